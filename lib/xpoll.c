@@ -37,33 +37,116 @@
  * To use xpoll(3), one must first call xpoll_create(3) which returns a handle
  * to an xpoll(3) instance for use in subsequent xpoll(3) related calls.  This
  * handle should be passed to xpoll_destroy(3) when the caller is done with it.
+ * Alternatively, xpoll_init(3) initializes a caller provided instance whose
+ * tables are carved from caller provided storage, sized by
+ * xpoll_storage_size(3), and xpoll_fini(3) releases it.
  *
  * xpoll_ctl(3) associates poll events with a given file descriptor.  It is
  * analogous to epoll_ctl(2) and kevent(2) with respect to adding and enabling
- * events on a per file descriptor basis.  Currently, the event types are POLLIN
- * and POLLOUT, and the operations are XPOLL_ADD, XPOLL_DELETE, XPOLL_ENABLE,
- * and XPOLL_DISABLE.
+ * events on a per file descriptor basis.  Currently, the event types are POLLIN,
+ * POLLOUT, and POLLERR, and the operations are XPOLL_ADD, XPOLL_DELETE,
+ * XPOLL_ENABLE, and XPOLL_DISABLE.
+ *
+ * xpoll_accept_batch(3) accepts as many pending connections as are ready on
+ * a listening socket and registers each with the xpoll instance.
+ *
+ * xpoll_dgram_recv(3) drains a ready datagram socket in batches via
+ * recvmmsg(2), while xpoll_dgram_queue(3) and xpoll_dgram_flush(3) send
+ * queued datagrams in batches via sendmmsg(2), using UDP GRO and GSO
+ * where available and requested.
+ *
+ * xpoll_relay_init(3) pairs two fds such that xpoll_relay_event(3) moves
+ * bytes between them through a pipe via splice(2) (or through a user
+ * buffer where splice(2) isn't available), arming POLLIN and POLLOUT on
+ * each fd according to how full each pipe is.
+ *
+ * xpoll_zc_send(3) sends from a caller's buffer with MSG_ZEROCOPY, and
+ * xpoll_zc_complete(3) consumes the completion notifications signaled
+ * by POLLERR, releasing each buffer once the kernel is done with it.
+ *
+ * xpoll_write(3) appends a reference to a caller's buffer to a per-fd
+ * write queue, which xpoll_wait() flushes with a single writev(2) per fd
+ * per loop iteration, enabling POLLOUT only while data remain queued.
+ * xpoll_wq_link(3) applies backpressure by disabling POLLIN on an upstream
+ * fd while the queue of its downstream fd is above a high watermark.
+ *
+ * xpoll_fibers_init(3) runs stackful fibers (e.g., thread-per-connection
+ * style code) on a single xpoll instance: xpoll_fiber_read(3) and
+ * xpoll_fiber_write(3) look blocking to the fiber, but switch back to
+ * xpoll_fibers_run(3) upon EAGAIN until the fd is ready.
+ *
+ * xpoll_handles_init(3) switches an xpoll instance to generational handles:
+ * xpoll_ctl(3) is given handles from xpoll_handle_alloc(3) rather than
+ * raw pointers, and xpoll_revents(3) drops events for handles which have
+ * since been freed by xpoll_handle_free(3).
+ *
+ * xpoll_slab_init(3) creates a slab allocator of fixed size objects with
+ * per-thread caches.  Once attached to an xpoll instance by
+ * xpoll_slab_attach(3), xpoll_add_obj(3) allocates an object and adds a
+ * fd with the object as its data, and deleting the fd (or closing it via
+ * xpoll_close(3)) releases the object at the next xpoll_wait(3).
+ *
+ * xpoll_fd(3) returns a fd which polls readable while the instance has
+ * ready events, such that one instance may be nested in another.
+ *
+ * xpoll_rwdata_init(3) gives each fd separate data for reading and for
+ * writing, such that xpoll_revents(3) returns each direction's events
+ * with that direction's data.
+ *
+ * xpoll_hook(3) installs functions to be called by xpoll_wait() just
+ * before it polls and just after, e.g., to batch work once per loop
+ * iteration.
  *
  * To poll for events one must call xpoll_wait().  xpoll() has the same general
  * sematics as poll(2), but may vary somewhat depending upon which underlying
  * implementation is in use.  In order to retrieve all currently ready events,
  * xpoll_revents() should be called until it returns zero.
  *
+ * When compiled with XPOLL_STATS defined to 1, every system call made by
+ * xpoll(3) is counted and timed per call site, see xpoll_stats_print().
+ *
  * Compile this file with the accompanying main.c to generate a simple test
  * program that illustrates how much more efficent epoll(7)/kqueue(2) are
  * than poll(2).
  */
+#if __linux__
+#define _GNU_SOURCE     // for accept4(), recvmmsg(), sendmmsg(), and splice()
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <time.h>
 
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <sys/mman.h>
+
+#if __linux__
+#include <linux/errqueue.h>
+#endif
+
+/*
+ * Fibers switch contexts with a few instructions of assembly where
+ * available, otherwise via swapcontext(3) (which also saves and
+ * restores the signal mask, i.e., makes a system call per switch).
+ */
+#if __x86_64__ && !XPOLL_FIBER_UCONTEXT
+#define XPOLL_FIBER_ASM     1
+#else
+#include <ucontext.h>
+#endif
 
 #include "xpoll.h"
 
@@ -71,257 +154,3523 @@
 #define NELEM(_array)   (sizeof(_array) / sizeof((_array)[0]))
 #endif
 
+#define XPOLL_CACHELINE     (64)
+#define XPOLL_NEVENTS       (128)       // eventv size for epoll and kqueue
+#define XPOLL_HUGEPAGE      (2ul << 20)
+
+#if XPOLL_STATS
+static inline uint64_t
+xpoll_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static inline void
+xpoll_stats_end(struct xpoll *xpoll, int site, uint64_t start, int rc)
+{
+    xpoll->stats.sitev[site].nsecs += xpoll_nsecs() - start;
+    xpoll->stats.sitev[site].calls++;
+
+    if (rc == -1)
+        xpoll->stats.sitev[site].errors++;
+}
+
+#define XPOLL_STATS_BEGIN(_start) \
+    uint64_t _start = xpoll_nsecs()
+
+#define XPOLL_STATS_END(_xpoll, _site, _start, _rc) \
+    xpoll_stats_end((_xpoll), (_site), (_start), (_rc))
+
+#else
+
+#define XPOLL_STATS_BEGIN(_start)
+#define XPOLL_STATS_END(_xpoll, _site, _start, _rc)
+#endif
+
 /*
- * Create an xpoll instance and event queue to be used to manage
- * a set of file descriptors.
+ * A write queue holds references to the caller's buffers in the order
+ * they were written.  The pending iovecs are kept contiguous in
+ * [head, tail) so that they can be passed directly to writev(2).
  */
-struct xpoll *
-xpoll_create(int fdmax)
+struct xpoll_wqent {
+    xpoll_wq_fn_t *release;
+    void *arg;
+};
+
+struct xpoll_wq {
+    struct iovec *iovv;
+    struct xpoll_wqent *entv;       // release callback of each iovec
+    unsigned int head;
+    unsigned int tail;
+    unsigned int cap;
+    size_t len;                     // bytes queued
+    int dirty;                      // fd is on the dirty list
+    int pollout;                    // POLLOUT enabled by the queue
+    int upfd;                       // fd throttled by this queue, or -1
+    int downfd;                     // fd whose queue throttles this one, or -1
+    int throttled;                  // POLLIN disabled on upfd
+    size_t lowat;
+    size_t hiwat;
+};
+
+#ifndef IOV_MAX
+#define IOV_MAX     (1024)
+#endif
+
+/*
+ * Discard everything queued.  The queue itself (and its place on the
+ * dirty list) is retained for reuse by the next fd with the same number.
+ */
+static void
+xpoll_wq_reset(struct xpoll_wq *wq)
 {
-    struct xpoll *xpoll;
+    for (unsigned int i = wq->head; i < wq->tail; ++i) {
+        if (wq->entv[i].release)
+            wq->entv[i].release(wq->entv[i].arg);
+    }
+
+    wq->head = wq->tail = 0;
+    wq->len = 0;
+    wq->pollout = 0;
+}
+
+static void
+xpoll_wq_free(struct xpoll_wq *wq)
+{
+    if (!wq)
+        return;
 
-    errno = 0;
+    xpoll_wq_reset(wq);
 
-    if (fdmax < 1) {
+    free(wq->iovv);
+    free(wq->entv);
+    free(wq);
+}
+
+/*
+ * Write as much of the fd's queue as it will take.  Returns 0 if the
+ * queue drained, 1 if some of it remains, or -1 on error.
+ */
+static int
+xpoll_wq_write(struct xpoll *xpoll, int fd, struct xpoll_wq *wq)
+{
+    (void)xpoll;
+
+    while (wq->head < wq->tail) {
+        unsigned int iovcnt = wq->tail - wq->head;
+        ssize_t cc;
+
+        if (iovcnt > IOV_MAX)
+            iovcnt = IOV_MAX;
+
+        XPOLL_STATS_BEGIN(start);
+
+        cc = writev(fd, wq->iovv + wq->head, iovcnt);
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_WRITEV, start, cc);
+
+        if (cc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            return -1;
+        }
+
+        wq->len -= cc;
+
+        /* Retire the fully written iovecs (including empty ones). */
+        while (wq->head < wq->tail) {
+            struct iovec *iov = wq->iovv + wq->head;
+
+            if ((size_t)cc < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + cc;
+                iov->iov_len -= cc;
+                break;
+            }
+
+            cc -= iov->iov_len;
+
+            if (wq->entv[wq->head].release)
+                wq->entv[wq->head].release(wq->entv[wq->head].arg);
+            ++wq->head;
+        }
+    }
+
+    wq->head = wq->tail = 0;
+
+    return 0;
+}
+
+/*
+ * Enable POLLOUT on fd while its queue is non-empty, and disable it
+ * once the queue drains.
+ */
+static int
+xpoll_wq_pollout(struct xpoll *xpoll, int fd, struct xpoll_wq *wq, int enable)
+{
+    if (wq->pollout == enable)
+        return 0;
+
+    wq->pollout = enable;
+
+    return xpoll_ctl(xpoll, enable ? XPOLL_ENABLE : XPOLL_DISABLE, POLLOUT, fd,
+                     xpoll->wdatav ? xpoll->wdatav[fd] : xpoll->datav[fd]);
+}
+
+/*
+ * Get fd's write queue, creating it (and the tables) if need be.
+ */
+static struct xpoll_wq *
+xpoll_wq_get(struct xpoll *xpoll, int fd)
+{
+    struct xpoll_wq *wq;
+
+    if (fd < 0 || fd >= xpoll->fdmax) {
         errno = EINVAL;
         return NULL;
     }
 
-    xpoll = calloc(1, sizeof(*xpoll));
-    if (!xpoll)
-        return NULL;
+    if (!xpoll->wqv) {
+        xpoll->wqv = calloc(xpoll->fdmax, sizeof(*xpoll->wqv));
+        xpoll->dirtyv = malloc(xpoll->fdmax * sizeof(*xpoll->dirtyv));
+
+        if (!xpoll->wqv || !xpoll->dirtyv) {
+            free(xpoll->wqv);
+            free(xpoll->dirtyv);
+            xpoll->wqv = NULL;
+            xpoll->dirtyv = NULL;
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
 
-    xpoll->fdmax = fdmax + 128;
+    wq = xpoll->wqv[fd];
+    if (!wq) {
+        wq = calloc(1, sizeof(*wq));
+        if (!wq)
+            return NULL;
 
-#if !XPOLL_KQUEUE
-    xpoll->fds = calloc(xpoll->fdmax, sizeof(*xpoll->fds));
-    if (!xpoll->fds)
-        goto errout;
+        wq->upfd = wq->downfd = -1;
+        xpoll->wqv[fd] = wq;
+    }
 
-    for (int i = 0; i < xpoll->fdmax; ++i)
-        xpoll->fds[i].fd = -1;
-#endif
+    return wq;
+}
 
-#if XPOLL_EPOLL || XPOLL_KQUEUE
-    xpoll->nfds = 128;
-    xpoll->eventv = calloc(xpoll->nfds, sizeof(*xpoll->eventv));
-    if (!xpoll->eventv)
-        goto errout;
+/*
+ * Disable POLLIN on the queue's upstream fd once the queue grows beyond
+ * its high watermark, and re-enable it once the queue drains to its low
+ * watermark.
+ */
+static int
+xpoll_wq_throttle(struct xpoll *xpoll, struct xpoll_wq *wq)
+{
+    int upfd = wq->upfd;
 
-#else
-    xpoll->datav = calloc(xpoll->fdmax, sizeof(*xpoll->datav));
-    if (!xpoll->datav)
-        goto errout;
+    if (upfd < 0)
+        return 0;
 
-    xpoll->eventv = xpoll->fds;
-#endif
+    if (!wq->throttled && wq->len > wq->hiwat) {
+        wq->throttled = 1;
+        return xpoll_ctl(xpoll, XPOLL_DISABLE, POLLIN, upfd, xpoll->datav[upfd]);
+    }
 
-#if XPOLL_EPOLL
-    xpoll->fd = epoll_create1(0);
-#elif XPOLL_KQUEUE
-    xpoll->fd = kqueue();
-#else
-    xpoll->fd = -1;
-#endif
+    if (wq->throttled && wq->len <= wq->lowat) {
+        wq->throttled = 0;
+        return xpoll_ctl(xpoll, XPOLL_ENABLE, POLLIN, upfd, xpoll->datav[upfd]);
+    }
 
-  errout:
-    if (errno) {
-        int xerrno = errno;
+    return 0;
+}
 
-        xpoll_destroy(xpoll);
-        errno = xerrno;
-        xpoll = NULL;
+/*
+ * Called when the queue's fd is deleted.  Discard the queue, and break
+ * any watermark link in which it participates.  If it was throttling
+ * its upstream fd then POLLIN is re-enabled there, whereas an upstream
+ * fd which is deleted simply leaves its downstream queue unlinked.
+ */
+static void
+xpoll_wq_unlink(struct xpoll *xpoll, struct xpoll_wq *wq)
+{
+    if (wq->downfd >= 0) {
+        struct xpoll_wq *down = xpoll->wqv[wq->downfd];
+
+        down->upfd = -1;
+        down->throttled = 0;
+        wq->downfd = -1;
     }
 
-    return xpoll;
+    if (wq->upfd >= 0) {
+        int upfd = wq->upfd;
+
+        if (wq->throttled)
+            xpoll_ctl(xpoll, XPOLL_ENABLE, POLLIN, upfd, xpoll->datav[upfd]);
+
+        xpoll->wqv[upfd]->downfd = -1;
+        wq->upfd = -1;
+        wq->throttled = 0;
+    }
+
+    xpoll_wq_reset(wq);
 }
 
-void
-xpoll_destroy(struct xpoll *xpoll)
+/*
+ * Flush every queue written since the last call.  Queues which cannot
+ * be drained (including those which encountered an error) are left to
+ * POLLOUT, in response to which the caller's xpoll_flush() resumes the
+ * flush (or reports the error).
+ */
+static void
+xpoll_wq_flushall(struct xpoll *xpoll)
 {
-    if (xpoll) {
-        close(xpoll->fd);
+    for (int i = 0; i < xpoll->dirtyc; ++i) {
+        int fd = xpoll->dirtyv[i];
+        struct xpoll_wq *wq = xpoll->wqv[fd];
 
-#if !XPOLL_KQUEUE
-        free(xpoll->fds);
-        free(xpoll->datav);
-#endif
+        wq->dirty = 0;
 
-#if XPOLL_EPOLL || XPOLL_KQUEUE
-        free(xpoll->eventv);
-#endif
+        if (wq->pollout || wq->head == wq->tail)
+            continue;
+
+        if (xpoll_wq_write(xpoll, fd, wq))
+            xpoll_wq_pollout(xpoll, fd, wq, 1);
 
-        free(xpoll);
+        xpoll_wq_throttle(xpoll, wq);
     }
+
+    xpoll->dirtyc = 0;
 }
 
+#if !XPOLL_EPOLL && !XPOLL_KQUEUE
 /*
- * Similar to epoll_ctl() and kevent(), allows caller to add or delete
- * file descriptors to the xpoll event queue, and to enable or disable
- * reception of POLLIN and/or POLLOUT events on those descriptors.
+ * poll(2) has no kernel object to nest, so xpoll_fd() returns the read
+ * end of a pipe that never becomes readable by itself, and the instance
+ * is put on a list such that xpoll_ctl() can recognize its fd.  An
+ * xpoll_wait() on an instance with nested instances polls their fds
+ * along with its own, and reports a nested instance's fd readable if
+ * any of its fds (or those of instances nested in it) are ready.
+ *
+ * The combined poll(2) set is cached by each parent and rebuilt only
+ * once its stamp (see xpoll_nest_stamp()) has moved on, i.e., after an
+ * xpoll_ctl() on an instance nested in it, or one which changed its
+ * own children or their placeholders.  Generations are drawn from
+ * xpoll_nestgen, such that the stamp increases with every such change.
+ * xpoll_nestlock protects the list and every instance's childv.
  */
-int
-xpoll_ctl(struct xpoll *xpoll, int op, int events, int fd, void *data)
+static struct xpoll *xpoll_nestl;
+static int xpoll_nestlock;
+static unsigned long xpoll_nestgen;
+
+static inline void
+xpoll_nest_lock(void)
 {
-    int rc = 0;
+    while (__atomic_exchange_n(&xpoll_nestlock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&xpoll_nestlock, __ATOMIC_RELAXED))
+            continue;
+}
 
-    if (fd < 0)
-        abort();
+static inline void
+xpoll_nest_unlock(void)
+{
+    __atomic_store_n(&xpoll_nestlock, 0, __ATOMIC_RELEASE);
+}
 
-#if !XPOLL_KQUEUE
-    struct pollfd *fds;
+static inline void
+xpoll_nest_bump(unsigned long *genp)
+{
+    __atomic_store_n(genp, __atomic_add_fetch(&xpoll_nestgen, 1, __ATOMIC_RELAXED),
+                     __ATOMIC_RELEASE);
+}
 
-    if (fd >= xpoll->fdmax) {
-        errno = EINVAL;
-        return -1;
-    }
+/*
+ * Return the instance whose placeholder is fd, if any.  The caller
+ * must hold xpoll_nestlock.
+ */
+static struct xpoll *
+xpoll_nest_find(int fd)
+{
+    struct xpoll *xpoll;
 
-    fds = xpoll->fds + fd;
+    for (xpoll = xpoll_nestl; xpoll; xpoll = xpoll->nest.next)
+        if (xpoll->fd == fd)
+            break;
 
-    fds->fd = (op == XPOLL_DELETE) ? -1 : fd;
+    return xpoll;
+}
 
-    events &= POLLIN | POLLOUT;
+/*
+ * Return true if target is xpoll or is nested (at any depth) in it.
+ * The caller must hold xpoll_nestlock.
+ */
+static int
+xpoll_nest_reaches(struct xpoll *xpoll, struct xpoll *target)
+{
+    if (xpoll == target)
+        return 1;
 
-    if (op == XPOLL_ADD || op == XPOLL_ENABLE)
-        fds->events |= events;
-    else if (op == XPOLL_DELETE || op == XPOLL_DISABLE)
-        fds->events &= ~events;
-#endif
+    for (int i = 0; i < xpoll->nest.childc; ++i)
+        if (xpoll_nest_reaches(xpoll->nest.childv[i], target))
+            return 1;
 
-#if XPOLL_EPOLL
-    struct xpollev change;
+    return 0;
+}
 
-    change.events = fds->events;
-    change.data.ptr = data;
+/*
+ * Record (or upon delete forget) that the instance whose placeholder
+ * is fd is nested in xpoll.  fd may be any fd, of course.  Also bump
+ * the generations that tell parents (and xpoll itself) that a cached
+ * poll(2) set including xpoll's fds or children is stale.
+ */
+static int
+xpoll_nest_ctl(struct xpoll *xpoll, int op, int fd)
+{
+    struct xpoll *child, **childv;
+    int rc = 0;
 
-    rc = epoll_ctl(xpoll->fd, op & 0xff, fd, &change);
+    /* xpoll's fds are cached by whichever instance it's nested in. */
+    if (xpoll->fd != -1)
+        xpoll_nest_bump(&xpoll->nest.gen);
 
-#elif XPOLL_KQUEUE
-    struct xpollev *change = xpoll->changev + xpoll->changec;
+    if (!xpoll_nestl)
+        return 0;
 
-    if (events & POLLIN) {
-        EV_SET(change, fd, EVFILT_READ, op, 0, 0, data);
-        ++change;
-    }
+    xpoll_nest_lock();
 
-    if (events & POLLOUT) {
-        EV_SET(change, fd, EVFILT_WRITE, op, 0, 0, data);
-        ++change;
+    for (int i = 0; i < xpoll->nest.childc; ++i) {
+        if (xpoll->nest.childv[i]->fd == fd) {
+            if (op == XPOLL_DELETE)
+                xpoll->nest.childv[i] = xpoll->nest.childv[--xpoll->nest.childc];
+            xpoll_nest_bump(&xpoll->nest.layoutgen);
+            goto unlock;
+        }
     }
 
-    xpoll->changec = change - xpoll->changev;
+    if (op != XPOLL_ADD)
+        goto unlock;
 
-    if ((size_t)xpoll->changec >= NELEM(xpoll->changev) - 1) {
-        rc = kevent(xpoll->fd, xpoll->changev, xpoll->changec, NULL, 0, NULL);
+    child = xpoll_nest_find(fd);
+    if (!child)
+        goto unlock;
 
-        xpoll->changec = 0;
+    if (xpoll_nest_reaches(child, xpoll)) {
+        errno = ELOOP;
+        rc = -1;
+        goto unlock;
     }
 
-#else
-    if (fd >= xpoll->nfds)
-        xpoll->nfds = fd + 1;
+    childv = realloc(xpoll->nest.childv,
+                     (xpoll->nest.childc + 1) * sizeof(*childv));
+    if (!childv) {
+        rc = -1;
+        goto unlock;
+    }
 
-    xpoll->datav[fd] = data;
-#endif
+    childv[xpoll->nest.childc++] = child;
+    xpoll->nest.childv = childv;
+    xpoll_nest_bump(&xpoll->nest.layoutgen);
+
+  unlock:
+    xpoll_nest_unlock();
 
     return rc;
 }
 
 /*
- * Similar to epoll_wait() and poll(), returns the number of file
- * descriptors in the xpoll object that are ready for reading or
- * writing.
+ * Return true if xpoll is polling the placeholder of the nested instance
+ * child for POLLIN.  Otherwise child's readiness cannot be reported, so
+ * its fds mustn't be polled either (lest poll(2) return at once, with
+ * nothing to report, for as long as one of them is ready).
  */
-int
-xpoll_wait(struct xpoll *xpoll, int timeout)
+static inline int
+xpoll_nest_polled(const struct xpoll *xpoll, const struct xpoll *child)
 {
-    xpoll->n = 0;
+    const struct pollfd *fds = xpoll->fds + child->fd;
 
-#if XPOLL_EPOLL
-    xpoll->nrdy = epoll_wait(xpoll->fd, xpoll->eventv, xpoll->nfds, timeout);
+    return fds->fd >= 0 && (fds->events & POLLIN);
+}
 
-#elif XPOLL_KQUEUE
-    struct timespec tsbuf, *ts = NULL;
+/*
+ * Return the latest generation among xpoll's layout and the instances
+ * nested in it (recursively).  As every generation is drawn afresh from
+ * xpoll_nestgen this moves on whenever any of them changes, and only
+ * then.  The caller must hold xpoll_nestlock.
+ */
+static unsigned long
+xpoll_nest_stamp(struct xpoll *xpoll, unsigned long stamp)
+{
+    for (int i = 0; i < xpoll->nest.childc; ++i) {
+        struct xpoll *child = xpoll->nest.childv[i];
+        unsigned long gen = __atomic_load_n(&child->nest.gen, __ATOMIC_ACQUIRE);
 
-    if (timeout >= 0) {
-        tsbuf.tv_sec = timeout / 1000;
-        tsbuf.tv_nsec = (timeout * 1000000) % 1000000;
-        ts = &tsbuf;
+        if (gen > stamp)
+            stamp = gen;
+
+        stamp = xpoll_nest_stamp(child, stamp);
     }
 
-    xpoll->nrdy = kevent(xpoll->fd, xpoll->changev, xpoll->changec,
-                         xpoll->eventv, xpoll->nfds, ts);
+    return stamp;
+}
 
-    xpoll->changec = 0;
+/*
+ * Copy the live fds of the instances nested in xpoll (recursively) into
+ * fdv at off (or just count them if fdv is NULL), returning the new off.
+ * Only live fds are copied, as poll(2) fails with EINVAL given more fds
+ * than RLIMIT_NOFILE, which the sum of sparse tables easily exceeds.
+ * Instances whose placeholder xpoll isn't polling for POLLIN are skipped.
+ * ownerv records for each fd the index of the top level child (i.e.,
+ * in the outermost xpoll's childv) whose placeholder it makes readable.
+ * The caller must hold xpoll_nestlock.
+ */
+static size_t
+xpoll_nest_gather(struct xpoll *xpoll, struct pollfd *fdv, int *ownerv,
+                  size_t off, int owner)
+{
+    for (int i = 0; i < xpoll->nest.childc; ++i) {
+        struct xpoll *child = xpoll->nest.childv[i];
+        int idx = (owner < 0) ? i : owner;
+
+        if (!xpoll_nest_polled(xpoll, child))
+            continue;
+
+        for (int j = 0; j < child->nfds; ++j) {
+            if (child->fds[j].fd >= 0) {
+                if (fdv) {
+                    fdv[off] = child->fds[j];
+                    ownerv[off] = idx;
+                }
+                ++off;
+            }
+        }
 
-#else
-    xpoll->nrdy = poll(xpoll->eventv, xpoll->nfds, timeout);
-#endif
+        off = xpoll_nest_gather(child, fdv, ownerv, off, idx);
+    }
 
-    return xpoll->nrdy;
+    return off;
 }
 
 /*
- * xpoll_revents() should be called in a loop after xpoll_wait()
- * returns that one or more descriptors have pending events.
- * On each successive call, xpoll_revents() will return the
- * pending eventmask and the user data for each descriptor
- * (as associated by xpoll_ctl()) that has a pending event.
+ * poll(2) xpoll's fds along with those of the instances nested in it,
+ * and mark the placeholder of each child with a ready fd as readable.
  */
-int
-xpoll_revents(struct xpoll *xpoll, void **datap)
+static int
+xpoll_nest_poll(struct xpoll *xpoll, int timeout)
 {
-    struct xpollev *event;
+    unsigned long stamp;
+    struct pollfd *fdv;
+    size_t len;
+    int nrdy;
 
-    *datap = NULL;
+    xpoll_nest_lock();
 
-    if (xpoll->nrdy < 1)
-        return 0;
+    /* Taken before gathering, such that a concurrent change forces a rebuild. */
+    stamp = xpoll_nest_stamp(xpoll, xpoll->nest.layoutgen);
 
-#if XPOLL_EPOLL
-    event = xpoll->eventv + xpoll->n;
-    *datap = event->data.ptr;
+    if (!xpoll->nest.fdv || xpoll->nest.stamp != stamp ||
+        xpoll->nest.nfds != xpoll->nfds) {
+        len = xpoll_nest_gather(xpoll, NULL, NULL, xpoll->nfds, -1);
 
-    --xpoll->nrdy;
-    ++xpoll->n;
+        if (len > xpoll->nest.fdmax) {
+            int *ownerv;
 
-    return event->events;
+            fdv = realloc(xpoll->nest.fdv, len * sizeof(*fdv));
+            ownerv = fdv ? realloc(xpoll->nest.ownerv, len * sizeof(*ownerv)) : NULL;
 
-#elif XPOLL_KQUEUE
-    int events = 0;
+            if (fdv)
+                xpoll->nest.fdv = fdv;
+            if (ownerv)
+                xpoll->nest.ownerv = ownerv;
 
-    event = xpoll->eventv + xpoll->n;
+            if (!fdv || !ownerv) {
+                xpoll->nest.stamp = 0;
+                xpoll_nest_unlock();
+                return -1;
+            }
 
-    if (event->filter == EVFILT_READ)
-        events |= POLLIN;
-    else if (event->filter == EVFILT_WRITE)
-        events |= POLLOUT;
+            xpoll->nest.fdmax = len;
+        }
 
-    if (event->flags & EV_ERROR)
-        events |= POLLERR;
+        xpoll_nest_gather(xpoll, xpoll->nest.fdv, xpoll->nest.ownerv, xpoll->nfds, -1);
+        xpoll->nest.len = len;
+        xpoll->nest.nfds = xpoll->nfds;
+        xpoll->nest.stamp = stamp;
+    }
 
-    *datap = event->udata;
+    xpoll_nest_unlock();
 
-    --xpoll->nrdy;
-    ++xpoll->n;
+    fdv = xpoll->nest.fdv;
+    len = xpoll->nest.len;
 
-    return events;
+    memcpy(fdv, xpoll->fds, xpoll->nfds * sizeof(*xpoll->fds));
 
-#else
-    event = xpoll->eventv + xpoll->n;
+    nrdy = poll(fdv, len, timeout);
+    if (nrdy < 1)
+        return nrdy;
 
-    while (xpoll->n < xpoll->nfds) {
-        if (event->revents) {
-            *datap = xpoll->datav[xpoll->n];
-            --xpoll->nrdy;
-            ++xpoll->n;
-            return event->revents;
-        }
+    memcpy(xpoll->fds, fdv, xpoll->nfds * sizeof(*xpoll->fds));
+
+    xpoll_nest_lock();
+    for (size_t i = xpoll->nfds; i < len; ++i) {
+        if (fdv[i].revents && xpoll->nest.ownerv[i] < xpoll->nest.childc) {
+            struct xpoll *child = xpoll->nest.childv[xpoll->nest.ownerv[i]];
 
-        ++xpoll->n;
-        ++event;
+            xpoll->fds[child->fd].revents |= POLLIN;
+        }
     }
+    xpoll_nest_unlock();
 
-    return 0; // Should never get here..
-#endif
+    nrdy = 0;
+    for (int i = 0; i < xpoll->nfds; ++i)
+        nrdy += (xpoll->fds[i].revents != 0);
+
+    return nrdy;
 }
+#endif
+
+/*
+ * Carve len bytes from the cache line aligned cursor *offp into *ptrp
+ * (if base is not NULL), advancing the cursor.  Used both to size and
+ * to lay out the tables in the caller's storage.
+ */
+static void
+xpoll_carve(uint8_t *base, size_t *offp, void *ptrp, size_t len)
+{
+    if (base)
+        *(void **)ptrp = base + *offp;
+
+    *offp += (len + XPOLL_CACHELINE - 1) & ~(size_t)(XPOLL_CACHELINE - 1);
+}
+
+/*
+ * Lay out (or merely size, if base is NULL) the tables of an xpoll
+ * instance whose fdmax has already been adjusted.  The optional write
+ * queue and slab tables are those requested by flags.
+ */
+static size_t
+xpoll_layout(struct xpoll *xpoll, uint8_t *base, int fdmax, int flags)
+{
+    size_t off = 0;
+
+#if !XPOLL_KQUEUE
+    xpoll_carve(base, &off, &xpoll->fds, fdmax * sizeof(*xpoll->fds));
+#endif
+
+    xpoll_carve(base, &off, &xpoll->datav, fdmax * sizeof(*xpoll->datav));
+
+#if XPOLL_EPOLL || XPOLL_KQUEUE
+    xpoll_carve(base, &off, &xpoll->eventv, XPOLL_NEVENTS * sizeof(*xpoll->eventv));
+#endif
+
+    if (flags & XPOLL_INIT_WQ) {
+        xpoll_carve(base, &off, &xpoll->wqv, fdmax * sizeof(*xpoll->wqv));
+        xpoll_carve(base, &off, &xpoll->dirtyv, fdmax * sizeof(*xpoll->dirtyv));
+    }
+
+    if (flags & XPOLL_INIT_SLAB) {
+        xpoll_carve(base, &off, &xpoll->ownv, fdmax * sizeof(*xpoll->ownv));
+        xpoll_carve(base, &off, &xpoll->deferv, fdmax * sizeof(*xpoll->deferv));
+        xpoll_carve(base, &off, &xpoll->deferfdv, fdmax * sizeof(*xpoll->deferfdv));
+    }
+
+    if (flags & XPOLL_INIT_RWDATA)
+        xpoll_carve(base, &off, &xpoll->wdatav, fdmax * sizeof(*xpoll->wdatav));
+
+    return off;
+}
+
+/*
+ * Return the number of bytes of storage xpoll_init() requires for the
+ * given fdmax and flags, including slack to align the storage.
+ */
+size_t
+xpoll_storage_size(int fdmax, int flags)
+{
+    struct xpoll xpoll;
+
+    if (fdmax < 1)
+        return 0;
+
+    return xpoll_layout(&xpoll, NULL, fdmax + 128, flags) + XPOLL_CACHELINE - 1;
+}
+
+/*
+ * Initialize a caller provided xpoll instance whose tables are carved
+ * from the caller's storage (e.g., a static array, huge page, or NUMA
+ * local memory) of at least xpoll_storage_size(fdmax, flags) bytes,
+ * which must remain valid until xpoll_fini().  No memory is allocated
+ * here.  The storage is zeroed here, so every page of it is touched
+ * before the instance is used.
+ *
+ * Only the fd, event, and flag requested tables come from the storage.
+ * The following are still allocated (and freed by xpoll_fini()) on
+ * first use, so a caller that must not allocate after startup should
+ * exercise them before entering its event loop, or avoid them:
+ *
+ *   - the write queue and slab ownership tables, unless XPOLL_INIT_WQ
+ *     or XPOLL_INIT_SLAB was given, and the per-direction data table
+ *     unless XPOLL_INIT_RWDATA was given;
+ *   - each fd's write queue entry (xpoll_write()), whose iovec and
+ *     entry arrays also grow by realloc() as writes back up;
+ *   - the handle table (xpoll_handles_init());
+ *   - with the poll(2) backend, nesting state (xpoll_fd()), whose
+ *     child list and combined fd set grow by realloc() as instances
+ *     are nested.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_init(struct xpoll *xpoll, int fdmax, int flags,
+           void *storage, size_t len)
+{
+    uintptr_t base;
+    size_t need;
+
+    if (!xpoll || !storage || fdmax < 1 ||
+        flags & ~(XPOLL_INIT_WQ | XPOLL_INIT_SLAB | XPOLL_INIT_RWDATA)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    need = xpoll_storage_size(fdmax, flags);
+    if (len < need) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    memset(xpoll, 0, sizeof(*xpoll));
+    memset(storage, 0, need);
+
+    xpoll->storage = storage;
+    xpoll->storagesz = len;
+    xpoll->fdmax = fdmax + 128;
+
+    base = ((uintptr_t)storage + XPOLL_CACHELINE - 1) & ~(uintptr_t)(XPOLL_CACHELINE - 1);
+
+    xpoll_layout(xpoll, (uint8_t *)base, xpoll->fdmax, flags);
+
+#if !XPOLL_KQUEUE
+    for (int i = 0; i < xpoll->fdmax; ++i)
+        xpoll->fds[i].fd = -1;
+#endif
+
+#if XPOLL_EPOLL || XPOLL_KQUEUE
+    xpoll->nfds = XPOLL_NEVENTS;
+#else
+    xpoll->eventv = xpoll->fds;
+#endif
+
+#if XPOLL_EPOLL
+    xpoll->fd = epoll_create1(0);
+#elif XPOLL_KQUEUE
+    xpoll->fd = kqueue();
+#else
+    xpoll->fd = -1;
+#endif
+
+#if XPOLL_EPOLL || XPOLL_KQUEUE
+    if (xpoll->fd == -1)
+        return -1;
+#endif
+
+    return 0;
+}
+
+/*
+ * Free ptr unless it was carved from the caller's storage.
+ */
+static void
+xpoll_free(struct xpoll *xpoll, void *ptr)
+{
+    uintptr_t base = (uintptr_t)xpoll->storage;
+
+    if ((uintptr_t)ptr < base || (uintptr_t)ptr >= base + xpoll->storagesz)
+        free(ptr);
+}
+
+/*
+ * Disown the slab object of fd, which is being deleted.  Events for fd
+ * from the current xpoll_wait() batch may yet be dispatched with the
+ * object as their data, so it is returned to the slab only by the next
+ * xpoll_wait().  If fd already has a deferred object then fd has been
+ * deleted and re-added since that batch was retrieved, so its current
+ * object cannot appear in the batch and is freed straight away.
+ */
+static void
+xpoll_slab_defer(struct xpoll *xpoll, int fd)
+{
+    void *obj = xpoll->ownv[fd];
+
+    xpoll->ownv[fd] = NULL;
+
+    if (xpoll->deferv[fd]) {
+        xpoll_slab_free(xpoll->slab, obj);
+        return;
+    }
+
+    xpoll->deferv[fd] = obj;
+    xpoll->deferfdv[xpoll->deferc++] = fd;
+}
+
+/*
+ * Return the objects of all fds deleted since the last xpoll_wait()
+ * to the slab.
+ */
+static void
+xpoll_slab_release(struct xpoll *xpoll)
+{
+    while (xpoll->deferc > 0) {
+        int fd = xpoll->deferfdv[--xpoll->deferc];
+
+        xpoll_slab_free(xpoll->slab, xpoll->deferv[fd]);
+        xpoll->deferv[fd] = NULL;
+    }
+}
+
+/*
+ * Release everything held by an xpoll instance initialized by
+ * xpoll_init(), other than the instance itself and its storage.
+ */
+void
+xpoll_fini(struct xpoll *xpoll)
+{
+#if !XPOLL_EPOLL && !XPOLL_KQUEUE
+    if (xpoll->fd != -1) {
+        struct xpoll **prevp;
+
+        xpoll_nest_lock();
+        for (prevp = &xpoll_nestl; *prevp; prevp = &(*prevp)->nest.next) {
+            if (*prevp == xpoll) {
+                *prevp = xpoll->nest.next;
+                break;
+            }
+        }
+        xpoll_nest_unlock();
+
+        close(xpoll->nest.wfd);
+    }
+
+    free(xpoll->nest.childv);
+    free(xpoll->nest.fdv);
+    free(xpoll->nest.ownerv);
+#endif
+
+    if (xpoll->fd != -1)
+        close(xpoll->fd);
+
+    if (xpoll->wqv) {
+        for (int fd = 0; fd < xpoll->fdmax; ++fd)
+            xpoll_wq_free(xpoll->wqv[fd]);
+        xpoll_free(xpoll, xpoll->wqv);
+        xpoll_free(xpoll, xpoll->dirtyv);
+    }
+
+    if (xpoll->slab)
+        xpoll_slab_release(xpoll);
+
+    xpoll_free(xpoll, xpoll->handlev);
+    xpoll_free(xpoll, xpoll->ownv);
+    xpoll_free(xpoll, xpoll->deferv);
+    xpoll_free(xpoll, xpoll->deferfdv);
+    xpoll_free(xpoll, xpoll->wdatav);
+}
+
+/*
+ * Map len bytes (rounded up to a multiple of the huge page size) for
+ * the tables of an xpoll instance, preferably from the hugetlb pool,
+ * otherwise huge page aligned and advised for transparent huge pages.
+ * Returns NULL if the memory couldn't be mapped at all.
+ */
+static void *
+xpoll_map_huge(size_t *lenp, int *hugep)
+{
+    size_t len = (*lenp + XPOLL_HUGEPAGE - 1) & ~(XPOLL_HUGEPAGE - 1);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    uint8_t *mem, *end, *base;
+
+#ifdef MAP_HUGETLB
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+    if (mem != MAP_FAILED) {
+        *hugep = XPOLL_HUGE_TLB;
+        *lenp = len;
+        return mem;
+    }
+#endif
+
+#ifdef MAP_ALIGNED_SUPER
+    flags |= MAP_ALIGNED_SUPER;
+#endif
+
+    /*
+     * Over-map by a huge page and trim both ends such that the region
+     * is huge page aligned and so eligible for promotion.
+     */
+    mem = mmap(NULL, len + XPOLL_HUGEPAGE, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    base = (uint8_t *)(((uintptr_t)mem + XPOLL_HUGEPAGE - 1) & ~(XPOLL_HUGEPAGE - 1));
+    end = mem + len + XPOLL_HUGEPAGE;
+
+    if (base > mem)
+        munmap(mem, base - mem);
+    if (end > base + len)
+        munmap(base + len, end - (base + len));
+
+    *hugep = XPOLL_HUGE_NONE;
+
+#ifdef MADV_HUGEPAGE
+    if (!madvise(base, len, MADV_HUGEPAGE))
+        *hugep = XPOLL_HUGE_THP;
+#elif defined(MAP_ALIGNED_SUPER)
+    *hugep = XPOLL_HUGE_THP;
+#endif
+
+    *lenp = len;
+
+    return base;
+}
+
+/*
+ * Create an xpoll instance and event queue to be used to manage
+ * a set of file descriptors.  The instance and its tables share a
+ * single allocation.
+ */
+struct xpoll *
+xpoll_create(int fdmax)
+{
+    return xpoll_create_flags(fdmax, 0);
+}
+
+/*
+ * Like xpoll_create(), but with the optional tables given by flags
+ * (see xpoll_init()).  With XPOLL_INIT_HUGE the instance and its tables
+ * are backed by huge pages to reduce TLB misses from random per-event
+ * access to large fd tables, falling back to base pages if need be.
+ * xpoll->huge records which (if any) kind of huge pages was obtained.
+ */
+struct xpoll *
+xpoll_create_flags(int fdmax, int flags)
+{
+    struct xpoll *xpoll = NULL;
+    size_t hdrsz, len, mapsz;
+    int huge = XPOLL_HUGE_NONE;
+
+    if (fdmax < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    hdrsz = (sizeof(*xpoll) + XPOLL_CACHELINE - 1) & ~(size_t)(XPOLL_CACHELINE - 1);
+    len = xpoll_storage_size(fdmax, flags & ~XPOLL_INIT_HUGE);
+    mapsz = 0;
+
+    if (flags & XPOLL_INIT_HUGE) {
+        mapsz = hdrsz + len;
+        xpoll = xpoll_map_huge(&mapsz, &huge);
+        if (!xpoll)
+            mapsz = 0;
+    }
+
+    if (!xpoll && posix_memalign((void **)&xpoll, XPOLL_CACHELINE, hdrsz + len))
+        return NULL;
+
+    if (xpoll_init(xpoll, fdmax, flags & ~XPOLL_INIT_HUGE,
+                   (uint8_t *)xpoll + hdrsz, len)) {
+        int xerrno = errno;
+
+        if (mapsz)
+            munmap(xpoll, mapsz);
+        else
+            free(xpoll);
+        errno = xerrno;
+        return NULL;
+    }
+
+    xpoll->mapsz = mapsz;
+    xpoll->huge = huge;
+
+    return xpoll;
+}
+
+void
+xpoll_destroy(struct xpoll *xpoll)
+{
+    if (xpoll) {
+        xpoll_fini(xpoll);
+
+        if (xpoll->mapsz)
+            munmap(xpoll, xpoll->mapsz);
+        else
+            free(xpoll);
+    }
+}
+
+/*
+ * Return a fd which polls readable while the xpoll instance has ready
+ * events, such that it may be added (for POLLIN) to another instance,
+ * e.g., to let a library keep a private set of fds which the caller's
+ * loop only looks at, via xpoll_wait(xpoll, 0), once it's signaled.
+ * The fd belongs to the instance and must not be closed by the caller.
+ *
+ * Queued writes and pre-wait hooks of the instance are run only by its
+ * own xpoll_wait().  Under poll(2) the nesting is emulated (see above):
+ * the fd is meaningful only to another xpoll instance, from which it
+ * must be deleted before the nested instance is destroyed.
+ *
+ * Returns the fd on success, otherwise -1 with errno set.
+ */
+int
+xpoll_fd(struct xpoll *xpoll)
+{
+#if !XPOLL_EPOLL && !XPOLL_KQUEUE
+    int pipefd[2];
+
+    if (xpoll->fd != -1)
+        return xpoll->fd;
+
+    if (pipe(pipefd))
+        return -1;
+
+    for (int i = 0; i < 2; ++i)
+        fcntl(pipefd[i], F_SETFD, FD_CLOEXEC);
+
+    xpoll->fd = pipefd[0];
+    xpoll->nest.wfd = pipefd[1];
+
+    xpoll_nest_lock();
+    xpoll->nest.next = xpoll_nestl;
+    xpoll_nestl = xpoll;
+    xpoll_nest_unlock();
+#endif
+
+    return xpoll->fd;
+}
+
+/*
+ * Similar to epoll_ctl() and kevent(), allows caller to add or delete
+ * file descriptors to the xpoll event queue, and to enable or disable
+ * reception of POLLIN and/or POLLOUT events on those descriptors.
+ */
+int
+xpoll_ctl(struct xpoll *xpoll, int op, int events, int fd, void *data)
+{
+    int rc = 0;
+
+    if (fd < 0)
+        abort();
+
+    /* In rwdata mode the kernel's data is the fd, see xpoll_revents_rw(). */
+    if (xpoll->wdatav) {
+        if (fd >= xpoll->fdmax) {
+            errno = EINVAL;
+            return -1;
+        }
+
+        if (op == XPOLL_DELETE && xpoll->rwpend && xpoll->rwfd == fd)
+            xpoll->rwpend = 0;
+    }
+
+#if !XPOLL_KQUEUE
+    struct pollfd *fds;
+
+    if (fd >= xpoll->fdmax) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fds = xpoll->fds + fd;
+
+    fds->fd = (op == XPOLL_DELETE) ? -1 : fd;
+
+    /*
+     * POLLERR is accepted so that interest in the error queue (e.g.,
+     * zerocopy completions) can be expressed, but like poll(2) and
+     * epoll(7) error conditions are always reported regardless.
+     */
+    events &= POLLIN | POLLOUT | POLLERR;
+
+    if (op == XPOLL_ADD || op == XPOLL_ENABLE)
+        fds->events |= events;
+    else if (op == XPOLL_DELETE || op == XPOLL_DISABLE)
+        fds->events &= ~events;
+#endif
+
+#if XPOLL_EPOLL
+    struct xpollev change;
+
+    change.events = fds->events;
+    change.data.ptr = xpoll->wdatav ? (void *)(uintptr_t)fd : data;
+
+    XPOLL_STATS_BEGIN(start);
+
+    rc = epoll_ctl(xpoll->fd, op & 0xff, fd, &change);
+
+    XPOLL_STATS_END(xpoll,
+                    (op == XPOLL_ADD) ? XPOLL_SITE_CTL_ADD :
+                    (op == XPOLL_DELETE) ? XPOLL_SITE_CTL_DELETE :
+                    (op == XPOLL_ENABLE) ? XPOLL_SITE_CTL_ENABLE :
+                    XPOLL_SITE_CTL_DISABLE, start, rc);
+
+#elif XPOLL_KQUEUE
+    struct xpollev *change = xpoll->changev + xpoll->changec;
+    void *udata = xpoll->wdatav ? (void *)(uintptr_t)fd : data;
+
+    if (events & POLLIN) {
+        EV_SET(change, fd, EVFILT_READ, op, 0, 0, udata);
+        ++change;
+    }
+
+    if (events & POLLOUT) {
+        EV_SET(change, fd, EVFILT_WRITE, op, 0, 0, udata);
+        ++change;
+    }
+
+    xpoll->changec = change - xpoll->changev;
+
+    if ((size_t)xpoll->changec >= NELEM(xpoll->changev) - 1) {
+        XPOLL_STATS_BEGIN(start);
+
+        rc = kevent(xpoll->fd, xpoll->changev, xpoll->changec, NULL, 0, NULL);
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_CTL_FLUSH, start, rc);
+
+        xpoll->changec = 0;
+    }
+
+#else
+    if (fd >= xpoll->nfds)
+        xpoll->nfds = fd + 1;
+
+    rc = xpoll_nest_ctl(xpoll, op, fd);
+    if (rc) {
+        fds->fd = -1;
+        fds->events = 0;
+        return rc;
+    }
+#endif
+
+    /*
+     * Remember each fd's data pointer so that the write queue can
+     * toggle POLLOUT without the caller's help.  Under kqueue fds
+     * beyond fdmax are permitted, but cannot have write queues.
+     */
+    if (fd < xpoll->fdmax) {
+        if (op == XPOLL_DELETE && xpoll->ownv && xpoll->ownv[fd])
+            xpoll_slab_defer(xpoll, fd);
+
+        /*
+         * In rwdata mode data applies only to the directions given
+         * by events (POLLERR alone counts as the read direction).
+         */
+        if (!xpoll->wdatav || (events & ~POLLOUT) || !events)
+            xpoll->datav[fd] = data;
+        if (xpoll->wdatav && (events & POLLOUT))
+            xpoll->wdatav[fd] = data;
+
+        if (op == XPOLL_DELETE && xpoll->wqv && xpoll->wqv[fd])
+            xpoll_wq_unlink(xpoll, xpoll->wqv[fd]);
+    }
+
+    return rc;
+}
+
+/*
+ * Similar to epoll_wait() and poll(), returns the number of file
+ * descriptors in the xpoll object that are ready for reading or
+ * writing.
+ */
+int
+xpoll_wait(struct xpoll *xpoll, int timeout)
+{
+    if (xpoll->deferc > 0)
+        xpoll_slab_release(xpoll);
+
+    if (xpoll->prewait)
+        xpoll->prewait(xpoll, 0, xpoll->prewait_arg);
+
+    if (xpoll->dirtyc > 0)
+        xpoll_wq_flushall(xpoll);
+
+    xpoll->n = 0;
+    xpoll->rwpend = 0;
+
+    XPOLL_STATS_BEGIN(start);
+
+#if XPOLL_EPOLL
+    xpoll->nrdy = epoll_wait(xpoll->fd, xpoll->eventv, xpoll->nfds, timeout);
+
+#elif XPOLL_KQUEUE
+    struct timespec tsbuf, *ts = NULL;
+
+    if (timeout >= 0) {
+        tsbuf.tv_sec = timeout / 1000;
+        tsbuf.tv_nsec = (timeout * 1000000) % 1000000;
+        ts = &tsbuf;
+    }
+
+    xpoll->nrdy = kevent(xpoll->fd, xpoll->changev, xpoll->changec,
+                         xpoll->eventv, xpoll->nfds, ts);
+
+    xpoll->changec = 0;
+
+#else
+    if (xpoll->nest.childc > 0)
+        xpoll->nrdy = xpoll_nest_poll(xpoll, timeout);
+    else
+        xpoll->nrdy = poll(xpoll->eventv, xpoll->nfds, timeout);
+#endif
+
+#if XPOLL_STATS
+    XPOLL_STATS_END(xpoll, XPOLL_SITE_WAIT, start, xpoll->nrdy);
+
+    if (xpoll->nrdy > 0)
+        xpoll->stats.nevents += xpoll->nrdy;
+#endif
+
+    if (xpoll->postwait) {
+        int xerrno = errno;
+
+        xpoll->postwait(xpoll, xpoll->nrdy, xpoll->postwait_arg);
+        errno = xerrno;
+    }
+
+    return xpoll->nrdy;
+}
+
+/*
+ * Install fn as the given hook, replacing any previous one (fn may be
+ * NULL to remove it).  The XPOLL_HOOK_PREWAIT hook is called on entry
+ * to xpoll_wait(), before queued writes are flushed and before it may
+ * block, which makes it the place to do once per loop iteration what
+ * would otherwise be done once per event (e.g., flush corked writes,
+ * submit batched I/O, or update metrics).  The XPOLL_HOOK_POSTWAIT hook
+ * is called just before xpoll_wait() returns, with its return value
+ * (errno is preserved across the call).  The hooks may call any xpoll
+ * function other than xpoll_wait() and xpoll_revents().
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_hook(struct xpoll *xpoll, int which, xpoll_hook_t *fn, void *arg)
+{
+    switch (which) {
+    case XPOLL_HOOK_PREWAIT:
+        xpoll->prewait = fn;
+        xpoll->prewait_arg = arg;
+        break;
+
+    case XPOLL_HOOK_POSTWAIT:
+        xpoll->postwait = fn;
+        xpoll->postwait_arg = arg;
+        break;
+
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * xpoll_revents() should be called in a loop after xpoll_wait()
+ * returns that one or more descriptors have pending events.
+ * On each successive call, xpoll_revents() will return the
+ * pending eventmask and the user data for each descriptor
+ * (as associated by xpoll_ctl()) that has a pending event.
+ *
+ * This is the out-of-line copy of xpoll_revents_inline() (see xpoll.h),
+ * its name parenthesized so that it isn't expanded when built with
+ * XPOLL_INLINE.
+ */
+int
+(xpoll_revents)(struct xpoll *xpoll, void **datap)
+{
+    return xpoll_revents_inline(xpoll, datap);
+}
+
+/*
+ * Switch the xpoll instance to rwdata mode, in which each fd has
+ * separate data for reading and for writing (e.g., distinct reader
+ * and writer state machines for one socket).  This must be done
+ * before any fds are added (or use XPOLL_INIT_RWDATA), after which
+ * the data given to xpoll_ctl() applies only to the directions given
+ * by its events.  The portable way to set both is to add the fd for
+ * POLLIN | POLLOUT with the read data, and then enable or disable
+ * POLLOUT with the write data.  fds must be less than fdmax.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_rwdata_init(struct xpoll *xpoll)
+{
+    if (xpoll->wdatav)
+        return 0;
+
+    xpoll->wdatav = calloc(xpoll->fdmax, sizeof(*xpoll->wdatav));
+    if (!xpoll->wdatav)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Switch the xpoll instance to handle mode, with room for max handles
+ * live at once.  This must be done before any fds are added, after
+ * which the data argument of every xpoll_ctl() call must be a handle
+ * from xpoll_handle_alloc() (via XPOLL_HANDLE_DATA()).
+ *
+ * A handle may be freed while events for it remain queued (e.g., by
+ * another thread, or in the midst of processing a batch of events),
+ * in which case xpoll_revents() skips them.  Note that this protects
+ * the handle, not the object it refers to: an object should be freed
+ * only once the thread running the event loop can no longer be using
+ * it (e.g., from its pre-wait hook).
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_handles_init(struct xpoll *xpoll, uint32_t max)
+{
+    if (xpoll->handlev || max < 1 || max == UINT32_MAX ||
+        sizeof(void *) < sizeof(xpoll_handle_t)) {
+        errno = (sizeof(void *) < sizeof(xpoll_handle_t)) ? ENOTSUP : EINVAL;
+        return -1;
+    }
+
+    xpoll->handlev = malloc(sizeof(*xpoll->handlev) * max);
+    if (!xpoll->handlev)
+        return -1;
+
+    xpoll->handlemax = max;
+    xpoll->handlenext = 0;
+    xpoll->handlefree = UINT32_MAX;
+
+    return 0;
+}
+
+static inline void
+xpoll_handle_lock(struct xpoll *xpoll)
+{
+    while (__atomic_exchange_n(&xpoll->handlelock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&xpoll->handlelock, __ATOMIC_RELAXED))
+            continue;
+}
+
+static inline void
+xpoll_handle_unlock(struct xpoll *xpoll)
+{
+    __atomic_store_n(&xpoll->handlelock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Allocate a handle which refers to data.  Generations start at one
+ * such that a handle is never zero.
+ *
+ * The data is stored before the slot's new generation is published
+ * with a release store, pairing with the acquire load of the generation
+ * in xpoll_handle_lookup(), so that a lookup which matches the new
+ * handle also sees its data.  A reused slot therefore takes a fresh
+ * generation here, in addition to the one taken by xpoll_handle_free().
+ *
+ * Returns the handle on success, otherwise 0 with errno set.
+ */
+xpoll_handle_t
+xpoll_handle_alloc(struct xpoll *xpoll, void *data)
+{
+    struct xpoll_slot *slot;
+    uint32_t idx, gen;
+
+    if (!xpoll->handlev) {
+        errno = EINVAL;
+        return 0;
+    }
+
+    xpoll_handle_lock(xpoll);
+
+    idx = xpoll->handlefree;
+    if (idx != UINT32_MAX) {
+        slot = xpoll->handlev + idx;
+        xpoll->handlefree = slot->next;
+        gen = (slot->gen + 1) ? slot->gen + 1 : 1;
+    }
+    else if (xpoll->handlenext < xpoll->handlemax) {
+        idx = xpoll->handlenext;
+        slot = xpoll->handlev + idx;
+        gen = 1;
+    }
+    else {
+        xpoll_handle_unlock(xpoll);
+        errno = ENOSPC;
+        return 0;
+    }
+
+    __atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->gen, gen, __ATOMIC_RELEASE);
+
+    if (idx == xpoll->handlenext)
+        __atomic_store_n(&xpoll->handlenext, idx + 1, __ATOMIC_RELEASE);
+
+    xpoll_handle_unlock(xpoll);
+
+    return ((xpoll_handle_t)gen << 32) | idx;
+}
+
+/*
+ * Invalidate the handle, such that xpoll_revents() skips any events
+ * for it that are already queued.  The caller should also delete its
+ * fds from the xpoll instance (before or after).  May be called from
+ * any thread.
+ *
+ * Returns 0 on success, otherwise -1 with errno set to EINVAL if the
+ * handle isn't live.
+ */
+int
+xpoll_handle_free(struct xpoll *xpoll, xpoll_handle_t handle)
+{
+    uint32_t idx = (uint32_t)handle;
+    uint32_t gen = handle >> 32;
+    struct xpoll_slot *slot;
+
+    if (!xpoll->handlev || idx >= xpoll->handlemax) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    xpoll_handle_lock(xpoll);
+
+    slot = xpoll->handlev + idx;
+
+    if (idx >= xpoll->handlenext || slot->gen != gen) {
+        xpoll_handle_unlock(xpoll);
+        errno = EINVAL;
+        return -1;
+    }
+
+    /*
+     * Bump the generation before clearing the data, pairing with the
+     * fence in xpoll_handle_lookup().  Generation zero is skipped.
+     */
+    __atomic_store_n(&slot->gen, (gen + 1) ? gen + 1 : 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->data, NULL, __ATOMIC_RELAXED);
+
+    slot->next = xpoll->handlefree;
+    xpoll->handlefree = idx;
+
+    xpoll_handle_unlock(xpoll);
+
+    return 0;
+}
+
+/*
+ * Return the data to which the handle refers, or NULL if the handle
+ * has been freed.
+ */
+void *
+xpoll_handle_data(struct xpoll *xpoll, xpoll_handle_t handle)
+{
+    if (!xpoll->handlev)
+        return NULL;
+
+    return xpoll_handle_lookup(xpoll, handle);
+}
+
+/*
+ * Queue len bytes from buf for writing to fd, which must have been
+ * added to the xpoll instance with POLLOUT (enabled or not).  The data
+ * are not copied, so buf must remain valid until release(arg) is
+ * called (release may be NULL if that's not of interest).
+ *
+ * Queued data are not written immediately, rather every queue written
+ * since the last xpoll_wait() is flushed by the next xpoll_wait() before
+ * it polls, such that all the writes made to a fd within one iteration
+ * of the event loop are coalesced into a single writev(2).  If the fd
+ * won't take all of it, POLLOUT is enabled until the queue drains, in
+ * response to which the caller should call xpoll_flush().  While a
+ * queue is in use the caller must not enable or disable POLLOUT on its
+ * fd.  Deleting the fd from the xpoll instance discards its queue.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_write(struct xpoll *xpoll, int fd, const void *buf, size_t len,
+            xpoll_wq_fn_t *release, void *arg)
+{
+    struct xpoll_wq *wq;
+
+    wq = xpoll_wq_get(xpoll, fd);
+    if (!wq)
+        return -1;
+
+    if (wq->tail >= wq->cap) {
+        if (wq->head > 0) {
+            unsigned int n = wq->tail - wq->head;
+
+            memmove(wq->iovv, wq->iovv + wq->head, n * sizeof(*wq->iovv));
+            memmove(wq->entv, wq->entv + wq->head, n * sizeof(*wq->entv));
+            wq->head = 0;
+            wq->tail = n;
+        } else {
+            unsigned int cap = wq->cap ? wq->cap * 2 : 8;
+            struct iovec *iovv;
+            struct xpoll_wqent *entv;
+
+            iovv = realloc(wq->iovv, cap * sizeof(*iovv));
+            if (!iovv)
+                return -1;
+            wq->iovv = iovv;
+
+            entv = realloc(wq->entv, cap * sizeof(*entv));
+            if (!entv)
+                return -1;
+            wq->entv = entv;
+
+            wq->cap = cap;
+        }
+    }
+
+    wq->iovv[wq->tail].iov_base = (void *)buf;
+    wq->iovv[wq->tail].iov_len = len;
+    wq->entv[wq->tail].release = release;
+    wq->entv[wq->tail].arg = arg;
+    ++wq->tail;
+    wq->len += len;
+
+    if (!wq->dirty) {
+        wq->dirty = 1;
+        xpoll->dirtyv[xpoll->dirtyc++] = fd;
+    }
+
+    return xpoll_wq_throttle(xpoll, wq);
+}
+
+/*
+ * Write as much of fd's queue as it will take now, enabling POLLOUT
+ * if any remains and disabling it once the queue drains.  Call this in
+ * response to POLLOUT on a fd with a write queue, or to push queued
+ * data out before the next xpoll_wait().
+ *
+ * Returns the number of bytes which remain queued, otherwise -1 with
+ * errno set (in which case the queue is left intact).
+ */
+ssize_t
+xpoll_flush(struct xpoll *xpoll, int fd)
+{
+    struct xpoll_wq *wq;
+    int rc;
+
+    if (fd < 0 || fd >= xpoll->fdmax || !xpoll->wqv || !xpoll->wqv[fd])
+        return 0;
+
+    wq = xpoll->wqv[fd];
+
+    rc = xpoll_wq_write(xpoll, fd, wq);
+    if (rc == -1)
+        return -1;
+
+    if (xpoll_wq_pollout(xpoll, fd, wq, rc) || xpoll_wq_throttle(xpoll, wq))
+        return -1;
+
+    return wq->len;
+}
+
+/*
+ * Return the number of bytes queued for writing to fd.
+ */
+size_t
+xpoll_wqlen(struct xpoll *xpoll, int fd)
+{
+    if (fd < 0 || fd >= xpoll->fdmax || !xpoll->wqv || !xpoll->wqv[fd])
+        return 0;
+
+    return xpoll->wqv[fd]->len;
+}
+
+/*
+ * Link fd's write queue to the upstream fd upfd from which its data are
+ * read (e.g., the other side of a proxied connection), such that POLLIN
+ * is disabled on upfd while more than hiwat bytes are queued for fd,
+ * and re-enabled once no more than lowat bytes remain.  This bounds the
+ * data buffered per connection when fd's peer falls behind.  While
+ * linked, POLLIN on upfd belongs to xpoll and must not be enabled or
+ * disabled by the caller.  Each fd may throttle (and be throttled by)
+ * at most one other fd, which may be itself (e.g., an echo server).
+ * Pass -1 for upfd to remove the link, re-enabling POLLIN if need be.
+ * Deleting either fd from the xpoll instance also removes the link.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_wq_link(struct xpoll *xpoll, int fd, int upfd, size_t lowat, size_t hiwat)
+{
+    struct xpoll_wq *wq, *up;
+
+    if (lowat > hiwat) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    wq = xpoll_wq_get(xpoll, fd);
+    if (!wq)
+        return -1;
+
+    if (wq->upfd >= 0) {
+        int oldfd = wq->upfd;
+        int rc = 0;
+
+        if (wq->throttled)
+            rc = xpoll_ctl(xpoll, XPOLL_ENABLE, POLLIN, oldfd, xpoll->datav[oldfd]);
+
+        xpoll->wqv[oldfd]->downfd = -1;
+        wq->upfd = -1;
+        wq->throttled = 0;
+
+        if (rc)
+            return -1;
+    }
+
+    if (upfd < 0)
+        return 0;
+
+    up = xpoll_wq_get(xpoll, upfd);
+    if (!up)
+        return -1;
+
+    if (up->downfd >= 0) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    wq->upfd = upfd;
+    wq->lowat = lowat;
+    wq->hiwat = hiwat;
+    up->downfd = fd;
+
+    return xpoll_wq_throttle(xpoll, wq);
+}
+
+/*
+ * Each thread keeps a small cache of free objects per slab, such that
+ * most allocations and frees touch neither the lock nor the slab's
+ * free list.  Caches are indexed by each slab's tcidx.  Should more
+ * than XPOLL_SLAB_TCMAX slabs be in use at once, a slab which finds
+ * its index held by another returns that slab's cached objects to its
+ * free list (under its lock) before taking the index over.  Hence a
+ * slab's struct must not be freed while other threads which used it
+ * may still use slabs, other than via xpoll_slab_fini() followed by
+ * xpoll_slab_init().  Objects cached by a thread when it exits remain
+ * allocated until xpoll_slab_fini().
+ */
+#define XPOLL_SLAB_TCMAX    (16)
+#define XPOLL_SLAB_TCSZ     (32)
+
+struct xpoll_slab_tc {
+    struct xpoll_slab *slab;        // slab whose objects are cached
+    unsigned long serial;           // slab->serial when first cached
+    int n;
+    void *objv[XPOLL_SLAB_TCSZ];
+};
+
+static __thread struct xpoll_slab_tc xpoll_slab_tcv[XPOLL_SLAB_TCMAX];
+static unsigned long xpoll_slab_serial;
+
+static inline void
+xpoll_slab_lock(struct xpoll_slab *slab)
+{
+    while (__atomic_exchange_n(&slab->lock, 1, __ATOMIC_ACQUIRE))
+        while (__atomic_load_n(&slab->lock, __ATOMIC_RELAXED))
+            continue;
+}
+
+static inline void
+xpoll_slab_unlock(struct xpoll_slab *slab)
+{
+    __atomic_store_n(&slab->lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return the first n cached objects to the slab's free list.
+ */
+static void
+xpoll_slab_flush(struct xpoll_slab *slab, struct xpoll_slab_tc *tc, int n)
+{
+    void *head, *tail;
+
+    if (n < 1)
+        return;
+
+    head = tail = tc->objv[0];
+
+    for (int i = 1; i < n; ++i) {
+        *(void **)tc->objv[i] = head;
+        head = tc->objv[i];
+    }
+
+    memmove(tc->objv, tc->objv + n, (tc->n - n) * sizeof(tc->objv[0]));
+    tc->n -= n;
+
+    xpoll_slab_lock(slab);
+    *(void **)tail = slab->freel;
+    slab->freel = head;
+    xpoll_slab_unlock(slab);
+}
+
+static inline struct xpoll_slab_tc *
+xpoll_slab_tc(struct xpoll_slab *slab)
+{
+    struct xpoll_slab_tc *tc = xpoll_slab_tcv + slab->tcidx;
+
+    if (tc->serial != slab->serial) {
+
+        /*
+         * Evict the slab which held this index, unless it has since
+         * been finalized (its chunks, and hence the cached objects,
+         * are gone).
+         */
+        if (tc->n > 0 && tc->slab->serial == tc->serial)
+            xpoll_slab_flush(tc->slab, tc, tc->n);
+
+        tc->slab = slab;
+        tc->serial = slab->serial;
+        tc->n = 0;
+    }
+
+    return tc;
+}
+
+/*
+ * Initialize a slab of objects of objsz bytes, each aligned to align
+ * bytes (a power of two, zero for pointer alignment).  Align to the
+ * cache line size (64) to keep objects from sharing lines, or leave
+ * it small for the densest packing.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_slab_init(struct xpoll_slab *slab, size_t objsz, size_t align)
+{
+    memset(slab, 0, sizeof(*slab));
+
+    if (align < sizeof(void *))
+        align = sizeof(void *);
+
+    if (objsz < 1 || (align & (align - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    slab->align = align;
+    slab->objsz = (objsz + align - 1) & ~(align - 1);
+    slab->chunksz = 64 * 1024;
+
+    while (slab->chunksz < slab->objsz * 16 + align)
+        slab->chunksz *= 2;
+
+    slab->serial = __atomic_add_fetch(&xpoll_slab_serial, 1, __ATOMIC_RELAXED);
+    slab->tcidx = slab->serial % XPOLL_SLAB_TCMAX;
+
+    return 0;
+}
+
+/*
+ * Free every chunk of the slab, including all objects still allocated
+ * (or cached by any thread).
+ */
+void
+xpoll_slab_fini(struct xpoll_slab *slab)
+{
+    struct xpoll_slab_tc *tc = xpoll_slab_tcv + slab->tcidx;
+    void *chunk;
+
+    if (tc->slab == slab && tc->serial == slab->serial)
+        tc->n = 0;
+
+    while (( chunk = slab->chunks )) {
+        slab->chunks = *(void **)chunk;
+        free(chunk);
+    }
+
+    memset(slab, 0, sizeof(*slab));
+}
+
+/*
+ * Refill the thread cache with up to half its capacity of objects from
+ * the slab's free list, carving new objects from the newest chunk (and
+ * allocating a new chunk) as needed.
+ */
+static int
+xpoll_slab_refill(struct xpoll_slab *slab, struct xpoll_slab_tc *tc)
+{
+    xpoll_slab_lock(slab);
+
+    while (tc->n < XPOLL_SLAB_TCSZ / 2) {
+        void *obj = slab->freel;
+
+        if (obj) {
+            slab->freel = *(void **)obj;
+        }
+        else {
+            if (slab->carve + slab->objsz > slab->carveend) {
+                char *chunk;
+
+                if (posix_memalign((void **)&chunk, slab->align < 64 ? 64 : slab->align,
+                                   slab->chunksz))
+                    break;
+
+                /* The first align bytes link the chunk for fini. */
+                *(void **)chunk = slab->chunks;
+                slab->chunks = chunk;
+                slab->carve = chunk + slab->align;
+                slab->carveend = chunk + slab->chunksz;
+                ++slab->nchunks;
+            }
+
+            obj = slab->carve;
+            slab->carve += slab->objsz;
+        }
+
+        tc->objv[tc->n++] = obj;
+    }
+
+    xpoll_slab_unlock(slab);
+
+    if (tc->n < 1) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Allocate an (uninitialized) object from the slab.  May be called from
+ * any thread.
+ *
+ * Returns the object on success, otherwise NULL with errno set.
+ */
+void *
+xpoll_slab_alloc(struct xpoll_slab *slab)
+{
+    struct xpoll_slab_tc *tc = xpoll_slab_tc(slab);
+
+    if (tc->n < 1 && xpoll_slab_refill(slab, tc))
+        return NULL;
+
+    return tc->objv[--tc->n];
+}
+
+/*
+ * Return an object to the slab from which it was allocated.  May be
+ * called from any thread, not only the one which allocated it.
+ */
+void
+xpoll_slab_free(struct xpoll_slab *slab, void *obj)
+{
+    struct xpoll_slab_tc *tc = xpoll_slab_tc(slab);
+
+    if (!obj)
+        return;
+
+    /*
+     * Once the cache is full, return the older half of it to the
+     * slab's free list in one go.
+     */
+    if (tc->n >= XPOLL_SLAB_TCSZ)
+        xpoll_slab_flush(slab, tc, XPOLL_SLAB_TCSZ / 2);
+
+    tc->objv[tc->n++] = obj;
+}
+
+/*
+ * Attach a slab to the xpoll instance for use by xpoll_add_obj() and
+ * xpoll_accept_batch().  A slab may be shared by several xpoll
+ * instances (e.g., one per thread).  Not supported in handle mode.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_slab_attach(struct xpoll *xpoll, struct xpoll_slab *slab)
+{
+    if (xpoll->slab || xpoll->handlev || !slab) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!xpoll->ownv) {
+        xpoll->ownv = calloc(xpoll->fdmax, sizeof(*xpoll->ownv));
+        xpoll->deferv = calloc(xpoll->fdmax, sizeof(*xpoll->deferv));
+        xpoll->deferfdv = calloc(xpoll->fdmax, sizeof(*xpoll->deferfdv));
+
+        if (!xpoll->ownv || !xpoll->deferv || !xpoll->deferfdv) {
+            free(xpoll->ownv);
+            free(xpoll->deferv);
+            free(xpoll->deferfdv);
+            xpoll->ownv = NULL;
+            xpoll->deferv = NULL;
+            xpoll->deferfdv = NULL;
+            return -1;
+        }
+    }
+
+    xpoll->slab = slab;
+
+    return 0;
+}
+
+/*
+ * Allocate an object from the attached slab and add fd to the xpoll
+ * instance for the given events with the object as its data.  The
+ * object is uninitialized, and is owned by fd regardless of any data
+ * later given to xpoll_ctl() for fd.  It is released back to the slab
+ * by the first xpoll_wait() after fd is deleted (by XPOLL_DELETE or
+ * xpoll_close()), such that events for fd remaining in the current
+ * batch may still safely refer to it, but not thereafter.
+ *
+ * Returns the object on success, otherwise NULL with errno set.
+ */
+void *
+xpoll_add_obj(struct xpoll *xpoll, int events, int fd)
+{
+    void *obj;
+
+    if (!xpoll->slab || fd < 0 || fd >= xpoll->fdmax) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    obj = xpoll_slab_alloc(xpoll->slab);
+    if (!obj)
+        return NULL;
+
+    if (xpoll_ctl(xpoll, XPOLL_ADD, events, fd, obj)) {
+        int xerrno = errno;
+
+        xpoll_slab_free(xpoll->slab, obj);
+        errno = xerrno;
+
+        return NULL;
+    }
+
+    xpoll->ownv[fd] = obj;
+
+    return obj;
+}
+
+/*
+ * Delete fd from the xpoll instance (releasing its object, if any) and
+ * close it.
+ */
+int
+xpoll_close(struct xpoll *xpoll, int fd)
+{
+    xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, fd, NULL);
+
+    return close(fd);
+}
+
+/*
+ * Accept up to max pending connections on the non-blocking listening
+ * socket lfd (stopping early once accept would block), and register
+ * each accepted fd with the xpoll instance for the given events.  The
+ * accepted fds are non-blocking and close-on-exec.  The data pointer
+ * for each fd is obtained by calling datafn(fd, arg); if it returns
+ * NULL then the fd is closed and skipped.  If fdv is not NULL the
+ * accepted fds are stored there.
+ *
+ * If a slab is attached to the xpoll instance (see xpoll_slab_attach())
+ * each fd is instead registered with a new object from the slab, which
+ * is passed to datafn as datafn(fd, obj) for initialization in place
+ * of arg (which is then unused), and which is released when the fd is
+ * deleted.  datafn must then return obj (or NULL to reject the fd).
+ *
+ * On kqueue the registrations are batched into the changelist, which
+ * is submitted by the next call to xpoll_wait().  epoll(7) has no means
+ * to register several fds at once, so on epoll each fd still costs one
+ * epoll_ctl().
+ *
+ * Returns the number of connections accepted and registered, or -1 if
+ * an error occurred before any could be.  Errors encountered after at
+ * least one connection was accepted are left pending on the listener
+ * (or will recur on the next call).
+ */
+int
+xpoll_accept_batch(struct xpoll *xpoll, int lfd, int *fdv, int max,
+                   int events, xpoll_datafn_t *datafn, void *arg)
+{
+    int n = 0;
+
+    while (n < max) {
+        void *data;
+        int fd;
+
+        XPOLL_STATS_BEGIN(start);
+
+#ifdef SOCK_NONBLOCK
+        fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        fd = accept(lfd, NULL, NULL);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_ACCEPT, start, fd);
+
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return n > 0 ? n : -1;
+        }
+
+        if (xpoll->slab) {
+            data = xpoll_add_obj(xpoll, events, fd);
+            if (!data) {
+                int xerrno = errno;
+
+                close(fd);
+                errno = xerrno;
+
+                return n > 0 ? n : -1;
+            }
+
+            if (datafn && !datafn(fd, data)) {
+                xpoll_close(xpoll, fd);
+                continue;
+            }
+        }
+        else {
+            data = datafn ? datafn(fd, arg) : NULL;
+            if (datafn && !data) {
+                close(fd);
+                continue;
+            }
+
+            if (xpoll_ctl(xpoll, XPOLL_ADD, events, fd, data)) {
+                int xerrno = errno;
+
+                close(fd);
+                errno = xerrno;
+
+                return n > 0 ? n : -1;
+            }
+        }
+
+        if (fdv)
+            fdv[n] = fd;
+        ++n;
+    }
+
+    return n;
+}
+
+#ifdef UDP_SEGMENT
+#define XPOLL_DGRAM_CMSGSZ  CMSG_SPACE(sizeof(int))
+#define XPOLL_DGRAM_SEGMAX  (64)        // UDP_MAX_SEGMENTS
+#else
+#define XPOLL_DGRAM_CMSGSZ  (0)
+#endif
+
+/*
+ * Initialize a datagram batch for the socket fd.  Up to nbufs datagrams
+ * are received or sent per system call.  Each receive buffer is bufsz
+ * bytes, which should be at least 64KiB with XPOLL_DGRAM_GRO such that
+ * the kernel can coalesce several datagrams into one buffer.  flags
+ * may include XPOLL_DGRAM_GRO and/or XPOLL_DGRAM_GSO, which are quietly
+ * ignored if the platform doesn't support them.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_dgram_init(struct xpoll_dgram *dg, int fd, unsigned int nbufs,
+                 size_t bufsz, int flags)
+{
+    memset(dg, 0, sizeof(*dg));
+
+    if (nbufs < 1 || bufsz < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    dg->fd = fd;
+    dg->nbufs = nbufs;
+    dg->bufsz = bufsz;
+
+#ifdef UDP_GRO
+    if (flags & XPOLL_DGRAM_GRO) {
+        int one = 1;
+
+        if (!setsockopt(fd, IPPROTO_UDP, UDP_GRO, &one, sizeof(one)))
+            dg->flags |= XPOLL_DGRAM_GRO;
+    }
+#endif
+
+#ifdef UDP_SEGMENT
+    if (flags & XPOLL_DGRAM_GSO) {
+        struct sockaddr_storage ss;
+        socklen_t sslen = sizeof(ss);
+
+        /*
+         * A segmented message must fit in one IP datagram: the IPv4
+         * header counts against its 64KiB limit, the IPv6 header
+         * doesn't (though the UDP header does for both).
+         */
+        ss.ss_family = AF_INET;
+        getsockname(fd, (struct sockaddr *)&ss, &sslen);
+
+        dg->gsomax = (ss.ss_family == AF_INET6) ? 65535 - 8 : 65535 - 20 - 8;
+        dg->flags |= XPOLL_DGRAM_GSO;
+    }
+#endif
+
+    dg->bufv = malloc(nbufs * bufsz);
+    dg->rxmsgv = calloc(nbufs, sizeof(*dg->rxmsgv));
+    dg->rxiovv = calloc(nbufs, sizeof(*dg->rxiovv));
+    dg->addrv = calloc(nbufs, sizeof(*dg->addrv));
+    dg->txv = calloc(nbufs, sizeof(*dg->txv));
+    dg->txmsgv = calloc(nbufs, sizeof(*dg->txmsgv));
+    dg->txiovv = calloc(nbufs, sizeof(*dg->txiovv));
+    dg->cmsgv = calloc(nbufs, XPOLL_DGRAM_CMSGSZ + 1);
+    dg->txnsegv = calloc(nbufs, sizeof(*dg->txnsegv));
+    dg->txcmsgv = calloc(nbufs, XPOLL_DGRAM_CMSGSZ + 1);
+
+    if (!dg->bufv || !dg->rxmsgv || !dg->rxiovv || !dg->addrv ||
+        !dg->txv || !dg->txmsgv || !dg->txiovv || !dg->cmsgv ||
+        !dg->txnsegv || !dg->txcmsgv) {
+        xpoll_dgram_fini(dg);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+void
+xpoll_dgram_fini(struct xpoll_dgram *dg)
+{
+    free(dg->bufv);
+    free(dg->rxmsgv);
+    free(dg->rxiovv);
+    free(dg->addrv);
+    free(dg->txv);
+    free(dg->txmsgv);
+    free(dg->txiovv);
+    free(dg->cmsgv);
+    free(dg->txnsegv);
+    free(dg->txcmsgv);
+
+    memset(dg, 0, sizeof(*dg));
+    dg->fd = -1;
+}
+
+/*
+ * Receive datagrams from a ready socket in batches of up to nbufs per
+ * recvmmsg(2) until it would block, calling fn() once for each datagram
+ * received.  Datagrams coalesced by UDP GRO are split back into their
+ * original segments before being passed to fn().  The buffer passed
+ * to fn() is valid only until fn() returns.  If fn() returns non-zero
+ * then draining stops after the current batch.
+ *
+ * Returns the number of datagrams received, or -1 if an error occurred
+ * before any were received.
+ */
+int
+xpoll_dgram_recv(struct xpoll *xpoll, struct xpoll_dgram *dg,
+                 xpoll_dgram_fn_t *fn, void *arg)
+{
+    int total = 0;
+    int stop = 0;
+
+    (void)xpoll;
+
+    while (!stop) {
+        int n;
+
+        for (unsigned int i = 0; i < dg->nbufs; ++i) {
+            struct msghdr *hdr = &dg->rxmsgv[i].msg_hdr;
+
+            dg->rxiovv[i].iov_base = dg->bufv + i * dg->bufsz;
+            dg->rxiovv[i].iov_len = dg->bufsz;
+
+            hdr->msg_name = dg->addrv + i;
+            hdr->msg_namelen = sizeof(dg->addrv[i]);
+            hdr->msg_iov = dg->rxiovv + i;
+            hdr->msg_iovlen = 1;
+            hdr->msg_control = (dg->flags & XPOLL_DGRAM_GRO) ?
+                dg->cmsgv + i * XPOLL_DGRAM_CMSGSZ : NULL;
+            hdr->msg_controllen = hdr->msg_control ? XPOLL_DGRAM_CMSGSZ : 0;
+            hdr->msg_flags = 0;
+        }
+
+        XPOLL_STATS_BEGIN(start);
+
+        n = recvmmsg(dg->fd, dg->rxmsgv, dg->nbufs, MSG_DONTWAIT, NULL);
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_RECVMMSG, start, n);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return total > 0 ? total : -1;
+        }
+
+        for (int i = 0; i < n; ++i) {
+            struct msghdr *hdr = &dg->rxmsgv[i].msg_hdr;
+            size_t len = dg->rxmsgv[i].msg_len;
+            size_t segsz = len;
+            char *buf = dg->rxiovv[i].iov_base;
+
+#ifdef UDP_GRO
+            if (hdr->msg_controllen > 0) {
+                struct cmsghdr *cmsg;
+
+                for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+                    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        int gsosz;
+
+                        memcpy(&gsosz, CMSG_DATA(cmsg), sizeof(gsosz));
+                        if (gsosz > 0)
+                            segsz = gsosz;
+                    }
+                }
+            }
+#endif
+
+            while (len > 0) {
+                size_t seglen = (len < segsz) ? len : segsz;
+
+                if (fn(buf, seglen, (struct sockaddr *)hdr->msg_name,
+                       hdr->msg_namelen, arg))
+                    stop = 1;
+
+                buf += seglen;
+                len -= seglen;
+                ++total;
+            }
+        }
+
+        if ((unsigned int)n < dg->nbufs)
+            break;
+    }
+
+    return total;
+}
+
+/*
+ * Queue the datagram in buf for transmission by the next call to
+ * xpoll_dgram_flush().  The datagram is not copied, so buf (and addr,
+ * which may be NULL for a connected socket) must remain valid until
+ * it has been sent.  If the queue is full it is flushed first.
+ *
+ * Returns 0 on success, otherwise -1 with errno set (EAGAIN if the
+ * queue is full and the socket isn't writable).
+ */
+int
+xpoll_dgram_queue(struct xpoll *xpoll, struct xpoll_dgram *dg,
+                  const void *buf, size_t len,
+                  const struct sockaddr *addr, socklen_t addrlen)
+{
+    struct xpoll_dgram_tx *tx;
+
+    if (dg->txc >= dg->nbufs) {
+        int rc = xpoll_dgram_flush(xpoll, dg);
+
+        if (rc == -1)
+            return -1;
+
+        if (rc > 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    tx = dg->txv + dg->txc++;
+    tx->buf = buf;
+    tx->len = len;
+    tx->addr = addr;
+    tx->addrlen = addr ? addrlen : 0;
+
+    return 0;
+}
+
+#ifdef UDP_SEGMENT
+static int
+xpoll_dgram_samedst(const struct xpoll_dgram_tx *a, const struct xpoll_dgram_tx *b)
+{
+    if (a->addrlen != b->addrlen)
+        return 0;
+
+    return a->addr == b->addr || !memcmp(a->addr, b->addr, a->addrlen);
+}
+#endif
+
+/*
+ * Send as many queued datagrams as the socket will take, in batches of
+ * up to nbufs messages per sendmmsg(2).  With XPOLL_DGRAM_GSO each run
+ * of consecutive datagrams of the same length to the same destination
+ * (the last of which may be shorter) is sent as one message using
+ * UDP_SEGMENT, such that the kernel segments it.  Should the kernel
+ * reject a segmented message (e.g., its segment size exceeds the path
+ * MTU), GSO is turned off for dg and the run is resent as individual
+ * datagrams.
+ *
+ * Returns the number of datagrams which remain queued (in which case
+ * the caller should wait for POLLOUT before flushing again), or -1 on
+ * error, in which case the datagram at the head of the queue is
+ * discarded.
+ */
+int
+xpoll_dgram_flush(struct xpoll *xpoll, struct xpoll_dgram *dg)
+{
+    unsigned int *nsegv = dg->txnsegv;
+
+    (void)xpoll;
+
+    while (dg->txc > 0) {
+        unsigned int msgc = 0, i = 0, sent;
+        int n;
+
+        /*
+         * Build the message vector.  Only transmit side buffers are
+         * used here, such that datagrams may be queued (and flushed)
+         * from within the xpoll_dgram_recv() callback without
+         * clobbering the addresses or control messages of datagrams
+         * in the batch that have yet to be delivered.
+         */
+        while (i < dg->txc) {
+            struct xpoll_dgram_tx *tx = dg->txv + i;
+            struct msghdr *hdr = &dg->txmsgv[msgc].msg_hdr;
+            unsigned int nseg = 1;
+
+            dg->txiovv[i].iov_base = (void *)tx->buf;
+            dg->txiovv[i].iov_len = tx->len;
+
+            memset(hdr, 0, sizeof(*hdr));
+            hdr->msg_name = (void *)tx->addr;
+            hdr->msg_namelen = tx->addrlen;
+            hdr->msg_iov = dg->txiovv + i;
+
+#ifdef UDP_SEGMENT
+            if (dg->flags & XPOLL_DGRAM_GSO) {
+                size_t total = tx->len;
+
+                while (i + nseg < dg->txc && nseg < XPOLL_DGRAM_SEGMAX) {
+                    struct xpoll_dgram_tx *next = tx + nseg;
+
+                    if (next->len > tx->len || !xpoll_dgram_samedst(tx, next) ||
+                        total + next->len > dg->gsomax)
+                        break;
+
+                    dg->txiovv[i + nseg].iov_base = (void *)next->buf;
+                    dg->txiovv[i + nseg].iov_len = next->len;
+                    total += next->len;
+
+                    /* A shorter datagram must terminate the run. */
+                    if (next->len < tx->len) {
+                        ++nseg;
+                        break;
+                    }
+                    ++nseg;
+                }
+
+                if (nseg > 1) {
+                    struct cmsghdr *cmsg;
+                    uint16_t segsz = tx->len;
+
+                    hdr->msg_control = dg->txcmsgv + msgc * XPOLL_DGRAM_CMSGSZ;
+                    hdr->msg_controllen = CMSG_SPACE(sizeof(segsz));
+
+                    cmsg = CMSG_FIRSTHDR(hdr);
+                    cmsg->cmsg_level = IPPROTO_UDP;
+                    cmsg->cmsg_type = UDP_SEGMENT;
+                    cmsg->cmsg_len = CMSG_LEN(sizeof(segsz));
+                    memcpy(CMSG_DATA(cmsg), &segsz, sizeof(segsz));
+                }
+            }
+#endif
+
+            hdr->msg_iovlen = nseg;
+            nsegv[msgc] = nseg;
+            ++msgc;
+            i += nseg;
+        }
+
+        XPOLL_STATS_BEGIN(start);
+
+        n = sendmmsg(dg->fd, dg->txmsgv, msgc, MSG_DONTWAIT);
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_SENDMMSG, start, n);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+                return dg->txc;
+
+            if (nsegv[0] > 1 && (errno == EINVAL || errno == EMSGSIZE || errno == EIO)) {
+                dg->flags &= ~XPOLL_DGRAM_GSO;
+                continue;
+            }
+
+            /* Discard the offending message so that the caller can make progress. */
+            sent = nsegv[0];
+            memmove(dg->txv, dg->txv + sent, (dg->txc - sent) * sizeof(*dg->txv));
+            dg->txc -= sent;
+            return -1;
+        }
+
+        for (sent = 0, i = 0; i < (unsigned int)n; ++i)
+            sent += nsegv[i];
+
+        dg->txc -= sent;
+        if (dg->txc > 0)
+            memmove(dg->txv, dg->txv + sent, dg->txc * sizeof(*dg->txv));
+
+        if ((unsigned int)n < msgc)
+            return dg->txc;
+    }
+
+    return 0;
+}
+
+/*
+ * Move bytes from the source end of a relay into the given direction's
+ * pipe (or buffer).  Returns the number of bytes moved, 0 on EOF, or
+ * -1 with errno set (EAGAIN if either side isn't ready).
+ */
+static ssize_t
+xpoll_relay_in(struct xpoll *xpoll, struct xpoll_relay *relay,
+               struct xpoll_relay_dir *dir, int fd)
+{
+    size_t len = relay->bufsz - dir->fill;
+    ssize_t cc;
+
+    (void)xpoll;
+
+    XPOLL_STATS_BEGIN(start);
+
+#ifdef SPLICE_F_MOVE
+    if (!(relay->flags & XPOLL_RELAY_COPY))
+        cc = splice(fd, NULL, dir->pipev[1], NULL, len,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    else
+#endif
+    {
+        cc = read(fd, dir->buf + dir->fill, len);
+    }
+
+    XPOLL_STATS_END(xpoll, XPOLL_SITE_RELAY_IN, start, cc);
+
+    if (cc > 0)
+        dir->fill += cc;
+
+    return cc;
+}
+
+/*
+ * Move bytes from the given direction's pipe (or buffer) to its sink.
+ * Returns the number of bytes moved, or -1 with errno set.
+ */
+static ssize_t
+xpoll_relay_out(struct xpoll *xpoll, struct xpoll_relay *relay,
+                struct xpoll_relay_dir *dir, int fd)
+{
+    ssize_t cc;
+
+    (void)xpoll;
+
+    XPOLL_STATS_BEGIN(start);
+
+#ifdef SPLICE_F_MOVE
+    if (!(relay->flags & XPOLL_RELAY_COPY))
+        cc = splice(dir->pipev[0], NULL, fd, NULL, dir->fill,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    else
+#endif
+    {
+        cc = write(fd, dir->buf + dir->off, dir->fill - dir->off);
+    }
+
+    XPOLL_STATS_END(xpoll, XPOLL_SITE_RELAY_OUT, start, cc);
+
+    if (cc > 0) {
+        dir->full = 0;
+
+        if (relay->flags & XPOLL_RELAY_COPY) {
+            dir->off += cc;
+            if (dir->off == dir->fill)
+                dir->off = dir->fill = 0;
+        } else {
+            dir->fill -= cc;
+        }
+    }
+
+    return cc;
+}
+
+/*
+ * Enable or disable POLLIN and POLLOUT on each end of the relay to
+ * reflect how full the pipe in each direction is: an end is polled
+ * for input only while its outbound pipe has room, and for output
+ * only while its inbound pipe holds data.
+ */
+static int
+xpoll_relay_arm(struct xpoll *xpoll, struct xpoll_relay *relay)
+{
+    for (int i = 0; i < 2; ++i) {
+        struct xpoll_relay_end *end = relay->endv + i;
+        struct xpoll_relay_dir *out = relay->dirv + i;
+        struct xpoll_relay_dir *in = relay->dirv + !i;
+        int events = 0;
+        int change;
+
+        if (!out->eof && !out->full && out->fill < relay->bufsz)
+            events |= POLLIN;
+        if (in->fill > 0)
+            events |= POLLOUT;
+
+        change = events ^ end->events;
+
+        if (change & events) {
+            if (xpoll_ctl(xpoll, XPOLL_ENABLE, change & events, end->fd, end))
+                return -1;
+        }
+
+        if (change & ~events) {
+            if (xpoll_ctl(xpoll, XPOLL_DISABLE, change & ~events, end->fd, end))
+                return -1;
+        }
+
+        end->events = events;
+    }
+
+    return 0;
+}
+
+/*
+ * Initialize a relay which forwards all bytes read from fda to fdb and
+ * vice versa, and register both fds with the xpoll instance.  On Linux
+ * the bytes are moved through a pipe of (at least) bufsz bytes per
+ * direction via splice(2), such that they are never copied to user
+ * space.  Elsewhere, or given XPOLL_RELAY_COPY, they are copied through
+ * a bufsz byte buffer per direction via read(2) and write(2).  Both
+ * fds must be non-blocking, and remain owned by the caller.
+ *
+ * The data pointer registered for each fd is the address of the
+ * corresponding xpoll_relay_end, which the caller should pass to
+ * xpoll_relay_event() along with the revents for that fd.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_relay_init(struct xpoll *xpoll, struct xpoll_relay *relay,
+                 int fda, int fdb, size_t bufsz, int flags)
+{
+    memset(relay, 0, sizeof(*relay));
+
+    if (bufsz < 1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+#ifndef SPLICE_F_MOVE
+    flags |= XPOLL_RELAY_COPY;
+#endif
+
+    relay->flags = flags;
+    relay->bufsz = bufsz;
+
+    for (int i = 0; i < 2; ++i) {
+        struct xpoll_relay_dir *dir = relay->dirv + i;
+
+        relay->endv[i].fd = i ? fdb : fda;
+        dir->pipev[0] = dir->pipev[1] = -1;
+
+        if (flags & XPOLL_RELAY_COPY) {
+            dir->buf = malloc(bufsz);
+            if (!dir->buf)
+                goto errout;
+            continue;
+        }
+
+#ifdef SPLICE_F_MOVE
+        if (pipe2(dir->pipev, O_NONBLOCK | O_CLOEXEC))
+            goto errout;
+
+        /*
+         * If the pipe can't be grown to bufsz (e.g., it exceeds
+         * pipe-max-size) then track the fill level against its
+         * actual size.
+         */
+        if (fcntl(dir->pipev[1], F_SETPIPE_SZ, (int)bufsz) == -1) {
+            int pipesz = fcntl(dir->pipev[1], F_GETPIPE_SZ);
+
+            if (pipesz > 0 && (size_t)pipesz < relay->bufsz)
+                relay->bufsz = pipesz;
+        }
+#endif
+    }
+
+    /*
+     * Add both events so that either may later be enabled on all
+     * platforms, then let xpoll_relay_arm() disable POLLOUT.
+     */
+    for (int i = 0; i < 2; ++i) {
+        struct xpoll_relay_end *end = relay->endv + i;
+
+        if (xpoll_ctl(xpoll, XPOLL_ADD, POLLIN | POLLOUT, end->fd, end))
+            goto errout;
+
+        end->events = POLLIN | POLLOUT;
+        end->relay = relay;
+    }
+
+    if (xpoll_relay_arm(xpoll, relay)) {
+        xpoll_relay_fini(xpoll, relay);
+        return -1;
+    }
+
+    return 0;
+
+  errout:
+    {
+        int xerrno = errno;
+
+        xpoll_relay_fini(xpoll, relay);
+        errno = xerrno;
+    }
+
+    return -1;
+}
+
+/*
+ * Unregister both ends of the relay and release its pipes or buffers.
+ * The relayed fds are not closed.
+ */
+void
+xpoll_relay_fini(struct xpoll *xpoll, struct xpoll_relay *relay)
+{
+    for (int i = 0; i < 2; ++i) {
+        struct xpoll_relay_end *end = relay->endv + i;
+        struct xpoll_relay_dir *dir = relay->dirv + i;
+
+        if (end->relay)
+            xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, end->fd, end);
+
+        if (dir->pipev[0] >= 0)
+            close(dir->pipev[0]);
+        if (dir->pipev[1] >= 0)
+            close(dir->pipev[1]);
+        free(dir->buf);
+    }
+
+    memset(relay, 0, sizeof(*relay));
+}
+
+/*
+ * Handle the events returned by xpoll_revents() for one end of a relay.
+ * Bytes are moved in both directions as far as the fds and pipes allow,
+ * after which POLLIN and POLLOUT are re-armed on each end according to
+ * the fill level of each pipe.  When one end reaches EOF its peer is
+ * shut down for writing once the pipe in that direction drains.
+ *
+ * Returns 1 once both directions have reached EOF and drained (at
+ * which point the caller should call xpoll_relay_fini() and close the
+ * fds), 0 if the relay remains active, or -1 with errno set if an
+ * error occurred on either end.
+ */
+int
+xpoll_relay_event(struct xpoll *xpoll, struct xpoll_relay_end *end, int revents)
+{
+    struct xpoll_relay *relay = end->relay;
+    int progress;
+
+    (void)revents;
+
+    /*
+     * Rather than trust revents for just this end, pump both directions
+     * until neither moves, which saves a trip through xpoll_wait() when
+     * the data just read can be written immediately.
+     */
+    do {
+        progress = 0;
+
+        for (int i = 0; i < 2; ++i) {
+            struct xpoll_relay_dir *dir = relay->dirv + i;
+            int src = relay->endv[i].fd;
+            int dst = relay->endv[!i].fd;
+            ssize_t cc;
+
+            if (!dir->eof && !dir->full && dir->fill < relay->bufsz) {
+                cc = xpoll_relay_in(xpoll, relay, dir, src);
+                if (cc > 0) {
+                    progress = 1;
+                } else if (cc == 0) {
+                    dir->eof = 1;
+                    progress = 1;
+                } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    return -1;
+                } else if (dir->fill > 0 && !(relay->flags & XPOLL_RELAY_COPY)) {
+                    /*
+                     * A pipe's capacity is counted in pages rather than
+                     * bytes, so it may be full before fill reaches
+                     * bufsz.  Stop polling the source for input until
+                     * the sink drains some of it, lest we spin.
+                     */
+                    dir->full = 1;
+                }
+            }
+
+            if (dir->fill > 0) {
+                cc = xpoll_relay_out(xpoll, relay, dir, dst);
+                if (cc > 0)
+                    progress = 1;
+                else if (cc == -1 && errno != EAGAIN &&
+                         errno != EWOULDBLOCK && errno != EINTR)
+                    return -1;
+            }
+
+            if (dir->eof == 1 && dir->fill == 0) {
+                shutdown(dst, SHUT_WR);
+                dir->eof = 2;
+            }
+        }
+    } while (progress);
+
+    if (relay->dirv[0].eof == 2 && relay->dirv[1].eof == 2)
+        return 1;
+
+    return xpoll_relay_arm(xpoll, relay);
+}
+
+/*
+ * Prepare to send on the connected TCP socket fd with MSG_ZEROCOPY,
+ * such that the kernel transmits directly from the caller's buffers
+ * rather than copying them.  Up to max sends may be outstanding, and
+ * as the kernel reports each send complete via the socket's error
+ * queue release(cookie, arg) is called to return ownership of the
+ * buffer to the caller.
+ *
+ * Where SO_ZEROCOPY isn't supported sends are performed normally, and
+ * release() is called as soon as each send returns.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_zc_init(struct xpoll_zc *zc, int fd, unsigned int max,
+              xpoll_zc_fn_t *release, void *arg)
+{
+    memset(zc, 0, sizeof(*zc));
+
+    if (max < 1 || !release) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    zc->cookiev = calloc(max, sizeof(*zc->cookiev));
+    if (!zc->cookiev)
+        return -1;
+
+    zc->fd = fd;
+    zc->max = max;
+    zc->release = release;
+    zc->arg = arg;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    {
+        int one = 1;
+
+        if (!setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)))
+            zc->enabled = 1;
+    }
+#endif
+
+    return 0;
+}
+
+void
+xpoll_zc_fini(struct xpoll_zc *zc)
+{
+    free(zc->cookiev);
+    memset(zc, 0, sizeof(*zc));
+    zc->fd = -1;
+}
+
+/*
+ * Send up to len bytes from buf without copying.  The caller must not
+ * modify buf until release() has been called with the given cookie.
+ * Note that each send which transmits any bytes (including a partial
+ * send) yields exactly one call to release().
+ *
+ * Returns the number of bytes sent, otherwise -1 with errno set.  If
+ * max sends are already outstanding, or the kernel's per-socket limit
+ * on pinned memory has been reached, errno is ENOBUFS and the caller
+ * should wait for POLLERR and call xpoll_zc_complete() before trying
+ * again.
+ */
+ssize_t
+xpoll_zc_send(struct xpoll *xpoll, struct xpoll_zc *zc,
+              const void *buf, size_t len, void *cookie)
+{
+    ssize_t cc;
+    int flags = MSG_DONTWAIT;
+
+    (void)xpoll;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    if (zc->enabled) {
+        if (zc->inflight >= zc->max) {
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        flags |= MSG_ZEROCOPY;
+    }
+#endif
+
+    XPOLL_STATS_BEGIN(start);
+
+    cc = send(zc->fd, buf, len, flags);
+
+    XPOLL_STATS_END(xpoll, XPOLL_SITE_ZC_SEND, start, cc);
+
+    if (cc > 0) {
+        if (zc->enabled) {
+            /* The kernel numbers each zerocopy send sequentially. */
+            zc->cookiev[zc->next % zc->max] = cookie;
+            ++zc->next;
+            ++zc->inflight;
+        } else {
+            zc->release(cookie, zc->arg);
+        }
+    }
+
+    return cc;
+}
+
+/*
+ * Consume the zerocopy completion notifications queued on the socket's
+ * error queue, which is signaled by POLLERR, calling release() for the
+ * cookie of each completed send.
+ *
+ * Returns the number of sends completed, or -1 with errno set if an
+ * error other than a completion was pending on the socket (in which
+ * case it has been consumed).
+ */
+int
+xpoll_zc_complete(struct xpoll *xpoll, struct xpoll_zc *zc)
+{
+    int n = 0;
+
+    (void)xpoll;
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+    while (zc->enabled) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct sock_extended_err *ee = NULL;
+        struct msghdr msg;
+        struct cmsghdr *cmsg;
+        ssize_t cc;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        XPOLL_STATS_BEGIN(start);
+
+        cc = recvmsg(zc->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+
+        XPOLL_STATS_END(xpoll, XPOLL_SITE_ZC_COMPLETE, start, cc);
+
+        if (cc == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return n > 0 ? n : -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        }
+
+        if (!ee || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            errno = ee ? ee->ee_errno : EIO;
+            return n > 0 ? n : -1;
+        }
+
+        /*
+         * Each notification covers the inclusive range of send ids
+         * [ee_info, ee_data].  SO_EE_CODE_ZEROCOPY_COPIED means the
+         * kernel fell back to copying (e.g., over loopback).
+         */
+        for (uint32_t id = ee->ee_info; id != ee->ee_data + 1; ++id) {
+            void *cookie = zc->cookiev[id % zc->max];
+
+            --zc->inflight;
+            ++n;
+
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                ++zc->ncopied;
+
+            zc->release(cookie, zc->arg);
+        }
+    }
+#endif
+
+    zc->ncompleted += n;
+
+    return n;
+}
+
+/*
+ * A fiber and its stack share a single mapping: the guard page is at
+ * the bottom, the stack grows down from just below the fiber itself
+ * at the top.
+ */
+struct xpoll_fiber {
+    struct xpoll_fiber *next;       // run queue or pool linkage
+    struct xpoll_fiber *allnext;    // see xpoll_fibers.all
+    struct xpoll_fibers *fs;
+    xpoll_fiber_fn_t *fn;
+    void *arg;
+    void *base;                     // base of the mapping
+    int armfd;                      // fd whose events resume this fiber
+    int waitev;                     // events awaited on armfd, 0 if none
+    int revents;                    // events which resumed this fiber
+    int exited;
+#if XPOLL_FIBER_ASM
+    void *sp;                       // saved stack pointer
+#else
+    ucontext_t uc;
+#endif
+};
+
+#if XPOLL_FIBER_ASM
+/*
+ * Save the callee-saved registers of the current context on its stack,
+ * store its stack pointer in *savesp, and resume the context whose
+ * stack pointer is newsp.
+ */
+void xpoll_fiber_switch(void **savesp, void *newsp)
+    __attribute__((visibility("hidden")));
+void xpoll_fiber_entry(void)
+    __attribute__((visibility("hidden")));
+
+__asm__(
+    "   .text\n"
+    "   .p2align 4\n"
+    "xpoll_fiber_switch:\n"
+    "   pushq   %rbp\n"
+    "   pushq   %rbx\n"
+    "   pushq   %r12\n"
+    "   pushq   %r13\n"
+    "   pushq   %r14\n"
+    "   pushq   %r15\n"
+    "   movq    %rsp, (%rdi)\n"
+    "   movq    %rsi, %rsp\n"
+    "   popq    %r15\n"
+    "   popq    %r14\n"
+    "   popq    %r13\n"
+    "   popq    %r12\n"
+    "   popq    %rbx\n"
+    "   popq    %rbp\n"
+    "   ret\n"
+    "\n"
+    "   .p2align 4\n"
+    "xpoll_fiber_entry:\n"
+    "   movq    %r12, %rdi\n"
+    "   call    xpoll_fiber_main\n"
+    "   ud2\n"
+);
+#endif
+
+/* Called only from assembly, hence "used" (e.g., for LTO). */
+void xpoll_fiber_main(struct xpoll_fiber *fiber)
+    __attribute__((visibility("hidden"), noreturn, used));
+
+static inline void
+xpoll_fiber_swap(struct xpoll_fibers *fs, struct xpoll_fiber *from,
+                 struct xpoll_fiber *to)
+{
+    ++fs->nswitches;
+
+#if XPOLL_FIBER_ASM
+    xpoll_fiber_switch(&from->sp, to->sp);
+#else
+    swapcontext(&from->uc, &to->uc);
+#endif
+}
+
+#if !XPOLL_FIBER_ASM
+static void
+xpoll_fiber_ucmain(unsigned int hi, unsigned int lo)
+{
+    xpoll_fiber_main((struct xpoll_fiber *)(((uintptr_t)hi << 16 << 16) | lo));
+}
+
+/*
+ * Kept out of line from xpoll_fiber_create() such that getcontext()
+ * can't clobber its locals.
+ */
+static int
+xpoll_fiber_ucinit(struct xpoll_fiber *fiber, void *stack, size_t stacksz)
+{
+    if (getcontext(&fiber->uc))
+        return -1;
+
+    fiber->uc.uc_stack.ss_sp = stack;
+    fiber->uc.uc_stack.ss_size = stacksz;
+    fiber->uc.uc_link = NULL;
+
+    makecontext(&fiber->uc, (void (*)(void))xpoll_fiber_ucmain, 2,
+                (unsigned int)((uintptr_t)fiber >> 16 >> 16),
+                (unsigned int)(uintptr_t)fiber);
+
+    return 0;
+}
+#endif
+
+void
+xpoll_fiber_main(struct xpoll_fiber *fiber)
+{
+    struct xpoll_fibers *fs = fiber->fs;
+
+    fiber->fn(fiber->arg);
+
+    fiber->exited = 1;
+    xpoll_fiber_swap(fs, fiber, fs->sched);
+    abort();
+}
+
+static void
+xpoll_fiber_ready(struct xpoll_fibers *fs, struct xpoll_fiber *fiber)
+{
+    fiber->next = NULL;
+
+    if (fs->runqtail)
+        fs->runqtail->next = fiber;
+    else
+        fs->runq = fiber;
+
+    fs->runqtail = fiber;
+}
+
+/*
+ * Delete the fiber's armed fd from the xpoll instance (unless another
+ * fiber has since armed it).  Merely disabling its events isn't enough,
+ * as epoll reports POLLHUP and POLLERR regardless (level-triggered), so
+ * a fiber which saw EOF and moved on would otherwise leave
+ * xpoll_fibers_run() spinning.  The next wait on the fd adds it again.
+ * Errors are ignored since the fd may have been closed already.
+ */
+static void
+xpoll_fiber_disarm(struct xpoll_fibers *fs, struct xpoll_fiber *fiber)
+{
+    int fd = fiber->armfd;
+
+    if (fd < 0)
+        return;
+
+    fiber->armfd = -1;
+
+    if (fs->armv[fd] != fiber)
+        return;
+
+    xpoll_ctl(fs->xpoll, XPOLL_DELETE, POLLIN | POLLOUT, fd, NULL);
+
+    fs->maskv[fd] = 0;
+    fs->armv[fd] = NULL;
+}
+
+/*
+ * Prepare to run fibers on the given xpoll instance, which must be
+ * dedicated to them (every data pointer is a fiber).  Each fiber gets
+ * a stack of stacksz bytes (or 64KiB if zero) below a guard page, and
+ * stacks are pooled for reuse when fibers exit.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_fibers_init(struct xpoll_fibers *fs, struct xpoll *xpoll, size_t stacksz)
+{
+    size_t pagesz = sysconf(_SC_PAGESIZE);
+
+    memset(fs, 0, sizeof(*fs));
+
+    if (!stacksz)
+        stacksz = 64 * 1024;
+
+    fs->stacksz = (stacksz + pagesz - 1) & ~(pagesz - 1);
+    fs->mapsz = fs->stacksz + pagesz * 2;   // guard page + fiber
+    fs->xpoll = xpoll;
+    fs->fdmax = xpoll->fdmax;
+
+    fs->maskv = calloc(fs->fdmax, sizeof(*fs->maskv));
+    fs->armv = calloc(fs->fdmax, sizeof(*fs->armv));
+    fs->sched = calloc(1, sizeof(*fs->sched));
+
+    if (!fs->maskv || !fs->armv || !fs->sched) {
+        free(fs->maskv);
+        free(fs->armv);
+        free(fs->sched);
+        return -1;
+    }
+
+    fs->sched->armfd = -1;
+
+    return 0;
+}
+
+/*
+ * Release every fiber's stack, pooled or not.  Fibers which haven't
+ * exited (e.g., after xpoll_fibers_run() failed) are simply discarded
+ * along with their stacks, but the fds they waited on remain in the
+ * xpoll instance.
+ */
+void
+xpoll_fibers_fini(struct xpoll_fibers *fs)
+{
+    struct xpoll_fiber *fiber;
+
+    while (( fiber = fs->all )) {
+        fs->all = fiber->allnext;
+        munmap(fiber->base, fs->mapsz);
+    }
+
+    free(fs->maskv);
+    free(fs->armv);
+    free(fs->sched);
+    memset(fs, 0, sizeof(*fs));
+}
+
+/*
+ * Create a fiber which will call fn(arg) once xpoll_fibers_run() gets
+ * around to it.  The fiber exits when fn returns.
+ *
+ * Returns 0 on success, otherwise -1 with errno set.
+ */
+int
+xpoll_fiber_create(struct xpoll_fibers *fs, xpoll_fiber_fn_t *fn, void *arg)
+{
+    struct xpoll_fiber *fiber;
+    size_t pagesz = sysconf(_SC_PAGESIZE);
+    struct xpoll_fiber *allnext;
+    char *base, *top;
+
+    fiber = fs->pool;
+    if (fiber) {
+        fs->pool = fiber->next;
+        base = fiber->base;
+        allnext = fiber->allnext;
+    }
+    else {
+        int flags = MAP_PRIVATE | MAP_ANON;
+
+#ifdef MAP_STACK
+        flags |= MAP_STACK;
+#endif
+
+        base = mmap(NULL, fs->mapsz, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (base == MAP_FAILED)
+            return -1;
+
+        if (mprotect(base, pagesz, PROT_NONE)) {
+            munmap(base, fs->mapsz);
+            return -1;
+        }
+
+        fiber = (struct xpoll_fiber *)(base + fs->mapsz - pagesz);
+        allnext = fs->all;
+        fs->all = fiber;
+    }
+
+    memset(fiber, 0, sizeof(*fiber));
+    fiber->allnext = allnext;
+    fiber->fs = fs;
+    fiber->fn = fn;
+    fiber->arg = arg;
+    fiber->base = base;
+    fiber->armfd = -1;
+
+    top = (char *)fiber;
+
+#if XPOLL_FIBER_ASM
+    {
+        void **sp = (void **)top;
+
+        /*
+         * Lay out the frame which xpoll_fiber_switch() pops: six callee
+         * saved registers (with the fiber in %r12) and a return address
+         * of xpoll_fiber_entry.  top is page aligned, so once the return
+         * address is popped %rsp is 16-byte aligned at the call of
+         * xpoll_fiber_main(), as the SysV ABI requires.
+         */
+        *--sp = (void *)xpoll_fiber_entry;
+        *--sp = NULL;               // rbp
+        *--sp = NULL;               // rbx
+        *--sp = fiber;              // r12
+        *--sp = NULL;               // r13
+        *--sp = NULL;               // r14
+        *--sp = NULL;               // r15
+
+        fiber->sp = sp;
+    }
+#else
+    if (xpoll_fiber_ucinit(fiber, base + pagesz, top - (base + pagesz))) {
+        fiber->next = fs->pool;
+        fs->pool = fiber;
+        return -1;
+    }
+#endif
+
+    ++fs->nfibers;
+    xpoll_fiber_ready(fs, fiber);
+
+    return 0;
+}
+
+/*
+ * Let the other ready fibers run before continuing.
+ */
+void
+xpoll_fiber_yield(struct xpoll_fibers *fs)
+{
+    struct xpoll_fiber *fiber = fs->cur;
+
+    if (!fiber)
+        return;
+
+    xpoll_fiber_ready(fs, fiber);
+    xpoll_fiber_swap(fs, fiber, fs->sched);
+}
+
+/*
+ * Suspend the calling fiber until fd is ready for the given events
+ * (POLLIN or POLLOUT).  Interest is disarmed lazily, such that waiting
+ * on the same fd for the same events as last time needs no calls to
+ * xpoll_ctl().  At most one fiber may wait on a given fd at a time.
+ *
+ * Returns the events which resumed the fiber (which may include POLLERR
+ * or POLLHUP), otherwise -1 with errno set.
+ */
+int
+xpoll_fiber_wait(struct xpoll_fibers *fs, int fd, int events)
+{
+    struct xpoll_fiber *fiber = fs->cur;
+    struct xpoll_fiber *prev;
+    uint8_t m;
+
+    if (!fiber) {
+        errno = EPERM;
+        return -1;
+    }
+
+    events &= POLLIN | POLLOUT;
+
+    if (fd < 0 || fd >= fs->fdmax || !events) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (fiber->armfd != fd)
+        xpoll_fiber_disarm(fs, fiber);
+
+    /* Take fd over from whichever fiber last armed it. */
+    prev = fs->armv[fd];
+    if (prev && prev != fiber)
+        prev->armfd = -1;
+
+    m = fs->maskv[fd];
+
+    /*
+     * Add both POLLIN and POLLOUT such that either may be enabled later
+     * on every platform, then disable whichever isn't wanted.  The high
+     * bit records that fd has been added.
+     */
+    if (!m) {
+        if (xpoll_ctl(fs->xpoll, XPOLL_ADD, POLLIN | POLLOUT, fd, fiber))
+            return -1;
+        m = 0x80 | POLLIN | POLLOUT;
+    }
+    else if ((m & events) != events || fiber->armfd != fd) {
+        if (xpoll_ctl(fs->xpoll, XPOLL_ENABLE, events, fd, fiber))
+            return -1;
+        m |= events;
+    }
+
+    if (m & (POLLIN | POLLOUT) & ~events) {
+        if (xpoll_ctl(fs->xpoll, XPOLL_DISABLE, m & (POLLIN | POLLOUT) & ~events, fd, fiber))
+            return -1;
+        m &= ~(POLLIN | POLLOUT) | events;
+    }
+
+    fs->maskv[fd] = m;
+    fs->armv[fd] = fiber;
+    fiber->armfd = fd;
+    fiber->waitev = events;
+    ++fs->nwaiting;
+
+    xpoll_fiber_swap(fs, fiber, fs->sched);
+
+    return fiber->revents;
+}
+
+/*
+ * Read up to len bytes from the non-blocking fd, suspending the calling
+ * fiber until fd is readable if need be.
+ */
+ssize_t
+xpoll_fiber_read(struct xpoll_fibers *fs, int fd, void *buf, size_t len)
+{
+    ssize_t cc;
+
+    while (1) {
+        cc = read(fd, buf, len);
+        if (cc != -1 || errno != EAGAIN)
+            break;
+
+        if (xpoll_fiber_wait(fs, fd, POLLIN) == -1)
+            return -1;
+    }
+
+    return cc;
+}
+
+/*
+ * Write all len bytes to the non-blocking fd, suspending the calling
+ * fiber whenever fd isn't writable.  Returns len, or the number of
+ * bytes written before an error (-1 with errno set if none).
+ */
+ssize_t
+xpoll_fiber_write(struct xpoll_fibers *fs, int fd, const void *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t cc;
+
+    while (off < len) {
+        cc = write(fd, (const char *)buf + off, len - off);
+        if (cc == -1) {
+            if (errno == EAGAIN && xpoll_fiber_wait(fs, fd, POLLOUT) != -1)
+                continue;
+            break;
+        }
+
+        off += cc;
+    }
+
+    return (off > 0 || len == 0) ? (ssize_t)off : -1;
+}
+
+/*
+ * Delete fd from the xpoll instance (if any fiber waited on it) and
+ * close it.  Fibers must close fds this way rather than via close(2)
+ * so that the fd number can't be reused while still registered.  A
+ * fiber still waiting on fd (e.g., when a timeout fiber closes its
+ * connection) is resumed with POLLHUP.
+ */
+int
+xpoll_fiber_close(struct xpoll_fibers *fs, int fd)
+{
+    struct xpoll_fiber *fiber;
+
+    if (fd >= 0 && fd < fs->fdmax && ( fiber = fs->armv[fd] )) {
+        xpoll_fiber_disarm(fs, fiber);
+
+        if (fiber->waitev) {
+            fiber->revents = POLLHUP;
+            fiber->waitev = 0;
+            --fs->nwaiting;
+            xpoll_fiber_ready(fs, fiber);
+        }
+    }
+
+    return close(fd);
+}
+
+/*
+ * Run fibers until all have exited, waiting on the xpoll instance
+ * whenever none are ready.
+ *
+ * Returns 0 once all fibers have exited, otherwise -1 with errno set
+ * if xpoll_wait() fails.
+ */
+int
+xpoll_fibers_run(struct xpoll_fibers *fs)
+{
+    struct xpoll_fiber *fiber, *last;
+    int revents;
+    int n;
+
+    while (fs->nfibers > 0) {
+
+        /*
+         * Run each fiber that was ready at the start of this pass, such
+         * that fibers which merely yield can't starve those waiting on
+         * fds.
+         */
+        last = fs->runqtail;
+
+        while (last && ( fiber = fs->runq )) {
+            fs->runq = fiber->next;
+            if (!fs->runq)
+                fs->runqtail = NULL;
+
+            fs->cur = fiber;
+            xpoll_fiber_swap(fs, fs->sched, fiber);
+            fs->cur = NULL;
+
+            if (fiber->exited) {
+                xpoll_fiber_disarm(fs, fiber);
+                fiber->next = fs->pool;
+                fs->pool = fiber;
+                --fs->nfibers;
+            }
+
+            if (fiber == last)
+                break;
+        }
+
+        if (fs->nwaiting < 1)
+            continue;
+
+        n = xpoll_wait(fs->xpoll, fs->runq ? 0 : -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (n-- > 0) {
+            revents = xpoll_revents(fs->xpoll, (void **)&fiber);
+            if (!revents || !fiber)
+                continue;
+
+            /*
+             * A stale event for a fiber which is no longer waiting on
+             * its fd (e.g., it's been resumed by a previous event and
+             * is now waiting elsewhere) disarms the fd.
+             */
+            if (!fiber->waitev) {
+                xpoll_fiber_disarm(fs, fiber);
+                continue;
+            }
+
+            fiber->revents = revents;
+            fiber->waitev = 0;
+            --fs->nwaiting;
+            xpoll_fiber_ready(fs, fiber);
+        }
+    }
+
+    return 0;
+}
+
+#if XPOLL_STATS
+static const char *xpoll_site_namev[] = {
+#if XPOLL_KQUEUE
+    [XPOLL_SITE_CTL_ADD] = "ctl_add",
+    [XPOLL_SITE_CTL_DELETE] = "ctl_delete",
+    [XPOLL_SITE_CTL_ENABLE] = "ctl_enable",
+    [XPOLL_SITE_CTL_DISABLE] = "ctl_disable",
+    [XPOLL_SITE_CTL_FLUSH] = "kevent(changes)",
+    [XPOLL_SITE_WAIT] = "kevent(wait)",
+#elif XPOLL_EPOLL
+    [XPOLL_SITE_CTL_ADD] = "epoll_ctl(ADD)",
+    [XPOLL_SITE_CTL_DELETE] = "epoll_ctl(DEL)",
+    [XPOLL_SITE_CTL_ENABLE] = "epoll_ctl(MOD+)",
+    [XPOLL_SITE_CTL_DISABLE] = "epoll_ctl(MOD-)",
+    [XPOLL_SITE_CTL_FLUSH] = "ctl_flush",
+    [XPOLL_SITE_WAIT] = "epoll_wait",
+#else
+    [XPOLL_SITE_CTL_ADD] = "ctl_add",
+    [XPOLL_SITE_CTL_DELETE] = "ctl_delete",
+    [XPOLL_SITE_CTL_ENABLE] = "ctl_enable",
+    [XPOLL_SITE_CTL_DISABLE] = "ctl_disable",
+    [XPOLL_SITE_CTL_FLUSH] = "ctl_flush",
+    [XPOLL_SITE_WAIT] = "poll",
+#endif
+    [XPOLL_SITE_ACCEPT] = "accept4",
+    [XPOLL_SITE_RECVMMSG] = "recvmmsg",
+    [XPOLL_SITE_SENDMMSG] = "sendmmsg",
+    [XPOLL_SITE_RELAY_IN] = "relay(in)",
+    [XPOLL_SITE_RELAY_OUT] = "relay(out)",
+    [XPOLL_SITE_ZC_SEND] = "send(ZEROCOPY)",
+    [XPOLL_SITE_ZC_COMPLETE] = "recvmsg(ERRQUEUE)",
+    [XPOLL_SITE_WRITEV] = "writev",
+};
+
+const char *
+xpoll_stats_name(int site)
+{
+    if (site < 0 || site >= XPOLL_SITE_MAX || !xpoll_site_namev[site])
+        return "unknown";
+
+    return xpoll_site_namev[site];
+}
+
+void
+xpoll_stats_get(struct xpoll *xpoll, struct xpoll_stats *stats)
+{
+    *stats = xpoll->stats;
+}
+
+void
+xpoll_stats_reset(struct xpoll *xpoll)
+{
+    memset(&xpoll->stats, 0, sizeof(xpoll->stats));
+}
+
+/*
+ * Print the number of calls, errors, and the mean time per call for
+ * each call site which issued at least one system call, along with
+ * the number of calls per event returned by xpoll_wait().
+ */
+void
+xpoll_stats_print(struct xpoll *xpoll, FILE *fp)
+{
+    struct xpoll_stats *stats = &xpoll->stats;
+    unsigned long calls = 0;
+    uint64_t nsecs = 0;
+    double nevents;
+
+    nevents = stats->nevents ? stats->nevents : 1;
+
+    fprintf(fp, "%-16s %12s %8s %10s %12s\n",
+            "SYSCALL", "CALLS", "ERRORS", "NSEC/CALL", "CALLS/EVENT");
+
+    for (int i = 0; i < XPOLL_SITE_MAX; ++i) {
+        if (stats->sitev[i].calls == 0)
+            continue;
+
+        fprintf(fp, "%-16s %12lu %8lu %10.1lf %12.3lf\n",
+                xpoll_stats_name(i), stats->sitev[i].calls,
+                stats->sitev[i].errors,
+                (double)stats->sitev[i].nsecs / stats->sitev[i].calls,
+                stats->sitev[i].calls / nevents);
+
+        calls += stats->sitev[i].calls;
+        nsecs += stats->sitev[i].nsecs;
+    }
+
+    fprintf(fp, "%-16s %12lu %8s %10.1lf %12.3lf\n",
+            "total", calls, "",
+            calls ? (double)nsecs / calls : 0, calls / nevents);
+    fprintf(fp, "%-16s %12lu\n", "events", stats->nevents);
+}
+#endif
@@ -30,6 +30,13 @@
 #define XPOLL_H
 
 #include <poll.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#if XPOLL_STATS
+#include <stdio.h>
+#endif
 
 #if __FreeBSD__
 #define XPOLL_KQUEUE    (!XPOLL_POLL)
@@ -69,15 +76,144 @@
 #define XPOLL_DISABLE   0x0008
 #endif
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if XPOLL_STATS
+/*
+ * When built with XPOLL_STATS every system call issued by xpoll(3) is
+ * counted and timed, attributed to the call site which issued it.
+ */
+enum xpoll_site {
+    XPOLL_SITE_CTL_ADD,             // epoll_ctl(EPOLL_CTL_ADD)
+    XPOLL_SITE_CTL_DELETE,          // epoll_ctl(EPOLL_CTL_DEL)
+    XPOLL_SITE_CTL_ENABLE,          // epoll_ctl(EPOLL_CTL_MOD) from XPOLL_ENABLE
+    XPOLL_SITE_CTL_DISABLE,         // epoll_ctl(EPOLL_CTL_MOD) from XPOLL_DISABLE
+    XPOLL_SITE_CTL_FLUSH,           // kevent() flushing a full changelist
+    XPOLL_SITE_WAIT,                // epoll_wait(), kevent(), or poll()
+    XPOLL_SITE_ACCEPT,              // accept4() from xpoll_accept_batch()
+    XPOLL_SITE_RECVMMSG,            // recvmmsg() from xpoll_dgram_recv()
+    XPOLL_SITE_SENDMMSG,            // sendmmsg() from xpoll_dgram_flush()
+    XPOLL_SITE_RELAY_IN,            // splice() or read() from xpoll_relay_event()
+    XPOLL_SITE_RELAY_OUT,           // splice() or write() from xpoll_relay_event()
+    XPOLL_SITE_ZC_SEND,             // send() from xpoll_zc_send()
+    XPOLL_SITE_ZC_COMPLETE,         // recvmsg(MSG_ERRQUEUE) from xpoll_zc_complete()
+    XPOLL_SITE_WRITEV,              // writev() from xpoll_flush() and xpoll_wait()
+    XPOLL_SITE_MAX
+};
+
+struct xpoll_stats {
+    struct {
+        unsigned long calls;
+        unsigned long errors;
+        uint64_t nsecs;             // total time spent in the call
+    } sitev[XPOLL_SITE_MAX];
+
+    unsigned long nevents;          // events returned by xpoll_wait()
+};
+#endif
+
+struct xpoll;
+
+/*
+ * Hooks called by xpoll_wait() (see xpoll_hook()).
+ */
+enum xpoll_hook {
+    XPOLL_HOOK_PREWAIT,             // before polling (nrdy is zero)
+    XPOLL_HOOK_POSTWAIT,            // after polling (nrdy is the result)
+};
+
+typedef void xpoll_hook_t(struct xpoll *xpoll, int nrdy, void *arg);
+
+/*
+ * Generational handles (see xpoll_handles_init()).  A handle is the
+ * slot index in the low 32 bits and the slot's generation at the time
+ * of allocation in the high 32 bits.  Pass XPOLL_HANDLE_DATA(handle)
+ * as the data argument to xpoll_ctl().
+ */
+typedef uint64_t xpoll_handle_t;
+
+#define XPOLL_HANDLE_DATA(_handle)  ((void *)(uintptr_t)(_handle))
+
+/*
+ * Optional tables to carve from the caller's storage (see xpoll_init()).
+ */
+#define XPOLL_INIT_WQ       (0x0001)    // write queue tables (xpoll_write())
+#define XPOLL_INIT_SLAB     (0x0002)    // slab ownership (xpoll_slab_attach())
+#define XPOLL_INIT_HUGE     (0x0004)    // back tables with huge pages (xpoll_create_flags())
+#define XPOLL_INIT_RWDATA   (0x0008)    // per-direction data (xpoll_rwdata_init())
+
+/*
+ * How an xpoll_create_flags() instance's tables are backed (see huge).
+ */
+enum xpoll_huge {
+    XPOLL_HUGE_NONE,                // base pages
+    XPOLL_HUGE_TLB,                 // MAP_HUGETLB
+    XPOLL_HUGE_THP,                 // madvise(MADV_HUGEPAGE) or superpages
+};
+
+struct xpoll_slab;
+
+#if !XPOLL_EPOLL && !XPOLL_KQUEUE
+/*
+ * poll(2) emulation of nesting (see xpoll_fd()).
+ */
+struct xpoll_nest {
+    int wfd;                        // write end of the placeholder pipe
+    struct xpoll *next;             // instances with a placeholder
+    struct xpoll **childv;          // instances nested in this one
+    int childc;
+    struct pollfd *fdv;             // combined poll(2) set
+    int *ownerv;                    // child each nested fd belongs to
+    size_t fdmax;
+    size_t len;                     // entries of fdv in use
+    int nfds;                       // xpoll->nfds when fdv was built
+    unsigned long gen;              // bumped by xpoll_ctl() once nestable
+    unsigned long layoutgen;        // bumped when childv or a placeholder changes
+    unsigned long stamp;            // xpoll_nest_stamp() when fdv was built
+};
+#endif
+
+struct xpoll_slot {
+    uint32_t gen;                   // bumped by xpoll_handle_free()
+    uint32_t next;                  // free list linkage
+    void *data;
+};
+
 struct xpoll {
 #if XPOLL_KQUEUE
     struct xpollev changev[8];      // kevent(2) changelist parameter
     int changec;                    // kevent(2) nchanges parameter
 #else
     struct pollfd *fds;             // poll(2) fds parameter
-    void **datav;
 #endif
 
+    void **datav;                   // data pointer of each fd
+    void **wdatav;                  // write data of each fd (see xpoll_rwdata_init())
+    int rwpend;                     // write half of a split event
+    int rwfd;
+    struct xpoll_wq **wqv;          // write queue of each fd
+    int *dirtyv;                    // fds with unflushed write queues
+    int dirtyc;
+
+    xpoll_hook_t *prewait;          // see xpoll_hook()
+    void *prewait_arg;
+    xpoll_hook_t *postwait;
+    void *postwait_arg;
+
+    struct xpoll_slot *handlev;     // see xpoll_handles_init()
+    uint32_t handlemax;
+    uint32_t handlenext;            // slots ever allocated
+    uint32_t handlefree;            // head of the free list
+    int handlelock;
+
+    struct xpoll_slab *slab;        // see xpoll_slab_attach()
+    void **ownv;                    // slab object owned by each fd
+    void **deferv;                  // deleted fds' objects, see xpoll_wait()
+    int *deferfdv;                  // fds with a deferred object
+    int deferc;
+
     struct xpollev *eventv;
     int fdmax;
     int nfds;
@@ -85,12 +221,422 @@ struct xpoll {
     int n;
 
     int fd; // fd from epoll_create() or kqueue()
+
+#if !XPOLL_EPOLL && !XPOLL_KQUEUE
+    struct xpoll_nest nest;
+#endif
+
+    void *storage;                  // tables carved by xpoll_init()
+    size_t storagesz;
+    size_t mapsz;                   // length of the mapping, if mmap()ed
+    int huge;                       // enum xpoll_huge
+
+#if XPOLL_STATS
+    struct xpoll_stats stats;
+#endif
 };
 
 extern struct xpoll *xpoll_create(int fdmax);
+extern struct xpoll *xpoll_create_flags(int fdmax, int flags);
 extern void xpoll_destroy(struct xpoll *xpoll);
+extern size_t xpoll_storage_size(int fdmax, int flags);
+extern int xpoll_init(struct xpoll *xpoll, int fdmax, int flags,
+                      void *storage, size_t len);
+extern void xpoll_fini(struct xpoll *xpoll);
 extern int xpoll_ctl(struct xpoll *xpoll, int op, int events, int fd, void *data);
 extern int xpoll_wait(struct xpoll *xpoll, int timeout);
 extern int xpoll_revents(struct xpoll *xpoll, void **datap);
+extern int xpoll_hook(struct xpoll *xpoll, int which, xpoll_hook_t *fn, void *arg);
+extern int xpoll_fd(struct xpoll *xpoll);
+extern int xpoll_rwdata_init(struct xpoll *xpoll);
+
+extern int xpoll_handles_init(struct xpoll *xpoll, uint32_t max);
+extern xpoll_handle_t xpoll_handle_alloc(struct xpoll *xpoll, void *data);
+extern int xpoll_handle_free(struct xpoll *xpoll, xpoll_handle_t handle);
+extern void *xpoll_handle_data(struct xpoll *xpoll, xpoll_handle_t handle);
+
+/*
+ * Slab allocator for per-connection state (see xpoll_slab_init()).
+ */
+struct xpoll_slab {
+    size_t objsz;                   // object size rounded up to align
+    size_t align;
+    size_t chunksz;                 // bytes per chunk
+    void *freel;                    // objects not held by any thread
+    void *chunks;                   // every chunk, for xpoll_slab_fini()
+    char *carve;                    // unused remainder of newest chunk
+    char *carveend;
+    unsigned long serial;           // identifies this slab to thread caches
+    unsigned long nchunks;
+    int tcidx;                      // thread cache slot
+    int lock;
+};
+
+extern int xpoll_slab_init(struct xpoll_slab *slab, size_t objsz, size_t align);
+extern void xpoll_slab_fini(struct xpoll_slab *slab);
+extern void *xpoll_slab_alloc(struct xpoll_slab *slab);
+extern void xpoll_slab_free(struct xpoll_slab *slab, void *obj);
+extern int xpoll_slab_attach(struct xpoll *xpoll, struct xpoll_slab *slab);
+extern void *xpoll_add_obj(struct xpoll *xpoll, int events, int fd);
+extern int xpoll_close(struct xpoll *xpoll, int fd);
+
+/*
+ * Per-fd write queues (see xpoll_write()).
+ */
+struct xpoll_wq;
+
+typedef void xpoll_wq_fn_t(void *arg);
+
+extern int xpoll_write(struct xpoll *xpoll, int fd, const void *buf, size_t len,
+                       xpoll_wq_fn_t *release, void *arg);
+extern ssize_t xpoll_flush(struct xpoll *xpoll, int fd);
+extern size_t xpoll_wqlen(struct xpoll *xpoll, int fd);
+extern int xpoll_wq_link(struct xpoll *xpoll, int fd, int upfd,
+                         size_t lowat, size_t hiwat);
+
+/*
+ * xpoll_accept_batch() calls datafn(fd, arg) for each accepted fd, or
+ * datafn(fd, obj) with the fd's new object in slab mode (arg is unused).
+ */
+typedef void *xpoll_datafn_t(int fd, void *arg);
+
+extern int xpoll_accept_batch(struct xpoll *xpoll, int lfd, int *fdv, int max,
+                              int events, xpoll_datafn_t *datafn, void *arg);
+
+/*
+ * Datagram batching (see xpoll_dgram_init()).
+ */
+#define XPOLL_DGRAM_GRO     (0x0001)    // receive coalesced datagrams
+#define XPOLL_DGRAM_GSO     (0x0002)    // send runs of datagrams as one
+
+struct xpoll_dgram_tx {
+    const void *buf;
+    size_t len;
+    const struct sockaddr *addr;
+    socklen_t addrlen;
+};
+
+struct xpoll_dgram {
+    int fd;
+    int flags;
+    unsigned int nbufs;             // max datagrams per batch
+    unsigned int txc;               // number of queued datagrams
+    size_t bufsz;                   // size of each receive buffer
+    size_t gsomax;                  // max bytes per UDP_SEGMENT message
+    char *bufv;                     // receive buffer pool
+    char *cmsgv;                    // per message control buffers
+    struct mmsghdr *rxmsgv;
+    struct iovec *rxiovv;
+    struct sockaddr_storage *addrv;
+    struct xpoll_dgram_tx *txv;     // transmit queue
+    struct mmsghdr *txmsgv;
+    struct iovec *txiovv;
+    unsigned int *txnsegv;          // datagrams carried by each message
+    char *txcmsgv;                  // per message UDP_SEGMENT control buffers
+};
+
+typedef int xpoll_dgram_fn_t(void *buf, size_t len, struct sockaddr *addr,
+                             socklen_t addrlen, void *arg);
+
+extern int xpoll_dgram_init(struct xpoll_dgram *dg, int fd, unsigned int nbufs,
+                            size_t bufsz, int flags);
+extern void xpoll_dgram_fini(struct xpoll_dgram *dg);
+extern int xpoll_dgram_recv(struct xpoll *xpoll, struct xpoll_dgram *dg,
+                            xpoll_dgram_fn_t *fn, void *arg);
+extern int xpoll_dgram_queue(struct xpoll *xpoll, struct xpoll_dgram *dg,
+                             const void *buf, size_t len,
+                             const struct sockaddr *addr, socklen_t addrlen);
+extern int xpoll_dgram_flush(struct xpoll *xpoll, struct xpoll_dgram *dg);
+
+/*
+ * Bidirectional fd-to-fd relay (see xpoll_relay_init()).
+ */
+#define XPOLL_RELAY_COPY    (0x0001)    // copy through user space
+
+struct xpoll_relay;
+
+struct xpoll_relay_end {
+    int fd;
+    int events;                     // currently enabled events
+    struct xpoll_relay *relay;
+};
+
+struct xpoll_relay_dir {
+    int pipev[2];                   // splice pipe
+    int eof;                        // 1: source hit EOF, 2: sink shut down
+    int full;                       // pipe refused input
+    size_t fill;                    // bytes held in the pipe or buffer
+    size_t off;                     // bytes of buf already written
+    char *buf;                      // XPOLL_RELAY_COPY buffer
+};
+
+struct xpoll_relay {
+    int flags;
+    size_t bufsz;
+    struct xpoll_relay_end endv[2];
+    struct xpoll_relay_dir dirv[2]; // dirv[i] moves endv[i] to endv[!i]
+};
+
+extern int xpoll_relay_init(struct xpoll *xpoll, struct xpoll_relay *relay,
+                            int fda, int fdb, size_t bufsz, int flags);
+extern void xpoll_relay_fini(struct xpoll *xpoll, struct xpoll_relay *relay);
+extern int xpoll_relay_event(struct xpoll *xpoll, struct xpoll_relay_end *end,
+                             int revents);
+
+/*
+ * MSG_ZEROCOPY sends (see xpoll_zc_init()).
+ */
+typedef void xpoll_zc_fn_t(void *cookie, void *arg);
+
+struct xpoll_zc {
+    int fd;
+    int enabled;                    // SO_ZEROCOPY is in effect
+    unsigned int max;               // max outstanding sends
+    unsigned int inflight;          // sends not yet completed
+    uint32_t next;                  // id of the next zerocopy send
+    void **cookiev;                 // cookie of each outstanding send
+    xpoll_zc_fn_t *release;
+    void *arg;
+    unsigned long ncompleted;
+    unsigned long ncopied;          // completions the kernel copied anyway
+};
+
+extern int xpoll_zc_init(struct xpoll_zc *zc, int fd, unsigned int max,
+                         xpoll_zc_fn_t *release, void *arg);
+extern void xpoll_zc_fini(struct xpoll_zc *zc);
+extern ssize_t xpoll_zc_send(struct xpoll *xpoll, struct xpoll_zc *zc,
+                             const void *buf, size_t len, void *cookie);
+extern int xpoll_zc_complete(struct xpoll *xpoll, struct xpoll_zc *zc);
+
+/*
+ * Stackful fibers scheduled by an xpoll instance (see xpoll_fibers_init()).
+ */
+struct xpoll_fiber;
+
+typedef void xpoll_fiber_fn_t(void *arg);
+
+struct xpoll_fibers {
+    struct xpoll *xpoll;
+    size_t stacksz;                 // usable stack size per fiber
+    size_t mapsz;                   // stack + guard page + fiber
+    struct xpoll_fiber *sched;      // context of xpoll_fibers_run()
+    struct xpoll_fiber *cur;        // running fiber, NULL if none
+    struct xpoll_fiber *runq;       // ready fibers (FIFO)
+    struct xpoll_fiber *runqtail;
+    struct xpoll_fiber *pool;       // stacks of exited fibers
+    struct xpoll_fiber *all;        // every fiber's mapping, live or pooled
+    uint8_t *maskv;                 // per-fd registered events
+    struct xpoll_fiber **armv;      // per-fd fiber armed on it, if any
+    int fdmax;
+    int nfibers;                    // fibers not yet exited
+    int nwaiting;                   // fibers waiting on fds
+    unsigned long nswitches;        // context switches
+};
+
+extern int xpoll_fibers_init(struct xpoll_fibers *fs, struct xpoll *xpoll,
+                             size_t stacksz);
+extern void xpoll_fibers_fini(struct xpoll_fibers *fs);
+extern int xpoll_fibers_run(struct xpoll_fibers *fs);
+extern int xpoll_fiber_create(struct xpoll_fibers *fs, xpoll_fiber_fn_t *fn,
+                              void *arg);
+extern void xpoll_fiber_yield(struct xpoll_fibers *fs);
+extern int xpoll_fiber_wait(struct xpoll_fibers *fs, int fd, int events);
+extern ssize_t xpoll_fiber_read(struct xpoll_fibers *fs, int fd,
+                                void *buf, size_t len);
+extern ssize_t xpoll_fiber_write(struct xpoll_fibers *fs, int fd,
+                                 const void *buf, size_t len);
+extern int xpoll_fiber_close(struct xpoll_fibers *fs, int fd);
+
+#if XPOLL_STATS
+extern void xpoll_stats_get(struct xpoll *xpoll, struct xpoll_stats *stats);
+extern void xpoll_stats_reset(struct xpoll *xpoll);
+extern void xpoll_stats_print(struct xpoll *xpoll, FILE *fp);
+extern const char *xpoll_stats_name(int site);
+#endif
+
+/*
+ * Return the data of a live handle, otherwise NULL.  The generation is
+ * checked both before and after reading the data such that the handle
+ * may be freed (and its slot reused) concurrently by another thread.
+ */
+static inline void *
+xpoll_handle_lookup(struct xpoll *xpoll, xpoll_handle_t handle)
+{
+    uint32_t idx = (uint32_t)handle;
+    uint32_t gen = handle >> 32;
+    struct xpoll_slot *slot;
+    void *data;
+
+    if (idx >= __atomic_load_n(&xpoll->handlenext, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    slot = xpoll->handlev + idx;
+
+    /* Pairs with the release store of gen in xpoll_handle_alloc(). */
+    if (__atomic_load_n(&slot->gen, __ATOMIC_ACQUIRE) != gen)
+        return NULL;
+
+    data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (__atomic_load_n(&slot->gen, __ATOMIC_RELAXED) != gen)
+        return NULL;
+
+    return data;
+}
+
+static inline int
+xpoll_revents_next(struct xpoll *xpoll, void **datap)
+{
+    struct xpollev *event;
+
+    *datap = NULL;
+
+    if (xpoll->nrdy < 1)
+        return 0;
+
+#if XPOLL_EPOLL
+    event = xpoll->eventv + xpoll->n;
+    *datap = event->data.ptr;
+
+    --xpoll->nrdy;
+    ++xpoll->n;
+
+    return event->events;
+
+#elif XPOLL_KQUEUE
+    int events = 0;
+
+    event = xpoll->eventv + xpoll->n;
+
+    if (event->filter == EVFILT_READ)
+        events |= POLLIN;
+    else if (event->filter == EVFILT_WRITE)
+        events |= POLLOUT;
+
+    if (event->flags & EV_ERROR)
+        events |= POLLERR;
+
+    *datap = event->udata;
+
+    --xpoll->nrdy;
+    ++xpoll->n;
+
+    return events;
+
+#else
+    event = xpoll->eventv + xpoll->n;
+
+    while (xpoll->n < xpoll->nfds) {
+        if (event->revents) {
+            *datap = xpoll->datav[xpoll->n];
+            --xpoll->nrdy;
+            ++xpoll->n;
+            return event->revents;
+        }
+
+        ++xpoll->n;
+        ++event;
+    }
+
+    return 0; // Should never get here..
+#endif
+}
+
+/*
+ * Return the next event in rwdata mode (see xpoll_revents_inline()).
+ * The kernel's data is the fd, from which the data of the event's
+ * direction is looked up.  An epoll(7) or poll(2) event which is
+ * both readable and writable is returned as two events, first the
+ * read half with the read data, then the write half with the write
+ * data.  Errors and hangups are reported to each direction whose
+ * events are enabled.
+ */
+static inline int
+xpoll_revents_rw(struct xpoll *xpoll, void **datap)
+{
+    int revents;
+
+    if (xpoll->rwpend) {
+        revents = xpoll->rwpend;
+        xpoll->rwpend = 0;
+        *datap = xpoll->wdatav[xpoll->rwfd];
+        return revents;
+    }
+
+    while (( revents = xpoll_revents_next(xpoll, datap) )) {
+#if XPOLL_KQUEUE
+        int fd = (int)(uintptr_t)*datap;
+
+        /* Each kevent is of a single filter, hence direction. */
+        *datap = (revents & POLLOUT) ? xpoll->wdatav[fd] : xpoll->datav[fd];
+
+        return revents;
+#else
+#if XPOLL_EPOLL
+        int fd = (int)(uintptr_t)*datap;
+#else
+        int fd = xpoll->n - 1;
+#endif
+        int events = xpoll->fds[fd].events;
+        int rd, wr;
+
+        wr = (events & POLLOUT) ? revents & (POLLOUT | POLLERR | POLLHUP) : 0;
+        rd = revents & ~POLLOUT;
+        if (wr && !(events & POLLIN))
+            rd = 0;
+
+        if (rd) {
+            xpoll->rwpend = wr;
+            xpoll->rwfd = fd;
+            *datap = xpoll->datav[fd];
+            return rd;
+        }
+
+        if (wr) {
+            *datap = xpoll->wdatav[fd];
+            return wr;
+        }
+#endif
+    }
+
+    return 0;
+}
+
+/*
+ * The event retrieval fast path, exposed here so that it may be inlined
+ * into the caller's event loop rather than costing a call into the
+ * library per ready event.  Define XPOLL_INLINE to 1 (e.g., 'gmake
+ * inline') to have calls to xpoll_revents() expand to it.
+ *
+ * This is the body of xpoll_revents().  In handle mode the data
+ * returned is that of the handle given to xpoll_ctl(), and events for
+ * handles freed since are skipped.  In rwdata mode the read and write
+ * halves of an event are returned separately.  The helpers above for
+ * both modes are inline too, so no mode calls into the library.
+ */
+static inline int
+xpoll_revents_inline(struct xpoll *xpoll, void **datap)
+{
+    int revents;
+
+    while (( revents = (xpoll->wdatav ? xpoll_revents_rw(xpoll, datap) :
+                        xpoll_revents_next(xpoll, datap)) ) && xpoll->handlev) {
+        *datap = xpoll_handle_lookup(xpoll, (uintptr_t)*datap);
+        if (*datap)
+            break;
+    }
+
+    return revents;
+}
+
+#if XPOLL_INLINE
+#define xpoll_revents(_xpoll, _datap)   xpoll_revents_inline((_xpoll), (_datap))
+#endif
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* XPOLL_H */
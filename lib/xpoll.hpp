@@ -0,0 +1,1504 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef XPOLL_HPP
+#define XPOLL_HPP
+
+/*
+ * xpoll.hpp is a header-only C++20 interface to xpoll(3).  A loop is a
+ * move-only class template parameterized on a backend policy, which
+ * is selected at compile time:
+ *
+ *   c_backend       wraps struct xpoll (i.e., whichever mechanism
+ *                   lib/xpoll.c was compiled for), retrieving each
+ *                   event via the inline xpoll_revents_inline() as
+ *                   the range is iterated, such that handle and
+ *                   per-direction data modes work.
+ *   epoll_backend   epoll(7) directly (Linux).
+ *   uring_backend   io_uring(7) poll requests via the raw system
+ *                   calls (Linux 5.11 or later).
+ *   kqueue_backend  kqueue(2) directly (FreeBSD).
+ *   poll_backend    poll(2) directly.
+ *
+ * The header-only backends don't depend upon lib/xpoll.c at all, but
+ * follow the same semantics: events are POLLIN, POLLOUT, and POLLERR,
+ * registrations are level-triggered, and POLLOUT can only be enabled
+ * on a fd to which it was added (even if disabled since).
+ *
+ * Registration returns an RAII handle which deletes the fd from the
+ * loop when destroyed, and wait() returns a range over the ready
+ * events which may be iterated with a range-based for loop:
+ *
+ *   xpp::loop<> loop(fdmax);
+ *   auto reg = loop.add(fd, POLLIN, conn);
+ *
+ *   for (;;) {
+ *       for (xpp::event ev : loop.wait(-1))
+ *           handle(static_cast<struct conn *>(ev.data), ev.revents);
+ *   }
+ *
+ * Errors are reported by throwing std::system_error, except that
+ * wait() returns an empty range if interrupted by a signal.
+ *
+ * co_loop<Backend> runs C++20 coroutines (see xpp::task) over the same
+ * backends, such that a connection can be served by straight-line code
+ * rather than a callback state machine:
+ *
+ *   xpp::task
+ *   echo(xpp::co_loop<> &loop, int fd)
+ *   {
+ *       char buf[4096];
+ *       ssize_t cc;
+ *
+ *       while ((cc = read(fd, buf, sizeof(buf))) != 0) {
+ *           if (cc == -1 && errno == EAGAIN)
+ *               co_await loop.readable(fd);
+ *           ...
+ *       }
+ *
+ *       loop.close(fd);
+ *   }
+ *
+ *   loop.spawn(echo(loop, fd));
+ *   loop.run();
+ *
+ * A backend is any class which provides:
+ *
+ *   using native_event = ...;               // element of the event vector
+ *   static constexpr bool sparse;           // events with revents == 0?
+ *   explicit Backend(int fdmax);
+ *   void ctl(op, int events, int fd, void *data);
+ *   std::span<const native_event> wait(int timeout);
+ *   event decode(const native_event &) const;
+ *
+ * c_backend is the exception: its wait() returns the number of ready
+ * events, and event_range<c_backend> pulls them one at a time from the
+ * struct xpoll rather than from a vector.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+#if __linux__
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+
+#if __FreeBSD__
+#include <sys/types.h>
+#include <sys/event.h>
+#endif
+
+#include "xpoll.h"
+
+namespace xpp {
+
+enum class op {
+    add,
+    del,
+    enable,
+    disable,
+};
+
+struct event {
+    int revents;
+    void *data;
+};
+
+[[noreturn]] inline void
+throw_errno(const char *what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+/*
+ * Compute the new event mask of a fd given its current mask.
+ */
+constexpr int
+apply_op(op o, int cur, int events)
+{
+    events &= POLLIN | POLLOUT | POLLERR;
+
+    if (o == op::add || o == op::enable)
+        return cur | events;
+
+    return cur & ~events;
+}
+
+/*
+ * Backend which wraps struct xpoll.  wait() merely returns the number
+ * of ready events, which event_range<c_backend> then retrieves one at
+ * a time via xpoll_revents_inline() as it is iterated, so that handles
+ * are resolved (and stale ones dropped) and read and write data are
+ * split exactly as for callers of the C API, without copying.
+ */
+class c_backend {
+public:
+    explicit c_backend(int fdmax)
+        : xpoll_(xpoll_create(fdmax))
+    {
+        if (!xpoll_)
+            throw_errno("xpoll_create");
+    }
+
+    ~c_backend() { xpoll_destroy(xpoll_); }
+
+    c_backend(c_backend &&other) noexcept
+        : xpoll_(std::exchange(other.xpoll_, nullptr)) {}
+
+    c_backend &
+    operator=(c_backend &&other) noexcept
+    {
+        std::swap(xpoll_, other.xpoll_);
+        return *this;
+    }
+
+    c_backend(const c_backend &) = delete;
+    c_backend &operator=(const c_backend &) = delete;
+
+    void
+    ctl(op o, int events, int fd, void *data)
+    {
+        static constexpr int opv[] = {
+            XPOLL_ADD, XPOLL_DELETE, XPOLL_ENABLE, XPOLL_DISABLE,
+        };
+
+        if (xpoll_ctl(xpoll_, opv[static_cast<int>(o)], events, fd, data))
+            throw_errno("xpoll_ctl");
+    }
+
+    int
+    wait(int timeout)
+    {
+        int n = xpoll_wait(xpoll_, timeout);
+
+        if (n < 1) {
+            if (n == -1 && errno != EINTR)
+                throw_errno("xpoll_wait");
+            return 0;
+        }
+
+        return n;
+    }
+
+    /* For use with the rest of the C API (e.g., xpoll_write()). */
+    struct xpoll *native() const { return xpoll_; }
+
+private:
+    struct xpoll *xpoll_;
+};
+
+/*
+ * Backend which manages a poll(2) fds vector indexed by fd.  As with
+ * lib/xpoll.c the vector is sized once by fdmax, so that ctl() never
+ * invalidates the span returned by wait().
+ */
+class poll_backend {
+public:
+    using native_event = struct pollfd;
+
+    static constexpr bool sparse = true;
+
+    explicit poll_backend(int fdmax)
+        : fds_(fdmax, pollfd{ -1, 0, 0 }), datav_(fdmax) {}
+
+    poll_backend(poll_backend &&) noexcept = default;
+    poll_backend &operator=(poll_backend &&) noexcept = default;
+
+    void
+    ctl(op o, int events, int fd, void *data)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= fds_.size()) {
+            errno = (fd < 0) ? EBADF : EINVAL;
+            throw_errno("poll_backend::ctl");
+        }
+
+        pollfd &pfd = fds_[fd];
+
+        pfd.fd = (o == op::del) ? -1 : fd;
+        pfd.events = apply_op(o, pfd.events, events);
+        pfd.revents = 0;
+        datav_[fd] = data;
+
+        if (o == op::add && fd >= nfds_)
+            nfds_ = fd + 1;
+    }
+
+    std::span<const native_event>
+    wait(int timeout)
+    {
+        int n = ::poll(fds_.data(), nfds_, timeout);
+
+        if (n < 1) {
+            if (n == -1 && errno != EINTR)
+                throw_errno("poll");
+            return {};
+        }
+
+        return { fds_.data(), static_cast<size_t>(nfds_) };
+    }
+
+    event
+    decode(const native_event &ev) const
+    {
+        return { ev.revents, datav_[&ev - fds_.data()] };
+    }
+
+private:
+    std::vector<pollfd> fds_;
+    std::vector<void *> datav_;
+    int nfds_ = 0;
+};
+
+#if __linux__
+/*
+ * Backend which calls epoll(7) directly, shadowing each fd's event mask
+ * such that POLLIN and POLLOUT may be enabled and disabled separately.
+ */
+class epoll_backend {
+public:
+    using native_event = struct epoll_event;
+
+    static constexpr bool sparse = false;
+
+    explicit epoll_backend(int fdmax)
+        : fd_(epoll_create1(EPOLL_CLOEXEC)), eventv_(128)
+    {
+        if (fd_ == -1)
+            throw_errno("epoll_create1");
+        maskv_.reserve(fdmax);
+    }
+
+    ~epoll_backend()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    epoll_backend(epoll_backend &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)),
+          maskv_(std::move(other.maskv_)),
+          eventv_(std::move(other.eventv_)) {}
+
+    epoll_backend &
+    operator=(epoll_backend &&other) noexcept
+    {
+        std::swap(fd_, other.fd_);
+        std::swap(maskv_, other.maskv_);
+        std::swap(eventv_, other.eventv_);
+        return *this;
+    }
+
+    epoll_backend(const epoll_backend &) = delete;
+    epoll_backend &operator=(const epoll_backend &) = delete;
+
+    void
+    ctl(op o, int events, int fd, void *data)
+    {
+        static constexpr int opv[] = {
+            EPOLL_CTL_ADD, EPOLL_CTL_DEL, EPOLL_CTL_MOD, EPOLL_CTL_MOD,
+        };
+        struct epoll_event change;
+
+        if (fd >= 0 && static_cast<size_t>(fd) >= maskv_.size())
+            maskv_.resize(fd + 1);
+
+        change.events = apply_op(o, (fd >= 0) ? maskv_[fd] : 0, events);
+        change.data.ptr = data;
+
+        if (epoll_ctl(fd_, opv[static_cast<int>(o)], fd, &change))
+            throw_errno("epoll_ctl");
+
+        maskv_[fd] = change.events;
+    }
+
+    std::span<const native_event>
+    wait(int timeout)
+    {
+        int n = epoll_wait(fd_, eventv_.data(), eventv_.size(), timeout);
+
+        if (n < 1) {
+            if (n == -1 && errno != EINTR)
+                throw_errno("epoll_wait");
+            return {};
+        }
+
+        return { eventv_.data(), static_cast<size_t>(n) };
+    }
+
+    static event
+    decode(const native_event &ev)
+    {
+        return { static_cast<int>(ev.events), ev.data.ptr };
+    }
+
+private:
+    int fd_;
+    std::vector<uint32_t> maskv_;
+    std::vector<native_event> eventv_;
+};
+#endif
+
+#if __linux__ && defined(IORING_FEAT_EXT_ARG)
+#define XPP_URING 1
+
+/*
+ * Backend which drives io_uring(7) poll requests via the raw system
+ * calls (i.e., without liburing).  A poll request completes but once,
+ * so each fd which fired is rearmed by the following wait(), after its
+ * event has been dispatched, which keeps registrations level-triggered:
+ * a fd that is still ready completes again at once.  As with
+ * kqueue_backend, ctl() merely queues its requests, which are submitted
+ * along with the next wait() (or whenever the submission queue fills).
+ *
+ * Each request's user_data carries the fd and a per-fd generation, such
+ * that completions of requests since cancelled or superseded by ctl()
+ * are recognized and dropped.  The wait timeout requires
+ * IORING_FEAT_EXT_ARG (Linux 5.11).
+ */
+class uring_backend {
+public:
+    using native_event = event;
+
+    static constexpr bool sparse = false;
+
+    explicit uring_backend(int fdmax)
+        : fdv_(fdmax)
+    {
+        struct io_uring_params params = {};
+        unsigned int cqentries = 1024;
+
+        /* Allow for a poll and a cancellation in flight per fd. */
+        while (cqentries < 2u * fdmax)
+            cqentries *= 2;
+
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = cqentries;
+
+        fd_ = syscall(__NR_io_uring_setup, 256, &params);
+        if (fd_ == -1)
+            throw_errno("io_uring_setup");
+
+        if (!(params.features & IORING_FEAT_EXT_ARG)) {
+            ::close(fd_);
+            errno = ENOSYS;
+            throw_errno("io_uring_setup");
+        }
+
+        if (map(params)) {
+            int xerrno = errno;
+
+            unmap();
+            ::close(fd_);
+            errno = xerrno;
+            throw_errno("mmap");
+        }
+
+        rearmv_.reserve(fdmax);
+        eventv_.reserve(fdmax);
+    }
+
+    ~uring_backend()
+    {
+        if (fd_ >= 0) {
+            unmap();
+            ::close(fd_);
+        }
+    }
+
+    uring_backend(uring_backend &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)),
+          ring_(other.ring_),
+          nsubmit_(other.nsubmit_),
+          fdv_(std::move(other.fdv_)),
+          rearmv_(std::move(other.rearmv_)),
+          eventv_(std::move(other.eventv_)) {}
+
+    uring_backend &
+    operator=(uring_backend &&other) noexcept
+    {
+        std::swap(fd_, other.fd_);
+        std::swap(ring_, other.ring_);
+        std::swap(nsubmit_, other.nsubmit_);
+        std::swap(fdv_, other.fdv_);
+        std::swap(rearmv_, other.rearmv_);
+        std::swap(eventv_, other.eventv_);
+        return *this;
+    }
+
+    uring_backend(const uring_backend &) = delete;
+    uring_backend &operator=(const uring_backend &) = delete;
+
+    void
+    ctl(op o, int events, int fd, void *data)
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= fdv_.size()) {
+            errno = (fd < 0) ? EBADF : EINVAL;
+            throw_errno("uring_backend::ctl");
+        }
+
+        fdstate &st = fdv_[fd];
+        int mask = (o == op::del) ? 0 : apply_op(o, st.mask, events);
+
+        st.data = data;
+
+        if (st.armed && mask != st.mask)
+            cancel(fd, st);
+
+        st.mask = mask;
+
+        if (!st.armed && mask)
+            arm(fd, st);
+    }
+
+    std::span<const native_event>
+    wait(int timeout)
+    {
+        struct io_uring_getevents_arg arg = {};
+        struct __kernel_timespec ts;
+        unsigned int flags = 0;
+        int rc;
+
+        for (int fd : rearmv_) {
+            fdstate &st = fdv_[fd];
+
+            if (!st.armed && st.mask)
+                arm(fd, st);
+        }
+
+        rearmv_.clear();
+        eventv_.clear();
+
+        if (timeout != 0 && *ring_.cqhead == __atomic_load_n(ring_.cqtail, __ATOMIC_ACQUIRE)) {
+            flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+
+            if (timeout > 0) {
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000;
+                arg.ts = reinterpret_cast<uintptr_t>(&ts);
+            }
+        }
+
+        if (nsubmit_ > 0 || flags) {
+            rc = enter(nsubmit_, flags ? 1 : 0, flags, flags ? &arg : nullptr,
+                       flags ? sizeof(arg) : 0);
+            if (rc == -1) {
+                if (errno != EINTR && errno != ETIME)
+                    throw_errno("io_uring_enter");
+            }
+            else {
+                nsubmit_ -= rc;
+            }
+        }
+
+        reap();
+
+        return eventv_;
+    }
+
+    static event decode(const native_event &ev) { return ev; }
+
+private:
+    struct fdstate {
+        void *data = nullptr;
+        uint32_t gen = 0;           // generation of the latest request
+        uint8_t mask = 0;           // enabled events
+        bool armed = false;         // a poll request is outstanding
+    };
+
+    struct ring {
+        void *sq = MAP_FAILED;
+        void *cq = MAP_FAILED;
+        size_t sqsz = 0;
+        size_t cqsz = 0;
+        struct io_uring_sqe *sqev = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+        size_t sqevsz = 0;
+        unsigned int *sqhead = nullptr;
+        unsigned int *sqtail = nullptr;
+        unsigned int *sqarray = nullptr;
+        unsigned int sqmask = 0;
+        unsigned int sqentries = 0;
+        unsigned int *cqhead = nullptr;
+        unsigned int *cqtail = nullptr;
+        struct io_uring_cqe *cqev = nullptr;
+        unsigned int cqmask = 0;
+    };
+
+    static uint64_t
+    udata(int fd, uint32_t gen)
+    {
+        return (static_cast<uint64_t>(gen) << 32) | static_cast<uint32_t>(fd);
+    }
+
+    int
+    enter(unsigned int tosubmit, unsigned int mincomplete, unsigned int flags,
+          const void *arg, size_t argsz)
+    {
+        return syscall(__NR_io_uring_enter, fd_, tosubmit, mincomplete, flags, arg, argsz);
+    }
+
+    int
+    map(const struct io_uring_params &params)
+    {
+        ring &r = ring_;
+
+        r.sqsz = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+        r.cqsz = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            r.sqsz = r.cqsz = std::max(r.sqsz, r.cqsz);
+
+        r.sq = mmap(nullptr, r.sqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    fd_, IORING_OFF_SQ_RING);
+        if (r.sq == MAP_FAILED)
+            return -1;
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            r.cq = r.sq;
+        }
+        else {
+            r.cq = mmap(nullptr, r.cqsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        fd_, IORING_OFF_CQ_RING);
+            if (r.cq == MAP_FAILED)
+                return -1;
+        }
+
+        r.sqevsz = params.sq_entries * sizeof(struct io_uring_sqe);
+        r.sqev = static_cast<struct io_uring_sqe *>(
+            mmap(nullptr, r.sqevsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 fd_, IORING_OFF_SQES));
+        if (r.sqev == MAP_FAILED)
+            return -1;
+
+        auto *sq = static_cast<char *>(r.sq);
+        auto *cq = static_cast<char *>(r.cq);
+
+        r.sqhead = reinterpret_cast<unsigned int *>(sq + params.sq_off.head);
+        r.sqtail = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+        r.sqarray = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+        r.sqmask = *reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+        r.sqentries = params.sq_entries;
+
+        r.cqhead = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+        r.cqtail = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+        r.cqev = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+        r.cqmask = *reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+
+        return 0;
+    }
+
+    void
+    unmap() noexcept
+    {
+        if (ring_.sqev != MAP_FAILED)
+            munmap(ring_.sqev, ring_.sqevsz);
+        if (ring_.cq != MAP_FAILED && ring_.cq != ring_.sq)
+            munmap(ring_.cq, ring_.cqsz);
+        if (ring_.sq != MAP_FAILED)
+            munmap(ring_.sq, ring_.sqsz);
+
+        ring_ = ring();
+    }
+
+    /*
+     * Return the next free submission queue entry, zeroed, submitting
+     * those queued so far if the queue is full.  Without SQPOLL the
+     * kernel reads entries only from within io_uring_enter(), so the
+     * tail may be advanced before the entry is filled in.
+     */
+    struct io_uring_sqe *
+    get_sqe()
+    {
+        unsigned int tail = *ring_.sqtail;
+        unsigned int idx;
+
+        if (tail - __atomic_load_n(ring_.sqhead, __ATOMIC_ACQUIRE) >= ring_.sqentries) {
+            int rc = enter(nsubmit_, 0, 0, nullptr, 0);
+
+            if (rc < 1) {
+                if (rc == 0)
+                    errno = EBUSY;
+                throw_errno("io_uring_enter");
+            }
+
+            nsubmit_ -= rc;
+        }
+
+        idx = tail & ring_.sqmask;
+        ring_.sqarray[idx] = idx;
+        __atomic_store_n(ring_.sqtail, tail + 1, __ATOMIC_RELEASE);
+        ++nsubmit_;
+
+        struct io_uring_sqe *sqe = ring_.sqev + idx;
+
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        return sqe;
+    }
+
+    void
+    arm(int fd, fdstate &st)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+
+        /* Generation 0 is reserved for requests whose completions are ignored. */
+        if (++st.gen == 0)
+            ++st.gen;
+
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->poll32_events = st.mask;
+        sqe->user_data = udata(fd, st.gen);
+        st.armed = true;
+    }
+
+    void
+    cancel(int fd, fdstate &st)
+    {
+        struct io_uring_sqe *sqe = get_sqe();
+
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = udata(fd, st.gen);
+        sqe->user_data = udata(fd, 0);
+
+        if (++st.gen == 0)
+            ++st.gen;
+        st.armed = false;
+    }
+
+    void
+    reap()
+    {
+        unsigned int head = *ring_.cqhead;
+        unsigned int tail = __atomic_load_n(ring_.cqtail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; ++head) {
+            const struct io_uring_cqe &cqe = ring_.cqev[head & ring_.cqmask];
+            uint32_t gen = cqe.user_data >> 32;
+            int fd = static_cast<uint32_t>(cqe.user_data);
+
+            if (!gen || static_cast<size_t>(fd) >= fdv_.size())
+                continue;
+
+            fdstate &st = fdv_[fd];
+
+            if (gen != st.gen || !st.armed)
+                continue;
+
+            st.armed = false;
+            rearmv_.push_back(fd);
+            eventv_.push_back({ (cqe.res < 0) ? POLLERR : cqe.res, st.data });
+        }
+
+        __atomic_store_n(ring_.cqhead, head, __ATOMIC_RELEASE);
+    }
+
+    int fd_ = -1;
+    ring ring_;
+    unsigned int nsubmit_ = 0;              // queued but not yet submitted
+    std::vector<fdstate> fdv_;
+    std::vector<int> rearmv_;               // fds to rearm on the next wait()
+    std::vector<native_event> eventv_;
+};
+#endif
+
+#if __FreeBSD__
+/*
+ * Backend which calls kqueue(2) directly.  Changes are batched and
+ * submitted by the next wait() (or once the batch fills).
+ */
+class kqueue_backend {
+public:
+    using native_event = struct kevent;
+
+    static constexpr bool sparse = false;
+
+    explicit kqueue_backend(int fdmax)
+        : fd_(kqueue()), eventv_(128)
+    {
+        if (fd_ == -1)
+            throw_errno("kqueue");
+        (void)fdmax;
+        changev_.reserve(64);
+    }
+
+    ~kqueue_backend()
+    {
+        if (fd_ >= 0)
+            ::close(fd_);
+    }
+
+    kqueue_backend(kqueue_backend &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)),
+          changev_(std::move(other.changev_)),
+          eventv_(std::move(other.eventv_)) {}
+
+    kqueue_backend &
+    operator=(kqueue_backend &&other) noexcept
+    {
+        std::swap(fd_, other.fd_);
+        std::swap(changev_, other.changev_);
+        std::swap(eventv_, other.eventv_);
+        return *this;
+    }
+
+    kqueue_backend(const kqueue_backend &) = delete;
+    kqueue_backend &operator=(const kqueue_backend &) = delete;
+
+    void
+    ctl(op o, int events, int fd, void *data)
+    {
+        static constexpr unsigned short flagv[] = {
+            EV_ADD, EV_DELETE, EV_ENABLE, EV_DISABLE,
+        };
+        unsigned short flags = flagv[static_cast<int>(o)];
+        struct kevent change;
+
+        if (events & POLLIN) {
+            EV_SET(&change, fd, EVFILT_READ, flags, 0, 0, data);
+            changev_.push_back(change);
+        }
+
+        if (events & POLLOUT) {
+            EV_SET(&change, fd, EVFILT_WRITE, flags, 0, 0, data);
+            changev_.push_back(change);
+        }
+
+        if (changev_.size() >= 64) {
+            if (kevent(fd_, changev_.data(), changev_.size(), nullptr, 0, nullptr) == -1)
+                throw_errno("kevent");
+            changev_.clear();
+        }
+    }
+
+    std::span<const native_event>
+    wait(int timeout)
+    {
+        struct timespec tsbuf, *ts = nullptr;
+        int n;
+
+        if (timeout >= 0) {
+            tsbuf.tv_sec = timeout / 1000;
+            tsbuf.tv_nsec = (timeout % 1000) * 1000000;
+            ts = &tsbuf;
+        }
+
+        n = kevent(fd_, changev_.data(), changev_.size(),
+                   eventv_.data(), eventv_.size(), ts);
+        changev_.clear();
+
+        if (n < 1) {
+            if (n == -1 && errno != EINTR)
+                throw_errno("kevent");
+            return {};
+        }
+
+        return { eventv_.data(), static_cast<size_t>(n) };
+    }
+
+    static event
+    decode(const native_event &ev)
+    {
+        int revents = (ev.filter == EVFILT_READ) ? POLLIN :
+            (ev.filter == EVFILT_WRITE) ? POLLOUT : 0;
+
+        if (ev.flags & EV_ERROR)
+            revents |= POLLERR;
+
+        return { revents, ev.udata };
+    }
+
+private:
+    int fd_;
+    std::vector<native_event> changev_;
+    std::vector<native_event> eventv_;
+};
+#endif
+
+#if __linux__
+using default_backend = epoll_backend;
+#elif __FreeBSD__
+using default_backend = kqueue_backend;
+#else
+using default_backend = poll_backend;
+#endif
+
+/*
+ * A range over the events returned by one wait().  Dereferencing an
+ * iterator decodes the native event in place, and for sparse backends
+ * (i.e., poll(2)) entries without events are skipped.
+ */
+template <class Backend>
+class event_range {
+public:
+    using native_event = typename Backend::native_event;
+
+    class iterator {
+    public:
+        using value_type = event;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        iterator(const Backend *backend, const native_event *cur, const native_event *end)
+            : backend_(backend), cur_(cur), end_(end)
+        {
+            skip();
+        }
+
+        event operator*() const { return backend_->decode(*cur_); }
+
+        iterator &
+        operator++()
+        {
+            ++cur_;
+            skip();
+            return *this;
+        }
+
+        iterator
+        operator++(int)
+        {
+            iterator tmp = *this;
+            ++*this;
+            return tmp;
+        }
+
+        bool operator==(const iterator &rhs) const { return cur_ == rhs.cur_; }
+
+    private:
+        void
+        skip()
+        {
+            if constexpr (Backend::sparse) {
+                while (cur_ < end_ && !cur_->revents)
+                    ++cur_;
+            }
+        }
+
+        const Backend *backend_ = nullptr;
+        const native_event *cur_ = nullptr;
+        const native_event *end_ = nullptr;
+    };
+
+    event_range(const Backend *backend, std::span<const native_event> events)
+        : backend_(backend), events_(events) {}
+
+    iterator begin() const { return { backend_, events_.data(), events_.data() + events_.size() }; }
+    iterator end() const { return { backend_, events_.data() + events_.size(), events_.data() + events_.size() }; }
+
+    bool empty() const { return begin() == end(); }
+
+private:
+    const Backend *backend_;
+    std::span<const native_event> events_;
+};
+
+/*
+ * The events of one c_backend::wait(), retrieved lazily from the
+ * struct xpoll by each increment.  As it consumes the batch, it may
+ * be iterated only once.
+ */
+template <>
+class event_range<c_backend> {
+public:
+    class iterator {
+    public:
+        using value_type = event;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        explicit iterator(struct xpoll *xpoll)
+            : xpoll_(xpoll)
+        {
+            ++*this;
+        }
+
+        event operator*() const { return ev_; }
+
+        iterator &
+        operator++()
+        {
+            ev_.revents = xpoll_revents_inline(xpoll_, &ev_.data);
+            return *this;
+        }
+
+        void operator++(int) { ++*this; }
+
+        bool operator==(std::default_sentinel_t) const { return !ev_.revents; }
+
+    private:
+        struct xpoll *xpoll_ = nullptr;
+        event ev_ = {};
+    };
+
+    event_range(const c_backend *backend, int n)
+        : xpoll_(backend->native()), n_(n) {}
+
+    iterator begin() const { return n_ > 0 ? iterator(xpoll_) : iterator(); }
+    std::default_sentinel_t end() const { return {}; }
+
+    /* Whether wait() returned nothing (stale handles aren't counted). */
+    bool empty() const { return n_ < 1; }
+
+private:
+    struct xpoll *xpoll_;
+    int n_;
+};
+
+template <class Backend>
+class loop;
+
+/*
+ * RAII handle for a fd registered with a loop, which deletes the fd
+ * from the loop when destroyed (but doesn't close it).  The loop must
+ * outlive (and must not be moved while there are) any registrations.
+ */
+template <class Backend>
+class registration {
+public:
+    registration() = default;
+
+    registration(Backend *backend, int fd, int events, void *data)
+        : backend_(backend), fd_(fd), events_(events), data_(data) {}
+
+    ~registration() { reset(); }
+
+    registration(registration &&other) noexcept
+        : backend_(std::exchange(other.backend_, nullptr)),
+          fd_(other.fd_), events_(other.events_), data_(other.data_) {}
+
+    registration &
+    operator=(registration &&other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            backend_ = std::exchange(other.backend_, nullptr);
+            fd_ = other.fd_;
+            events_ = other.events_;
+            data_ = other.data_;
+        }
+        return *this;
+    }
+
+    registration(const registration &) = delete;
+    registration &operator=(const registration &) = delete;
+
+    void enable(int events) { backend_->ctl(op::enable, events, fd_, data_); }
+    void disable(int events) { backend_->ctl(op::disable, events, fd_, data_); }
+
+    /*
+     * Delete the fd from the loop now.  Errors are ignored since the
+     * fd may already have been closed (which removes it implicitly
+     * from epoll(7) and kqueue(2)).
+     */
+    void
+    reset() noexcept
+    {
+        if (backend_) {
+            try {
+                backend_->ctl(op::del, events_, fd_, data_);
+            }
+            catch (const std::system_error &) {
+            }
+            backend_ = nullptr;
+        }
+    }
+
+    int fd() const { return fd_; }
+    explicit operator bool() const { return backend_ != nullptr; }
+
+private:
+    Backend *backend_ = nullptr;
+    int fd_ = -1;
+    int events_ = 0;
+    void *data_ = nullptr;
+};
+
+template <class Backend = default_backend>
+class loop {
+public:
+    using backend_type = Backend;
+
+    explicit loop(int fdmax = 1024)
+        : backend_(fdmax) {}
+
+    loop(loop &&) noexcept = default;
+    loop &operator=(loop &&) noexcept = default;
+    loop(const loop &) = delete;
+    loop &operator=(const loop &) = delete;
+
+    /*
+     * Register fd for the given events.  To be able to enable POLLOUT
+     * later on every platform, add POLLIN | POLLOUT and then disable
+     * POLLOUT.
+     */
+    [[nodiscard]] registration<Backend>
+    add(int fd, int events, void *data)
+    {
+        backend_.ctl(op::add, events, fd, data);
+
+        return { &backend_, fd, events, data };
+    }
+
+    event_range<Backend>
+    wait(int timeout)
+    {
+        return { &backend_, backend_.wait(timeout) };
+    }
+
+    Backend &backend() { return backend_; }
+
+private:
+    Backend backend_;
+};
+
+/*
+ * A task is a detached coroutine run by a co_loop.  It is created
+ * suspended, started by co_loop::spawn(), and destroyed by the loop
+ * upon completion.  The only allocation is that of the coroutine frame
+ * itself, once per task: suspending on an fd or a timer allocates
+ * nothing.
+ */
+class task {
+public:
+    struct promise_type {
+        int armfd = -1;             // fd whose events resume this task
+        int waitev = 0;             // events awaited on armfd, 0 if none
+        int revents = 0;            // events which resumed this task
+        int err = 0;                // errno if arming failed
+        std::exception_ptr ex;
+
+        task get_return_object() noexcept
+        {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { ex = std::current_exception(); }
+    };
+
+    using handle_type = std::coroutine_handle<promise_type>;
+
+    task(task &&other) noexcept
+        : h_(std::exchange(other.h_, nullptr)) {}
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+    task &operator=(task &&) = delete;
+
+    ~task()
+    {
+        if (h_)
+            h_.destroy();
+    }
+
+    handle_type release() { return std::exchange(h_, nullptr); }
+
+private:
+    explicit task(handle_type h) : h_(h) {}
+
+    handle_type h_;
+};
+
+/*
+ * co_loop resumes each suspended task directly from the revents loop:
+ * the task's coroutine handle is the data pointer given to ctl(), so
+ * there is no lookup between the event and the resumption.
+ *
+ * Since each fd has but one data pointer, at most one task may wait on
+ * a given fd at a time (e.g., one task per connection, which both reads
+ * and writes).  Interest is disarmed lazily: a task which awaits the
+ * same fd and events as last time costs no ctl() at all.  Should the
+ * fd become ready while its task is suspended on something else, the
+ * stale event disarms it.  A task which switches fds disarms its
+ * previous fd, and completion disarms its current fd.  Disarming
+ * deletes the fd, since epoll reports POLLHUP and POLLERR even for an
+ * fd with no events enabled.
+ *
+ * Fds must be closed via close() (or at least forget()) rather than
+ * close(2), so that the loop can forget their registration before the
+ * fd number is reused.  A task still waiting on the fd (e.g., when a
+ * timeout task closes its connection) is then resumed with POLLHUP.
+ * A readable or writable resumption means only
+ * that the fd may be ready; as with any level-triggered loop the task
+ * should retry its I/O and suspend again upon EAGAIN.
+ */
+template <class Backend = default_backend>
+class co_loop {
+public:
+    using backend_type = Backend;
+    using clock = std::chrono::steady_clock;
+    using handle_type = task::handle_type;
+
+    explicit co_loop(int fdmax = 1024)
+        : backend_(fdmax), maskv_(fdmax), armv_(fdmax), waitv_(fdmax) {}
+
+    ~co_loop()
+    {
+        for (auto &t : timerv_)
+            t.h.destroy();
+        for (auto h : waitv_)
+            if (h)
+                h.destroy();
+        for (auto h : readyv_)
+            h.destroy();
+    }
+
+    co_loop(const co_loop &) = delete;
+    co_loop &operator=(const co_loop &) = delete;
+
+    class io_awaiter {
+    public:
+        io_awaiter(co_loop *loop, int fd, int events)
+            : loop_(loop), fd_(fd), events_(events) {}
+
+        bool await_ready() const noexcept { return false; }
+
+        bool
+        await_suspend(handle_type h) noexcept
+        {
+            h_ = h;
+            return loop_->arm(h, fd_, events_);
+        }
+
+        /*
+         * Return the events which resumed the task, which may include
+         * POLLERR or POLLHUP rather than those awaited.
+         */
+        int
+        await_resume()
+        {
+            auto &p = h_.promise();
+
+            if (p.err) {
+                errno = std::exchange(p.err, 0);
+                throw_errno("co_loop::arm");
+            }
+
+            return p.revents;
+        }
+
+    private:
+        co_loop *loop_;
+        int fd_;
+        int events_;
+        handle_type h_;
+    };
+
+    class sleep_awaiter {
+    public:
+        sleep_awaiter(co_loop *loop, clock::time_point when)
+            : loop_(loop), when_(when) {}
+
+        bool await_ready() const noexcept { return when_ <= clock::now(); }
+        void await_suspend(handle_type h) { loop_->sleep_until(h, when_); }
+        void await_resume() const noexcept {}
+
+    private:
+        co_loop *loop_;
+        clock::time_point when_;
+    };
+
+    io_awaiter readable(int fd) { return { this, fd, POLLIN }; }
+    io_awaiter writable(int fd) { return { this, fd, POLLOUT }; }
+
+    template <class Rep, class Period>
+    sleep_awaiter
+    sleep(std::chrono::duration<Rep, Period> dur)
+    {
+        return { this, clock::now() + std::chrono::duration_cast<clock::duration>(dur) };
+    }
+
+    /*
+     * Take ownership of the given task and run it until it first
+     * suspends.
+     */
+    void
+    spawn(task &&t)
+    {
+        ++ntasks_;
+        resume(t.release());
+    }
+
+    /*
+     * Delete fd from the loop, but don't close it.  A task waiting on
+     * fd is queued to resume with POLLHUP.
+     */
+    void
+    forget(int fd) noexcept
+    {
+        if (fd < 0 || static_cast<size_t>(fd) >= maskv_.size() || !armv_[fd])
+            return;
+
+        disarm(*armv_[fd]);
+
+        if (handle_type h = std::exchange(waitv_[fd], nullptr)) {
+            auto &p = h.promise();
+
+            p.revents = POLLHUP;
+            p.waitev = 0;
+            readyv_.push_back(h);
+        }
+    }
+
+    int
+    close(int fd) noexcept
+    {
+        forget(fd);
+
+        return ::close(fd);
+    }
+
+    /*
+     * Wait for and dispatch one batch of events and expired timers.
+     */
+    void
+    run_once(int timeout)
+    {
+        if (!timerv_.empty()) {
+            auto ms = std::chrono::ceil<std::chrono::milliseconds>(timerv_.front().when - clock::now());
+            int tmo = std::max<long>(0, std::min<long>(ms.count(), INT32_MAX));
+
+            if (timeout < 0 || tmo < timeout)
+                timeout = tmo;
+        }
+
+        if (!readyv_.empty())
+            timeout = 0;
+
+        for (event ev : event_range<Backend>(&backend_, backend_.wait(timeout))) {
+            if (!ev.data)
+                continue;
+
+            handle_type h = handle_type::from_address(ev.data);
+            auto &p = h.promise();
+
+            if (!p.waitev) {
+                disarm(p);
+                continue;
+            }
+
+            p.revents = ev.revents;
+            p.waitev = 0;
+            waitv_[p.armfd] = nullptr;
+            resume(h);
+        }
+
+        if (!timerv_.empty()) {
+            auto now = clock::now();
+
+            while (!timerv_.empty() && timerv_.front().when <= now) {
+                std::pop_heap(timerv_.begin(), timerv_.end());
+                handle_type h = timerv_.back().h;
+                timerv_.pop_back();
+                resume(h);
+            }
+        }
+
+        /* Tasks whose fd was closed by another task (see forget()). */
+        while (!readyv_.empty()) {
+            handle_type h = readyv_.back();
+            readyv_.pop_back();
+            resume(h);
+        }
+    }
+
+    /*
+     * Run until all spawned tasks have completed.
+     */
+    void
+    run()
+    {
+        while (ntasks_ > 0)
+            run_once(-1);
+    }
+
+    size_t ntasks() const { return ntasks_; }
+    Backend &backend() { return backend_; }
+
+private:
+    static constexpr uint8_t REG = 0x80;    // fd has been added
+
+    struct timer {
+        clock::time_point when;
+        handle_type h;
+
+        /* Inverted such that the heap's front is the earliest. */
+        bool operator<(const timer &rhs) const { return when > rhs.when; }
+    };
+
+    /*
+     * Arrange for h to be resumed when fd is ready for the given events.
+     * Returns false (i.e., don't suspend) if that fails, in which case
+     * await_resume() throws.
+     */
+    bool
+    arm(handle_type h, int fd, int events) noexcept
+    {
+        auto &p = h.promise();
+
+        try {
+            if (fd < 0 || static_cast<size_t>(fd) >= maskv_.size()) {
+                errno = (fd < 0) ? EBADF : EINVAL;
+                throw_errno("co_loop::arm");
+            }
+
+            if (p.armfd != fd)
+                disarm(p);
+
+            /* Take fd over from whichever task last armed it. */
+            if (armv_[fd] && armv_[fd] != &p)
+                armv_[fd]->armfd = -1;
+
+            uint8_t m = maskv_[fd];
+
+            /*
+             * Add both POLLIN and POLLOUT such that either may be enabled
+             * later on every platform, then disable what isn't wanted.
+             */
+            if (!m) {
+                backend_.ctl(op::add, POLLIN | POLLOUT, fd, h.address());
+                m = REG | POLLIN | POLLOUT;
+            }
+            else if ((m & events) != events || p.armfd != fd) {
+                backend_.ctl(op::enable, events, fd, h.address());
+                m |= events;
+            }
+
+            if (m & ~REG & ~events) {
+                backend_.ctl(op::disable, m & ~REG & ~events, fd, h.address());
+                m &= REG | events;
+            }
+
+            maskv_[fd] = m;
+        }
+        catch (const std::system_error &ex) {
+            p.err = ex.code().value();
+            return false;
+        }
+
+        armv_[fd] = &p;
+        p.armfd = fd;
+        p.waitev = events;
+        waitv_[fd] = h;
+
+        return true;
+    }
+
+    /*
+     * Delete the task's armed fd (unless another task has since armed
+     * it), such that the next arm() adds it again.
+     */
+    void
+    disarm(task::promise_type &p) noexcept
+    {
+        int fd = std::exchange(p.armfd, -1);
+
+        if (fd < 0 || armv_[fd] != &p)
+            return;
+
+        try {
+            backend_.ctl(op::del, POLLIN | POLLOUT, fd, nullptr);
+        }
+        catch (const std::system_error &) {
+        }
+
+        maskv_[fd] = 0;
+        armv_[fd] = nullptr;
+    }
+
+    void
+    sleep_until(handle_type h, clock::time_point when)
+    {
+        timerv_.push_back({ when, h });
+        std::push_heap(timerv_.begin(), timerv_.end());
+    }
+
+    /*
+     * Resume the given task, and destroy it if it ran to completion.
+     * An exception which escaped the task is rethrown to the caller
+     * of run().
+     */
+    void
+    resume(handle_type h)
+    {
+        auto &p = h.promise();
+        auto *prev = std::exchange(cur_, &p);
+
+        h.resume();
+        cur_ = prev;
+
+        if (h.done()) {
+            std::exception_ptr ex = std::move(p.ex);
+
+            disarm(p);
+            h.destroy();
+            --ntasks_;
+
+            if (ex)
+                std::rethrow_exception(ex);
+        }
+    }
+
+    Backend backend_;
+    std::vector<uint8_t> maskv_;            // REG plus enabled events
+    std::vector<task::promise_type *> armv_;    // task armed on each fd
+    std::vector<handle_type> waitv_;        // tasks waiting by fd
+    std::vector<handle_type> readyv_;       // tasks to resume (see forget())
+    std::vector<timer> timerv_;             // min-heap of sleeping tasks
+    task::promise_type *cur_ = nullptr;     // task currently running
+    size_t ntasks_ = 0;
+};
+
+} // namespace xpp
+
+#endif /* XPOLL_HPP */
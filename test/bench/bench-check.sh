@@ -0,0 +1,131 @@
+#!/bin/sh
+#
+# Run a fixed matrix of looptest configurations and compare the results
+# against a baseline, failing if the median rate of any configuration
+# drops by more than THRESHOLD percent, or if its p99 hop latency grows
+# by more than P99_THRESHOLD percent.  With -b the results are instead
+# written to the baseline file.
+#
+# usage: bench-check.sh [-b] [-f baseline] looptest...
+#
+# The environment variables BENCH_ARGS, BENCH_CONNS, BENCH_TOKENS,
+# THRESHOLD and P99_THRESHOLD override the defaults below.
+
+FORMAT=1
+
+BENCH_ARGS=${BENCH_ARGS:-"-w 1 -d 2 -n 5"}
+BENCH_CONNS=${BENCH_CONNS:-"8 1000"}
+BENCH_TOKENS=${BENCH_TOKENS:-"1 16"}
+THRESHOLD=${THRESHOLD:-5}
+P99_THRESHOLD=${P99_THRESHOLD:-10}
+
+PROG=$(basename $0)
+BASEDIR=$(dirname $0)
+BASELINE=${BASEDIR}/baseline.csv
+RESULTS=${BASEDIR}/results.csv
+MKBASE=0
+
+while getopts ":bf:" opt ; do
+    case $opt in
+    b) MKBASE=1 ;;
+    f) BASELINE=${OPTARG} ;;
+    *) echo "usage: ${PROG} [-b] [-f baseline] looptest..." >&2 ; exit 2 ;;
+    esac
+done
+
+shift $((OPTIND - 1))
+
+if [ $# -lt 1 ] ; then
+    echo "usage: ${PROG} [-b] [-f baseline] looptest..." >&2
+    exit 2
+fi
+
+if [ ${MKBASE} -eq 0 ] && [ ! -f "${BASELINE}" ] ; then
+    echo "${PROG}: no baseline ${BASELINE}, run 'gmake bench-baseline' first" >&2
+    exit 2
+fi
+
+# Each configuration uses two fds per connection.
+ulimit -n 4096 2>/dev/null
+
+REV=$(git -C ${BASEDIR} describe --always --dirty 2>/dev/null || echo unknown)
+
+{
+    echo "# xpoll looptest baseline, format ${FORMAT}"
+    echo "# rev ${REV}, $(uname -srm), $(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    echo "# args ${BENCH_ARGS}"
+    echo "mechanism,connections,tokens,median,ci95,p99"
+} > ${RESULTS}
+
+for looptest in "$@" ; do
+    for conns in ${BENCH_CONNS} ; do
+        for tokens in ${BENCH_TOKENS} ; do
+            out=$(${looptest} ${BENCH_ARGS} -L -o csv -t ${tokens} ${conns})
+            if [ $? -ne 0 ] ; then
+                echo "${PROG}: ${looptest} failed" >&2
+                exit 1
+            fi
+
+            echo "${out}" | awk -F, '
+                NR == 1 { for (i = 1; i <= NF; ++i) col[$i] = i; next }
+                { printf "%s,%s,%s,%s,%s,%s\n",
+                    $col["mechanism"], $col["connections"],
+                    $col["tokens"], $col["median"], $col["ci95"],
+                    $col["p99"] }' >> ${RESULTS}
+
+            tail -n 1 ${RESULTS}
+        done
+    done
+done
+
+if [ ${MKBASE} -ne 0 ] ; then
+    cp ${RESULTS} ${BASELINE}
+    echo "${PROG}: wrote ${BASELINE}"
+    exit 0
+fi
+
+if ! head -n 1 ${BASELINE} | grep -q "format ${FORMAT}\$" ; then
+    echo "${PROG}: ${BASELINE} is not a format ${FORMAT} baseline" >&2
+    exit 2
+fi
+
+if ! grep -q "^# args ${BENCH_ARGS}\$" ${BASELINE} ; then
+    echo "${PROG}: warning: baseline was not run with args '${BENCH_ARGS}'" >&2
+fi
+
+awk -F, -v thresh=${THRESHOLD} -v p99thresh=${P99_THRESHOLD} '
+    /^#/ || /^mechanism,/ { next }
+    FILENAME == ARGV[1] {
+        key = $1 "," $2 "," $3
+        base[key] = $4
+        basep99[key] = $6
+        next
+    }
+    {
+        key = $1 "," $2 "," $3
+        if (!(key in base)) {
+            printf "%-24s  no baseline\n", key
+            next
+        }
+
+        verdict = "ok"
+        drate = (base[key] > 0) ? ($4 - base[key]) * 100 / base[key] : 0
+        dp99 = (basep99[key] > 0) ? ($6 - basep99[key]) * 100 / basep99[key] : 0
+
+        if (drate < -thresh || dp99 > p99thresh) {
+            verdict = "REGRESSED"
+            ++failed
+        }
+
+        printf "%-24s  rate %+7.2f%%  p99 %+7.2f%%  %s\n", key, drate, dp99, verdict
+    }
+    END { exit (failed > 0) }
+' ${BASELINE} ${RESULTS}
+
+rc=$?
+
+if [ ${rc} -ne 0 ] ; then
+    echo "${PROG}: performance regressed beyond ${THRESHOLD}% rate or ${P99_THRESHOLD}% p99" >&2
+fi
+
+exit ${rc}
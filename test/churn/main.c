@@ -0,0 +1,651 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * churn measures the cost of connection setup and teardown rather than
+ * steady-state readiness.  A single xpoll event loop drives both ends
+ * of up to conc concurrent loopback TCP connections, each of which:
+ *
+ *   1) is connected (non-blocking) by the client, which registers it
+ *      for POLLOUT to learn when the connect completes,
+ *   2) is accepted by the server and registered for POLLIN,
+ *   3) carries one request from the client to the server and one
+ *      response back, after which
+ *   4) the client deletes its end from xpoll, closes it, and starts a
+ *      new connection in its place, while
+ *   5) the server deletes and closes its end upon reading EOF.
+ *
+ * By default each connection's state is malloc()ed.  With -S it is
+ * allocated from an xpoll slab as the fd is added, and released back
+ * to the slab as the fd is deleted.
+ *
+ * It reports connections/sec along with the number of xpoll_ctl()
+ * calls and the time spent in them per connection.
+ */
+
+#ifndef INFTIM
+#define INFTIM (-1)
+#endif
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+enum ctype {
+    CTYPE_LISTENER,
+    CTYPE_CLIENT,
+    CTYPE_SERVER,
+};
+
+struct conn {
+    int fd;
+    enum ctype type;
+    uint64_t tstart;        // time at which the client started connecting
+};
+
+struct stats {
+    uint64_t nconns;        // connections completed
+    uint64_t nctl;          // calls to xpoll_ctl()
+    uint64_t ctlns;         // nanoseconds spent in xpoll_ctl()
+    uint64_t acceptns;      // nanoseconds spent accepting and registering
+    struct bench_hist hist; // connection lifetime (connect through close)
+};
+
+volatile sig_atomic_t sigalrm;
+
+struct sockaddr_in laddr;
+struct stats stats;
+struct xpoll_slab slab;
+int useslab;
+size_t msgsz;
+char *msgbuf;
+int fdmax;
+int abortive;
+int batch;
+char *progname;
+
+void
+sigalrm_isr(int sig)
+{
+    if (sig == SIGALRM)
+        sigalrm = 1;
+}
+
+static void
+usage(void)
+{
+    printf("usage: %s [-arS] [-c conc] [-d secs] [-m msgsz] [-o fmt] "
+           "[-w secs]\n", progname);
+    printf("-a        accept via xpoll_accept_batch() (registrations are\n");
+    printf("          then timed as part of accept, not xpoll_ctl)\n");
+    printf("-c conc   number of concurrent connections (default: 64)\n");
+    printf("-d secs   duration of the measured run (default: 10)\n");
+    printf("-h        print this help list\n");
+    printf("-m msgsz  request and response size in bytes (default: 64)\n");
+    printf("-o fmt    output format: text, json, or csv (default: text)\n");
+    printf("-r        clients close with a reset (avoids TIME_WAIT)\n");
+    printf("-S        allocate connection state from an xpoll slab\n");
+    printf("-w secs   duration of the unmeasured warmup (default: 1)\n");
+}
+
+/*
+ * Call xpoll_ctl(), accounting for the time spent in it.  Failure is
+ * fatal as the benchmark cannot meaningfully continue.
+ */
+static void
+ctl(struct xpoll *xpoll, int op, int events, struct conn *conn)
+{
+    uint64_t start;
+    int rc;
+
+    start = bench_nsecs();
+    rc = xpoll_ctl(xpoll, op, events, conn->fd, conn);
+    stats.ctlns += bench_nsecs() - start;
+    stats.nctl++;
+
+    if (rc) {
+        fprintf(stderr, "%s: xpoll_ctl(%d, %d, %d): %s\n",
+                progname, op, events, conn->fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+/*
+ * Allocate a connection and add its fd for the given events, via the
+ * slab with -S (which both allocates and adds), otherwise via malloc()
+ * and xpoll_ctl().
+ */
+static struct conn *
+conn_add(struct xpoll *xpoll, int events, int fd, enum ctype type)
+{
+    struct conn *conn;
+
+    if (useslab) {
+        uint64_t start = bench_nsecs();
+
+        conn = xpoll_add_obj(xpoll, events, fd);
+        stats.ctlns += bench_nsecs() - start;
+        stats.nctl++;
+
+        if (!conn) {
+            fprintf(stderr, "%s: xpoll_add_obj(%d, %d): %s\n",
+                    progname, events, fd, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        conn->fd = fd;
+        conn->type = type;
+
+        return conn;
+    }
+
+    conn = malloc(sizeof(*conn));
+    if (!conn)
+        exit(EX_OSERR);
+
+    conn->fd = fd;
+    conn->type = type;
+
+    ctl(xpoll, XPOLL_ADD, events, conn);
+
+    return conn;
+}
+
+static void
+conn_close(struct xpoll *xpoll, struct conn *conn)
+{
+    enum ctype type = conn->type;
+    int fd = conn->fd;
+
+    /* With -S deleting the fd releases conn back to the slab. */
+    ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, conn);
+
+    if (abortive && type == CTYPE_CLIENT) {
+        struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    close(fd);
+
+    if (!useslab)
+        free(conn);
+}
+
+/*
+ * Start a new non-blocking connection to the listener.  The client
+ * is registered for POLLOUT to learn when the connect completes, and
+ * for POLLIN to receive the response.
+ */
+static void
+client_start(struct xpoll *xpoll)
+{
+    struct conn *conn;
+    int one = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
+        fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (fd >= fdmax) {
+        fprintf(stderr, "%s: fd %d exceeds fdmax %d\n", progname, fd, fdmax);
+        exit(EX_SOFTWARE);
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&laddr, sizeof(laddr)) && errno != EINPROGRESS) {
+        fprintf(stderr, "%s: connect: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    conn = conn_add(xpoll, POLLIN | POLLOUT, fd, CTYPE_CLIENT);
+    conn->tstart = bench_nsecs();
+}
+
+/*
+ * Called by xpoll_accept_batch() for each accepted fd.  With -S arg is
+ * the fd's newly allocated slab object, otherwise it is unused.
+ */
+static void *
+server_conn(int fd, void *arg)
+{
+    struct conn *conn;
+
+    if (fd >= fdmax) {
+        fprintf(stderr, "%s: fd %d exceeds fdmax %d\n", progname, fd, fdmax);
+        exit(EX_SOFTWARE);
+    }
+
+    conn = useslab ? arg : malloc(sizeof(*conn));
+    if (!conn)
+        exit(EX_OSERR);
+
+    conn->fd = fd;
+    conn->type = CTYPE_SERVER;
+
+    return conn;
+}
+
+/*
+ * Accept all pending connections on the listener and register each
+ * for POLLIN.
+ */
+static void
+server_accept(struct xpoll *xpoll, struct conn *listener)
+{
+    uint64_t start = bench_nsecs();
+
+    if (batch) {
+        int n;
+
+        n = xpoll_accept_batch(xpoll, listener->fd, NULL, INT_MAX,
+                               POLLIN, server_conn, NULL);
+        if (n == -1) {
+            fprintf(stderr, "%s: xpoll_accept_batch: %s\n",
+                    progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        stats.acceptns += bench_nsecs() - start;
+        stats.nctl += n;
+        return;
+    }
+
+    while (1) {
+        int fd;
+
+        fd = accept(listener->fd, NULL, NULL);
+        if (fd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ||
+                errno == ECONNABORTED)
+                break;
+
+            fprintf(stderr, "%s: accept: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        if (fd >= fdmax) {
+            fprintf(stderr, "%s: fd %d exceeds fdmax %d\n", progname, fd, fdmax);
+            exit(EX_SOFTWARE);
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        conn_add(xpoll, POLLIN, fd, CTYPE_SERVER);
+    }
+
+    stats.acceptns += bench_nsecs() - start;
+}
+
+/*
+ * Handle one event on a client or server connection.  Messages are
+ * small enough that they are always read and written in one call
+ * on loopback.  Returns -1 on error.
+ */
+static int
+conn_event(struct xpoll *xpoll, struct conn *conn, int revents)
+{
+    ssize_t cc;
+
+    if (conn->type == CTYPE_SERVER) {
+        cc = read(conn->fd, msgbuf, msgsz);
+        if (cc == -1 && errno == EAGAIN)
+            return 0;
+
+        if (cc == 0 || (cc == -1 && errno == ECONNRESET)) {
+            conn_close(xpoll, conn);
+            return 0;
+        }
+
+        if (cc != (ssize_t)msgsz)
+            return -1;
+
+        cc = write(conn->fd, msgbuf, msgsz);
+        if (cc != (ssize_t)msgsz)
+            return -1;
+
+        return 0;
+    }
+
+    if (revents & (POLLERR | POLLHUP)) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    if (revents & POLLOUT) {
+        int err = 0;
+        socklen_t errlen = sizeof(err);
+
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &errlen) || err) {
+            errno = err;
+            return -1;
+        }
+
+        ctl(xpoll, XPOLL_DISABLE, POLLOUT, conn);
+
+        cc = write(conn->fd, msgbuf, msgsz);
+        if (cc != (ssize_t)msgsz)
+            return -1;
+    }
+
+    if (revents & POLLIN) {
+        cc = read(conn->fd, msgbuf, msgsz);
+        if (cc == -1 && errno == EAGAIN)
+            return 0;
+        if (cc != (ssize_t)msgsz)
+            return -1;
+
+        bench_hist_add(&stats.hist, bench_nsecs() - conn->tstart);
+        stats.nconns++;
+
+        conn_close(xpoll, conn);
+        client_start(xpoll);
+    }
+
+    return 0;
+}
+
+/*
+ * Run the event loop until the alarm fires.  Returns 0 on success,
+ * otherwise -1.
+ */
+static int
+loop(struct xpoll *xpoll, u_int secs)
+{
+    sigalrm = 0;
+    alarm(secs);
+
+    while (!sigalrm) {
+        struct conn *conn;
+        int revents;
+        int n;
+
+        n = xpoll_wait(xpoll, INFTIM);
+        if (n < 1) {
+            if (-1 == n && errno == EINTR)
+                continue;
+
+            fprintf(stderr, "%s: xpoll_wait: %s\n", progname,
+                    (-1 == n) ? strerror(errno) : "timeout");
+            return -1;
+        }
+
+        while ((revents = xpoll_revents(xpoll, (void **)&conn))) {
+            if (conn->type == CTYPE_LISTENER) {
+                server_accept(xpoll, conn);
+                continue;
+            }
+
+            errno = 0;
+
+            if (conn_event(xpoll, conn, revents)) {
+                fprintf(stderr, "%s: %s fd %d: %s\n", progname,
+                        conn->type == CTYPE_CLIENT ? "client" : "server",
+                        conn->fd, errno ? strerror(errno) : "short I/O");
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct conn listener;
+    struct xpoll *xpoll;
+    const char *fmt;
+    u_int warmup, secs;
+    double elapsed;
+    int conc;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    abortive = 0;
+    msgsz = 64;
+    conc = 64;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":ac:d:hm:o:rSw:"))) {
+        switch (rc) {
+        case 'a':
+            batch = 1;
+            break;
+
+        case 'c':
+            conc = bench_getnum(rc, optarg, 1, 100000);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 65536);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'r':
+            abortive = 1;
+            break;
+
+        case 'S':
+            useslab = 1;
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGALRM, sigalrm_isr);
+
+    msgbuf = calloc(1, msgsz);
+    if (!msgbuf)
+        exit(EX_OSERR);
+
+    /*
+     * Each connection consumes two fds, but a server fd is not closed
+     * until after the client has moved on to its next connection.
+     */
+    fdmax = conc * 4 + 16;
+
+    listener.type = CTYPE_LISTENER;
+    listener.fd = net_listen(&laddr, SOMAXCONN);
+    net_setnonblock(listener.fd, 1);
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (useslab) {
+        if (xpoll_slab_init(&slab, sizeof(struct conn), 0) ||
+            xpoll_slab_attach(xpoll, &slab)) {
+            fprintf(stderr, "%s: xpoll_slab: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    rc = xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, listener.fd, &listener);
+    if (rc) {
+        fprintf(stderr, "%s: xpoll_ctl: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    for (i = 0; i < conc; ++i)
+        client_start(xpoll);
+
+    rc = 0;
+    if (warmup > 0)
+        rc = loop(xpoll, warmup);
+
+    memset(&stats, 0, sizeof(stats));
+    bench_hist_init(&stats.hist);
+
+#if XPOLL_STATS
+    xpoll_stats_reset(xpoll);
+#endif
+
+    gettimeofday(&tv_start, NULL);
+    if (!rc)
+        rc = loop(xpoll, secs);
+    gettimeofday(&tv_stop, NULL);
+
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"concurrency\": %d, \"msgsz\": %zu, "
+               "\"secs\": %.3lf, \"connections\": %lu, \"cps\": %.2lf, "
+               "\"ctl_per_conn\": %.2lf, \"ctl_ns_per_conn\": %.1lf, "
+               "\"ctl_ns_per_call\": %.1lf, \"accept_ns_per_conn\": %.1lf, "
+               "\"allocator\": \"%s\", \"lifetime_ns\": { \"p50\": %lu, "
+               "\"p99\": %lu, \"max\": %lu } }\n",
+               mechanism, conc, msgsz, elapsed, stats.nconns,
+               stats.nconns / elapsed,
+               stats.nconns ? (double)stats.nctl / stats.nconns : 0,
+               stats.nconns ? (double)stats.ctlns / stats.nconns : 0,
+               stats.nctl ? (double)stats.ctlns / stats.nctl : 0,
+               stats.nconns ? (double)stats.acceptns / stats.nconns : 0,
+               useslab ? "slab" : "malloc",
+               bench_hist_pct(&stats.hist, 50), bench_hist_pct(&stats.hist, 99),
+               stats.hist.max);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,concurrency,msgsz,secs,connections,cps,"
+               "ctl_per_conn,ctl_ns_per_conn,ctl_ns_per_call,accept_ns_per_conn,"
+               "p50,p99,max\n");
+        printf("%s,%d,%zu,%.3lf,%lu,%.2lf,%.2lf,%.1lf,%.1lf,%.1lf,%lu,%lu,%lu\n",
+               mechanism, conc, msgsz, elapsed, stats.nconns,
+               stats.nconns / elapsed,
+               stats.nconns ? (double)stats.nctl / stats.nconns : 0,
+               stats.nconns ? (double)stats.ctlns / stats.nconns : 0,
+               stats.nctl ? (double)stats.ctlns / stats.nctl : 0,
+               stats.nconns ? (double)stats.acceptns / stats.nconns : 0,
+               bench_hist_pct(&stats.hist, 50), bench_hist_pct(&stats.hist, 99),
+               stats.hist.max);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12s  allocator\n", useslab ? "slab" : "malloc");
+        printf("%12d  concurrent connections\n", conc);
+        printf("%12zu  message bytes\n", msgsz);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  total connections\n", stats.nconns);
+        printf("%12.2lf  connections/sec\n", stats.nconns / elapsed);
+        printf("%12.2lf  xpoll_ctl calls/conn\n",
+               stats.nconns ? (double)stats.nctl / stats.nconns : 0);
+        printf("%12.1lf  xpoll_ctl ns/conn\n",
+               stats.nconns ? (double)stats.ctlns / stats.nconns : 0);
+        printf("%12.1lf  xpoll_ctl ns/call\n",
+               stats.nctl ? (double)stats.ctlns / stats.nctl : 0);
+        printf("%12.1lf  accept ns/conn\n",
+               stats.nconns ? (double)stats.acceptns / stats.nconns : 0);
+        printf("%12.2lf  lifetime p50 (us)\n",
+               bench_hist_pct(&stats.hist, 50) / 1000.0);
+        printf("%12.2lf  lifetime p99 (us)\n",
+               bench_hist_pct(&stats.hist, 99) / 1000.0);
+
+#if XPOLL_STATS
+        printf("\n");
+        xpoll_stats_print(xpoll, stdout);
+#endif
+    }
+
+    xpoll_destroy(xpoll);
+    close(listener.fd);
+    free(msgbuf);
+
+    if (useslab)
+        xpoll_slab_fini(&slab);
+
+    return rc ? EX_SOFTWARE : 0;
+}
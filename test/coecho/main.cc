@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sysexits.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.hpp"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * coecho compares an echo server written as C++20 coroutines over
+ * xpp::co_loop with the same server written as a conventional callback
+ * state machine over the C API.  Both use lib/xpoll.c underneath (via
+ * xpp::c_backend), so the difference is the cost of the programming
+ * model.  A client thread keeps one -m msgsz request outstanding on
+ * each of -c loopback TCP connections and counts round trips, while a
+ * server thread echoes them back (-k selects the callback server).
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct cconn {
+    int fd;
+    size_t off;             // bytes of the current response received
+};
+
+/*
+ * Callback server connection: the state which the coroutine server
+ * keeps implicitly in its frame must be kept here explicitly.
+ */
+struct sconn {
+    int fd;
+    int events;             // events currently enabled
+    size_t len;             // bytes in buf pending echo
+    size_t off;             // bytes of buf echoed so far
+    char buf[];
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+
+std::vector<int> sfdv;
+std::vector<int> cfdv;
+unsigned long nrequests;
+size_t msgsz;
+int fdmax;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-k] [-c conns] [-d secs] [-m msgsz] [-o fmt] [-w secs]\n",
+           progname);
+    printf("-c conns     number of connections (default: 64)\n");
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-h           print this help list\n");
+    printf("-k           use the callback server rather than coroutines\n");
+    printf("-m msgsz     request size in bytes (default: 64)\n");
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+}
+
+static xpp::task
+co_echo(xpp::co_loop<xpp::c_backend> &loop, int fd)
+{
+    std::vector<char> buf(msgsz);
+    ssize_t cc, off;
+
+    while (phase < 2) {
+        cc = read(fd, buf.data(), msgsz);
+        if (cc == -1 && errno == EAGAIN) {
+            co_await loop.readable(fd);
+            continue;
+        }
+
+        if (cc < 1)
+            break;
+
+        for (off = 0; off < cc; ) {
+            ssize_t n = write(fd, buf.data() + off, cc - off);
+
+            if (n == -1 && errno == EAGAIN) {
+                co_await loop.writable(fd);
+                continue;
+            }
+
+            if (n == -1)
+                co_return;
+
+            off += n;
+        }
+    }
+
+    loop.forget(fd);
+}
+
+static void *
+co_server_main(void *arg)
+{
+    (void)arg;
+
+    try {
+        xpp::co_loop<xpp::c_backend> loop(fdmax);
+
+        for (int fd : sfdv)
+            loop.spawn(co_echo(loop, fd));
+
+        while (phase < 2 && loop.ntasks() > 0)
+            loop.run_once(100);
+    }
+    catch (const std::system_error &ex) {
+        fprintf(stderr, "%s: %s\n", progname, ex.what());
+        exit(EX_OSERR);
+    }
+
+    return NULL;
+}
+
+static void
+cb_ctl(struct xpoll *xpoll, int op, int events, struct sconn *conn)
+{
+    if (xpoll_ctl(xpoll, op, events, conn->fd, conn))
+        bench_fatal("xpoll_ctl");
+
+    if (op == XPOLL_DISABLE)
+        conn->events &= ~events;
+    else
+        conn->events |= events;
+}
+
+static void
+cb_event(struct xpoll *xpoll, struct sconn *conn, int revents)
+{
+    ssize_t cc;
+
+    (void)revents;
+
+    for (;;) {
+        if (conn->off == conn->len) {
+            cc = read(conn->fd, conn->buf, msgsz);
+            if (cc == -1 && errno == EAGAIN)
+                break;
+
+            if (cc < 1) {
+                xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, conn->fd, NULL);
+                return;
+            }
+
+            conn->len = cc;
+            conn->off = 0;
+        }
+
+        cc = write(conn->fd, conn->buf + conn->off, conn->len - conn->off);
+        if (cc == -1 && errno == EAGAIN)
+            break;
+
+        if (cc == -1) {
+            xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, conn->fd, NULL);
+            return;
+        }
+
+        conn->off += cc;
+    }
+
+    /*
+     * Wait for POLLOUT (rather than POLLIN) while a partial response
+     * remains to be echoed, and vice versa.
+     */
+    if (conn->off < conn->len) {
+        if (!(conn->events & POLLOUT)) {
+            cb_ctl(xpoll, XPOLL_ENABLE, POLLOUT, conn);
+            cb_ctl(xpoll, XPOLL_DISABLE, POLLIN, conn);
+        }
+    }
+    else if (!(conn->events & POLLIN)) {
+        cb_ctl(xpoll, XPOLL_ENABLE, POLLIN, conn);
+        cb_ctl(xpoll, XPOLL_DISABLE, POLLOUT, conn);
+    }
+}
+
+static void *
+cb_server_main(void *arg)
+{
+    std::vector<struct sconn *> connv;
+    struct xpoll *xpoll;
+
+    (void)arg;
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll)
+        bench_fatal("xpoll_create");
+
+    for (int fd : sfdv) {
+        struct sconn *conn;
+
+        conn = (struct sconn *)calloc(1, sizeof(*conn) + msgsz);
+        if (!conn)
+            bench_fatal("calloc");
+
+        conn->fd = fd;
+        cb_ctl(xpoll, XPOLL_ADD, POLLIN | POLLOUT, conn);
+        cb_ctl(xpoll, XPOLL_DISABLE, POLLOUT, conn);
+        connv.push_back(conn);
+    }
+
+    while (phase < 2) {
+        struct sconn *conn;
+        int revents;
+        int n;
+
+        n = xpoll_wait(xpoll, 100);
+        if (n == -1 && errno != EINTR)
+            bench_fatal("xpoll_wait");
+
+        while (n-- > 0) {
+            revents = xpoll_revents(xpoll, (void **)&conn);
+            if (revents)
+                cb_event(xpoll, conn, revents);
+        }
+    }
+
+    xpoll_destroy(xpoll);
+
+    for (auto conn : connv)
+        free(conn);
+
+    return NULL;
+}
+
+static void *
+client_main(void *arg)
+{
+    std::vector<struct cconn> connv(cfdv.size());
+    unsigned long nreqs = 0;
+    struct xpoll *xpoll;
+    char *msg, *buf;
+    int measuring = 0;
+
+    (void)arg;
+
+    msg = (char *)calloc(2, msgsz);
+    if (!msg)
+        bench_fatal("calloc");
+    buf = msg + msgsz;
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll)
+        bench_fatal("xpoll_create");
+
+    for (size_t i = 0; i < cfdv.size(); ++i) {
+        connv[i].fd = cfdv[i];
+
+        if (xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, cfdv[i], &connv[i]))
+            bench_fatal("xpoll_ctl");
+
+        if (write(cfdv[i], msg, msgsz) != (ssize_t)msgsz)
+            bench_fatal("write");
+    }
+
+    while (phase < 2) {
+        struct cconn *conn;
+        int revents;
+        int n;
+
+        if (phase == 1 && !measuring) {
+            nreqs = 0;
+            measuring = 1;
+        }
+
+        n = xpoll_wait(xpoll, 100);
+        if (n == -1 && errno != EINTR)
+            bench_fatal("xpoll_wait");
+
+        while (n-- > 0) {
+            ssize_t cc;
+
+            revents = xpoll_revents(xpoll, (void **)&conn);
+            if (!(revents & (POLLIN | POLLERR | POLLHUP)))
+                continue;
+
+            cc = read(conn->fd, buf, msgsz - conn->off);
+            if (cc < 1) {
+                if (cc == -1 && errno == EAGAIN)
+                    continue;
+                bench_fatal("read");
+            }
+
+            conn->off += cc;
+            if (conn->off < msgsz)
+                continue;
+
+            /*
+             * The request is small enough to fit in the socket buffer
+             * since there's only ever one outstanding per connection.
+             */
+            conn->off = 0;
+            ++nreqs;
+
+            if (write(conn->fd, msg, msgsz) != (ssize_t)msgsz)
+                bench_fatal("write");
+        }
+    }
+
+    nrequests = nreqs;
+    xpoll_destroy(xpoll);
+    free(msg);
+
+    return NULL;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    pthread_t server_tid, client_tid;
+    struct sockaddr_in sin;
+    u_int warmup, secs;
+    const char *fmt, *model;
+    double elapsed;
+    int callback;
+    int conns, lfd;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    msgsz = 64;
+    conns = 64;
+    callback = 0;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":c:d:hkm:o:w:"))) {
+        switch (rc) {
+        case 'c':
+            conns = bench_getnum(rc, optarg, 1, 100000);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'k':
+            callback = 1;
+            break;
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 64 * 1024);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    model = callback ? "callback" : "coroutine";
+    fdmax = conns * 2 + 16;
+
+    lfd = net_listen(&sin, SOMAXCONN);
+
+    for (i = 0; i < conns; ++i) {
+        int cfd, sfd;
+
+        net_tcp_pair(lfd, &sin, fdmax, &cfd, &sfd);
+        cfdv.push_back(cfd);
+        sfdv.push_back(sfd);
+    }
+
+    close(lfd);
+
+    pthread_create(&server_tid, NULL, callback ? cb_server_main : co_server_main, NULL);
+    pthread_create(&client_tid, NULL, client_main, NULL);
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    pthread_join(client_tid, NULL);
+    pthread_join(server_tid, NULL);
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"model\": \"%s\", \"connections\": %d, "
+               "\"msgsz\": %zu, \"secs\": %.3lf, \"requests\": %lu, "
+               "\"requests_per_sec\": %.0lf }\n",
+               mechanism, model, conns, msgsz, elapsed, nrequests,
+               nrequests / elapsed);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,model,connections,msgsz,secs,requests,requests_per_sec\n");
+        printf("%s,%s,%d,%zu,%.3lf,%lu,%.0lf\n",
+               mechanism, model, conns, msgsz, elapsed, nrequests,
+               nrequests / elapsed);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12s  model\n", model);
+        printf("%12d  connections\n", conns);
+        printf("%12zu  msgsz\n", msgsz);
+        printf("%12.3lf  secs\n", elapsed);
+        printf("%12lu  total requests\n", nrequests);
+        printf("%12.0lf  requests/sec\n", nrequests / elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <sysexits.h>
+
+#include <time.h>
+
+#include <sys/time.h>
+#include <sys/types.h>
+
+#if __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#elif __linux__
+#include <sched.h>
+#endif
+
+#include "bench.h"
+
+/*
+ * Two-sided 95% critical values of Student's t distribution indexed
+ * by degrees of freedom.  Beyond the end of the table the normal
+ * approximation is close enough.
+ */
+static const double tcritv[] = {
+    0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+    2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093,
+    2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045,
+    2.042,
+};
+
+static int
+bench_cmp(const void *lhs, const void *rhs)
+{
+    double l = *(const double *)lhs;
+    double r = *(const double *)rhs;
+
+    return (l > r) - (l < r);
+}
+
+/*
+ * Compute the summary statistics of the given samples.  The sample
+ * vector is not modified.
+ */
+void
+bench_summarize(const double *samplev, int samplec, struct bench_summary *sum)
+{
+    double *sortv, sumsq;
+    int i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    if (samplec < 1)
+        return;
+
+    sortv = malloc(sizeof(*sortv) * samplec);
+    if (!sortv)
+        abort();
+
+    memcpy(sortv, samplev, sizeof(*sortv) * samplec);
+    qsort(sortv, samplec, sizeof(*sortv), bench_cmp);
+
+    sum->n = samplec;
+    sum->min = sortv[0];
+    sum->max = sortv[samplec - 1];
+
+    if (samplec % 2)
+        sum->median = sortv[samplec / 2];
+    else
+        sum->median = (sortv[samplec / 2 - 1] + sortv[samplec / 2]) / 2;
+
+    for (i = 0; i < samplec; ++i)
+        sum->mean += sortv[i];
+    sum->mean /= samplec;
+
+    if (samplec > 1) {
+        int df = samplec - 1;
+        double tcrit;
+
+        sumsq = 0;
+        for (i = 0; i < samplec; ++i)
+            sumsq += (sortv[i] - sum->mean) * (sortv[i] - sum->mean);
+
+        sum->stddev = sqrt(sumsq / df);
+
+        tcrit = (df < (int)(sizeof(tcritv) / sizeof(tcritv[0])))
+            ? tcritv[df] : 1.960;
+
+        sum->ci95 = tcrit * sum->stddev / sqrt(samplec);
+    }
+
+    free(sortv);
+}
+
+/*
+ * Bind the calling thread to the given CPU.  Returns 0 on success,
+ * otherwise an errno.
+ */
+int
+bench_pin_cpu(int cpu)
+{
+#if __FreeBSD__
+    cpuset_t mask;
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1,
+                           sizeof(mask), &mask))
+        return errno;
+
+    return 0;
+
+#elif __linux__
+    cpu_set_t mask;
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+
+    if (sched_setaffinity(0, sizeof(mask), &mask))
+        return errno;
+
+    return 0;
+
+#else
+    (void)cpu;
+
+    return ENOTSUP;
+#endif
+}
+
+double
+bench_tv2sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+/*
+ * Return the CPU time consumed by the calling thread in seconds.
+ */
+double
+bench_thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/*
+ * Start measuring the calling thread's CPU time once the run enters
+ * the measured phase (phase 1).  Returns true only from the call that
+ * starts the measurement, such that the caller can reset its counters.
+ */
+int
+bench_cpu_phase(struct bench_cpu *cpu, int phase)
+{
+    if (phase != 1 || cpu->measuring)
+        return 0;
+
+    cpu->start = bench_thread_cpu();
+    cpu->measuring = 1;
+
+    return 1;
+}
+
+/*
+ * Record the calling thread's CPU time since bench_cpu_phase() started
+ * measuring.
+ */
+void
+bench_cpu_done(struct bench_cpu *cpu)
+{
+    cpu->secs = cpu->measuring ? bench_thread_cpu() - cpu->start : 0;
+}
+
+/*
+ * Parse the argument str of option -c as an unsigned number within
+ * [min, max], exiting with EX_USAGE if it isn't one.
+ */
+u_long
+bench_getnum(int c, const char *str, u_long min, u_long max)
+{
+    u_long val;
+    char *end;
+
+    errno = 0;
+    val = strtoul(str, &end, 0);
+
+    if (errno || *end || end == str || val < min || val > max) {
+        fprintf(stderr, "%s: invalid argument '%s' for option -%c\n",
+                progname, str, c);
+        exit(EX_USAGE);
+    }
+
+    return val;
+}
+
+/*
+ * Report the failure of what (per errno) and exit with EX_OSERR.
+ */
+void
+bench_fatal(const char *what)
+{
+    fprintf(stderr, "%s: %s: %s\n", progname, what, strerror(errno));
+    exit(EX_OSERR);
+}
+
+/*
+ * Return the current value of the monotonic clock in nanoseconds.
+ */
+uint64_t
+bench_nsecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void
+bench_hist_init(struct bench_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+static inline u_int
+bench_hist_idx(uint64_t val)
+{
+    u_int shift;
+
+    if (val < (1u << BENCH_HIST_SUBBITS))
+        return val;
+
+    shift = 63 - __builtin_clzll(val) - BENCH_HIST_SUBBITS;
+
+    return ((shift + 1) << BENCH_HIST_SUBBITS) +
+        ((val >> shift) & ((1u << BENCH_HIST_SUBBITS) - 1));
+}
+
+/*
+ * Return the largest value which maps to the given bucket.
+ */
+static uint64_t
+bench_hist_val(u_int idx)
+{
+    u_int shift;
+
+    if (idx < (1u << BENCH_HIST_SUBBITS))
+        return idx;
+
+    shift = (idx >> BENCH_HIST_SUBBITS) - 1;
+    idx &= (1u << BENCH_HIST_SUBBITS) - 1;
+
+    return (((uint64_t)((1u << BENCH_HIST_SUBBITS) | idx) << shift) +
+            ((uint64_t)1 << shift) - 1);
+}
+
+void
+bench_hist_add(struct bench_hist *hist, uint64_t val)
+{
+    hist->bktv[bench_hist_idx(val)]++;
+    hist->count++;
+    hist->sum += val;
+
+    if (val > hist->max)
+        hist->max = val;
+}
+
+void
+bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src)
+{
+    for (u_int i = 0; i < BENCH_HIST_NBKTS; ++i)
+        dst->bktv[i] += src->bktv[i];
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/*
+ * Return the value at the given percentile (e.g., 99.9), or zero
+ * if the histogram is empty.  The result is the upper bound of the
+ * bucket in which the percentile falls, clamped to the largest value
+ * actually recorded.
+ */
+uint64_t
+bench_hist_pct(const struct bench_hist *hist, double pct)
+{
+    uint64_t rank, seen;
+
+    if (hist->count == 0)
+        return 0;
+
+    rank = (uint64_t)(hist->count * pct / 100.0 + 0.5);
+    if (rank < 1)
+        rank = 1;
+    else if (rank > hist->count)
+        rank = hist->count;
+
+    seen = 0;
+
+    for (u_int i = 0; i < BENCH_HIST_NBKTS; ++i) {
+        seen += hist->bktv[i];
+
+        if (seen >= rank) {
+            uint64_t val = bench_hist_val(i);
+
+            return (val < hist->max) ? val : hist->max;
+        }
+    }
+
+    return hist->max;
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Helpers shared by the programs under test/ for running repeated
+ * measurements and summarizing the results.
+ */
+
+/*
+ * The program's name, as used by bench_getnum() and bench_fatal() (and
+ * the net_*() helpers) when reporting errors.
+ */
+extern char *progname;
+
+/*
+ * CPU time consumed by a thread during the measured phase of a run
+ * (see bench_cpu_phase()).
+ */
+struct bench_cpu {
+    int     measuring;
+    double  start;
+    double  secs;           // set by bench_cpu_done()
+};
+
+struct bench_summary {
+    int     n;              // number of samples
+    double  min;
+    double  max;
+    double  mean;
+    double  median;
+    double  stddev;         // sample standard deviation
+    double  ci95;           // half-width of the 95% confidence interval
+};
+
+/*
+ * A log-linear histogram of non-negative values (typically latencies
+ * in nanoseconds).  Each power of two is divided into 2^BENCH_HIST_SUBBITS
+ * linear sub-buckets, bounding the relative error of any reported
+ * percentile to roughly 2^-BENCH_HIST_SUBBITS.
+ */
+#define BENCH_HIST_SUBBITS  (5)
+#define BENCH_HIST_NBKTS    (64 << BENCH_HIST_SUBBITS)
+
+struct bench_hist {
+    uint64_t    count;
+    uint64_t    max;
+    double      sum;
+    uint64_t    bktv[BENCH_HIST_NBKTS];
+};
+
+extern void bench_summarize(const double *samplev, int samplec,
+                            struct bench_summary *sum);
+extern int bench_pin_cpu(int cpu);
+extern double bench_tv2sec(const struct timeval *tv);
+extern uint64_t bench_nsecs(void);
+extern double bench_thread_cpu(void);
+extern int bench_cpu_phase(struct bench_cpu *cpu, int phase);
+extern void bench_cpu_done(struct bench_cpu *cpu);
+
+extern u_long bench_getnum(int c, const char *str, u_long min, u_long max);
+extern void bench_fatal(const char *what) __attribute__((__noreturn__));
+
+extern void bench_hist_init(struct bench_hist *hist);
+extern void bench_hist_add(struct bench_hist *hist, uint64_t val);
+extern void bench_hist_merge(struct bench_hist *dst, const struct bench_hist *src);
+extern uint64_t bench_hist_pct(const struct bench_hist *hist, double pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BENCH_H */
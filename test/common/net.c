@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sysexits.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+#include "net.h"
+
+/*
+ * Create a TCP socket listening on an ephemeral loopback port, and
+ * store its address in sin.  Returns the listening socket.
+ */
+int
+net_listen(struct sockaddr_in *sin, int backlog)
+{
+    socklen_t sinlen;
+    int lfd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd == -1)
+        bench_fatal("socket");
+
+    memset(sin, 0, sizeof(*sin));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sinlen = sizeof(*sin);
+
+    if (bind(lfd, (struct sockaddr *)sin, sinlen) ||
+        listen(lfd, backlog) ||
+        getsockname(lfd, (struct sockaddr *)sin, &sinlen))
+        bench_fatal("listen");
+
+    return lfd;
+}
+
+/*
+ * Set or clear O_NONBLOCK on fd, and disable Nagle's algorithm (which
+ * is quietly ignored if fd isn't a TCP socket).
+ */
+void
+net_setnonblock(int fd, int nonblock)
+{
+    int flags, one = 1;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags == -1)
+        bench_fatal("fcntl");
+
+    flags = nonblock ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+
+    if (fcntl(fd, F_SETFL, flags))
+        bench_fatal("fcntl");
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/*
+ * Connect a new socket to the listener lfd at sin and accept the
+ * connection, yielding a non-blocking client and server socket pair.
+ * Exits with EX_SOFTWARE if either fd isn't below fdmax.
+ */
+void
+net_tcp_pair(int lfd, const struct sockaddr_in *sin, int fdmax, int *cfdp, int *sfdp)
+{
+    int cfd, sfd;
+
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (cfd == -1 || connect(cfd, (const struct sockaddr *)sin, sizeof(*sin)))
+        bench_fatal("connect");
+
+    sfd = accept(lfd, NULL, NULL);
+    if (sfd == -1)
+        bench_fatal("accept");
+
+    if (cfd >= fdmax || sfd >= fdmax) {
+        fprintf(stderr, "%s: fd %d exceeds fdmax %d\n",
+                progname, cfd > sfd ? cfd : sfd, fdmax);
+        exit(EX_SOFTWARE);
+    }
+
+    net_setnonblock(cfd, 1);
+    net_setnonblock(sfd, 1);
+
+    *cfdp = cfd;
+    *sfdp = sfd;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/types.h>
+
+#if __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "perfctr.h"
+
+static const char *namev[PERFCTR_MAX] = {
+    [PERFCTR_CYCLES] = "cycles",
+    [PERFCTR_INSTRUCTIONS] = "instructions",
+    [PERFCTR_CACHE_MISSES] = "cache-misses",
+    [PERFCTR_BRANCH_MISSES] = "branch-misses",
+    [PERFCTR_DTLB_MISSES] = "dtlb-misses",
+    [PERFCTR_CTXSW] = "context-switches",
+};
+
+const char *
+perfctr_name(int event)
+{
+    return (event >= 0 && event < PERFCTR_MAX) ? namev[event] : "unknown";
+}
+
+int
+perfctr_valid(const struct perfctr *pc, int mode, int event)
+{
+    return pc->fdv[mode][event] >= 0;
+}
+
+#if __linux__
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} eventv[PERFCTR_MAX] = {
+    [PERFCTR_CYCLES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [PERFCTR_INSTRUCTIONS] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [PERFCTR_CACHE_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    [PERFCTR_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    [PERFCTR_DTLB_MISSES] = { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+    [PERFCTR_CTXSW] = { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static int
+perfctr_open1(int event, int mode)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = eventv[event].type;
+    attr.config = eventv[event].config;
+    attr.disabled = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+        PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    /*
+     * Context switches are a kernel event irrespective of the mode
+     * in which the switched-out thread was running, so count them
+     * all under PERFCTR_USER.
+     */
+    if (event == PERFCTR_CTXSW) {
+        if (mode != PERFCTR_USER)
+            return -1;
+    } else {
+        attr.exclude_kernel = (mode == PERFCTR_USER);
+        attr.exclude_user = (mode == PERFCTR_KERNEL);
+    }
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#endif
+
+/*
+ * Open as many of the counters as the platform and the caller's
+ * privileges permit.  Returns 0 if at least one counter could be
+ * opened, otherwise -1 (with errno set).
+ */
+int
+perfctr_open(struct perfctr *pc)
+{
+    int nopen = 0;
+
+    memset(pc, 0, sizeof(*pc));
+
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+#if __linux__
+            pc->fdv[mode][event] = perfctr_open1(event, mode);
+#else
+            pc->fdv[mode][event] = -1;
+#endif
+            if (pc->fdv[mode][event] >= 0)
+                ++nopen;
+        }
+    }
+
+#if !__linux__
+    errno = ENOTSUP;
+#endif
+
+    return nopen > 0 ? 0 : -1;
+}
+
+void
+perfctr_close(struct perfctr *pc)
+{
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+            if (pc->fdv[mode][event] >= 0)
+                close(pc->fdv[mode][event]);
+            pc->fdv[mode][event] = -1;
+        }
+    }
+}
+
+/*
+ * Reset and enable all open counters.
+ */
+void
+perfctr_start(struct perfctr *pc)
+{
+#if __linux__
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+            int fd = pc->fdv[mode][event];
+
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+#else
+    (void)pc;
+#endif
+}
+
+/*
+ * Disable all open counters and accumulate their values into
+ * pc->valv[][], scaling for the time each counter was actually
+ * scheduled on the PMU in case they were multiplexed.
+ */
+void
+perfctr_stop(struct perfctr *pc)
+{
+#if __linux__
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+            int fd = pc->fdv[mode][event];
+            uint64_t buf[3];
+
+            if (fd < 0)
+                continue;
+
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+
+            if (read(fd, buf, sizeof(buf)) != sizeof(buf))
+                continue;
+
+            if (buf[2] > 0 && buf[2] < buf[1])
+                buf[0] = (double)buf[0] * buf[1] / buf[2];
+
+            pc->valv[mode][event] += buf[0];
+        }
+    }
+#else
+    (void)pc;
+#endif
+}
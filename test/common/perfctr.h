@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+
+/*
+ * Optional hardware and software event counters for the calling
+ * thread, implemented via perf_event_open(2) on Linux.  Where the
+ * kernel allows it user and kernel mode events are counted
+ * separately, otherwise only user mode events are counted.  On
+ * other platforms perfctr_open() always fails with ENOTSUP.
+ */
+
+enum perfctr_event {
+    PERFCTR_CYCLES,
+    PERFCTR_INSTRUCTIONS,
+    PERFCTR_CACHE_MISSES,
+    PERFCTR_BRANCH_MISSES,
+    PERFCTR_DTLB_MISSES,
+    PERFCTR_CTXSW,
+    PERFCTR_MAX
+};
+
+enum perfctr_mode {
+    PERFCTR_USER,
+    PERFCTR_KERNEL,
+    PERFCTR_MODES
+};
+
+struct perfctr {
+    int         fdv[PERFCTR_MODES][PERFCTR_MAX];
+    uint64_t    valv[PERFCTR_MODES][PERFCTR_MAX];
+};
+
+extern int perfctr_open(struct perfctr *pc);
+extern void perfctr_close(struct perfctr *pc);
+extern void perfctr_start(struct perfctr *pc);
+extern void perfctr_stop(struct perfctr *pc);
+extern int perfctr_valid(const struct perfctr *pc, int mode, int event);
+extern const char *perfctr_name(int event);
+
+#endif /* PERFCTR_H */
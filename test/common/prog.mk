@@ -0,0 +1,102 @@
+# Common rules for the programs under test/.  Each program's GNUmakefile
+# sets PROG and SRC (and optionally appends to LDLIBS) and then includes
+# this file.  The programs are built against the preferred mechanism
+# for the given platform (i.e., epoll(7) on Linux, and kqueue(2) on
+# FreeBSD).
+# Use 'gmake poll' to build xpoll with poll(2).
+# Use 'gmake ${PROG}-poll' to build a poll(2) based ${PROG}-poll
+# alongside the preferred one (e.g., for the bench targets).
+# Use 'gmake stats' to build xpoll with system call accounting.
+# Use 'gmake inline' to inline xpoll_revents() into ${PROG}'s event loop,
+# and 'gmake lto' to build with link time optimization.
+# SRC may include C++ sources (*.cc), in which case ${PROG} is linked
+# with the C++ compiler.
+
+OBJ := $(patsubst %.cc,%.o,${SRC:.c=.o})
+POLLOBJ := $(patsubst %.cc,%-poll.o,${SRC:.c=-poll.o})
+
+INCLUDE  := -I. -I../../lib -I../common
+CFLAGS   += -Wall -Wextra -O2 -g3 ${INCLUDE}
+CXXFLAGS += -std=c++20 -Wall -Wextra -O2 -g3 ${INCLUDE}
+CPPFLAGS += -DNDEBUG
+LDLIBS   += -lm
+
+VPATH   := ../../lib ../common
+
+ifneq ($(filter %.cc,${SRC}),)
+LINK = $(LINK.cc)
+else
+LINK = $(LINK.o)
+endif
+
+.DELETE_ON_ERROR:
+.NOT_PARALLEL:
+
+.PHONY: all asan bench-baseline bench-check clean clobber debug
+.PHONY: distclean inline lto maintainer-clean poll stats
+
+
+all: ${PROG}
+
+bench-baseline bench-check: ${PROG} ${PROG}-poll
+
+clean:
+	rm -f ${PROG} ${PROG}-poll ${OBJ} ${POLLOBJ} *.core
+	rm -f $(patsubst %.cc,.%.d*,$(patsubst %.c,.%.d*,${SRC}))
+
+cleandir distclean maintainer-clean: clean
+
+debug: CPPFLAGS += -UNDEBUG
+debug: CFLAGS += -O0 -fno-omit-frame-pointer
+debug: CXXFLAGS += -O0 -fno-omit-frame-pointer
+debug: ${PROG}
+
+asan: CPPFLAGS += -UNDEBUG
+asan: CFLAGS += -O0 -fno-omit-frame-pointer
+asan: CFLAGS += -fsanitize=address -fsanitize=undefined
+asan: CXXFLAGS += -O0 -fno-omit-frame-pointer
+asan: CXXFLAGS += -fsanitize=address -fsanitize=undefined
+asan: LDLIBS += -fsanitize=address -fsanitize=undefined
+asan: ${PROG}
+
+poll: CPPFLAGS += -DXPOLL_POLL=1
+poll: ${PROG}
+
+stats: CPPFLAGS += -DXPOLL_STATS=1
+stats: ${PROG}
+
+inline: CPPFLAGS += -DXPOLL_INLINE=1
+inline: ${PROG}
+
+lto: CFLAGS += -flto
+lto: CXXFLAGS += -flto
+lto: LDFLAGS += -flto -O2
+lto: ${PROG}
+
+${PROG}: ${OBJ}
+	$(LINK) $^ $(LOADLIBES) $(LDLIBS) -o $@
+
+${PROG}-poll: CPPFLAGS += -DXPOLL_POLL=1
+${PROG}-poll: ${POLLOBJ}
+	$(LINK) $^ $(LOADLIBES) $(LDLIBS) -o $@
+
+%-poll.o: %.c
+	$(COMPILE.c) $(OUTPUT_OPTION) $<
+
+%-poll.o: %.cc
+	$(COMPILE.cc) $(OUTPUT_OPTION) $<
+
+
+.%.d: %.c
+	@set -e; rm -f $@; \
+	$(CC) -M $(CPPFLAGS) ${INCLUDE} $< > $@.$$$$; \
+	sed 's,\($*\)\.o[ :]*,\1.o $@ : ,g' < $@.$$$$ > $@; \
+	rm -f $@.$$$$
+
+.%.d: %.cc
+	@set -e; rm -f $@; \
+	$(CXX) -std=c++20 -M $(CPPFLAGS) ${INCLUDE} $< > $@.$$$$; \
+	sed 's,\($*\)\.o[ :]*,\1.o $@ : ,g' < $@.$$$$ > $@; \
+	rm -f $@.$$$$
+
+-include $(patsubst %.cc,.%.d,$(patsubst %.c,.%.d,${SRC}))
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sysexits.h>
+#include <sys/time.h>
+
+#include "xpoll.hpp"
+#include "bench.h"
+
+/*
+ * cxxloop compares the cost of an event loop written against the C API
+ * (i.e., xpoll_wait() plus one xpoll_revents() call per event) with the
+ * same loop written against each of the C++ backends in xpoll.hpp.  It
+ * passes -t tokens around a ring of N pipes: each read of a token from
+ * pipe i is followed by a write of it to pipe i + 1.  All pipes are
+ * registered for POLLIN only, so the only system calls are read(2),
+ * write(2), and the wait, leaving the per-event dispatch overhead as
+ * the difference between backends.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct pipe_end {
+    int rfd;
+    int wfd;            // write end of the next pipe in the ring
+};
+
+volatile sig_atomic_t done;
+
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-b backend] [-d secs] [-o fmt] [-t tokens] npipes\n", progname);
+    printf("-b backend  c, capi, epoll, uring, or poll (default: c)\n");
+    printf("-d secs     duration of the run (default: 10)\n");
+    printf("-h          print this help list\n");
+    printf("-o fmt      output format: text, json, or csv (default: text)\n");
+    printf("-t tokens   number of tokens in the ring (default: 1)\n");
+    printf("npipes      number of pipes in the ring\n");
+    printf("\nbackend c uses the C API directly, capi wraps it with\n");
+    printf("xpp::c_backend, and epoll, uring, and poll use\n");
+    printf("xpp::epoll_backend, xpp::uring_backend, and xpp::poll_backend\n");
+    printf("(which don't use lib/xpoll.c at all).\n");
+}
+
+static void
+sigalrm_handler(int sig)
+{
+    (void)sig;
+    done = 1;
+}
+
+/*
+ * Move the token from the given pipe to the next one in the ring.
+ */
+static inline void
+relay(const struct pipe_end *pe)
+{
+    char token;
+
+    if (read(pe->rfd, &token, 1) != 1 || write(pe->wfd, &token, 1) != 1) {
+        fprintf(stderr, "%s: relay(%d): %s\n", progname, pe->rfd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+static unsigned long
+run_c(std::vector<pipe_end> &pipev, int fdmax)
+{
+    struct xpoll *xpoll;
+    unsigned long nreads = 0;
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    for (auto &pe : pipev) {
+        if (xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, pe.rfd, &pe)) {
+            fprintf(stderr, "%s: xpoll_ctl: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    while (!done) {
+        struct pipe_end *pe;
+        int revents;
+        int n;
+
+        n = xpoll_wait(xpoll, -1);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "%s: xpoll_wait: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        while (n-- > 0) {
+            revents = xpoll_revents(xpoll, (void **)&pe);
+            if (revents & POLLIN) {
+                relay(pe);
+                ++nreads;
+            }
+        }
+    }
+
+    xpoll_destroy(xpoll);
+
+    return nreads;
+}
+
+template <class Backend>
+static unsigned long
+run_cxx(std::vector<pipe_end> &pipev, int fdmax)
+{
+    std::vector<xpp::registration<Backend>> regv;
+    unsigned long nreads = 0;
+
+    try {
+        xpp::loop<Backend> loop(fdmax);
+
+        regv.reserve(pipev.size());
+
+        for (auto &pe : pipev)
+            regv.push_back(loop.add(pe.rfd, POLLIN, &pe));
+
+        while (!done) {
+            for (xpp::event ev : loop.wait(-1)) {
+                if (ev.revents & POLLIN) {
+                    relay(static_cast<struct pipe_end *>(ev.data));
+                    ++nreads;
+                }
+            }
+        }
+
+        regv.clear();
+    }
+    catch (const std::system_error &ex) {
+        fprintf(stderr, "%s: %s\n", progname, ex.what());
+        exit(EX_OSERR);
+    }
+
+    return nreads;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    std::vector<pipe_end> pipev;
+    const char *backend, *fmt;
+    unsigned long nreads;
+    u_int secs, tokens;
+    int npipes, fdmax;
+    double elapsed;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    backend = "c";
+    fmt = "text";
+    tokens = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":b:d:ho:t:"))) {
+        switch (rc) {
+        case 'b':
+            backend = optarg;
+            if (strcmp(backend, "c") && strcmp(backend, "capi") &&
+                strcmp(backend, "epoll") && strcmp(backend, "uring") &&
+                strcmp(backend, "poll")) {
+                fprintf(stderr, "%s: invalid backend '%s'\n", progname, backend);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 't':
+            tokens = bench_getnum(rc, optarg, 1, 1000000);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1) {
+        fprintf(stderr, "%s: missing npipes, use -h for help\n", progname);
+        exit(EX_USAGE);
+    }
+
+    npipes = bench_getnum('n', argv[0], 1, 1000000);
+    fdmax = npipes * 2 + 16;
+
+    pipev.resize(npipes);
+
+    for (i = 0; i < npipes; ++i) {
+        int fdv[2];
+
+        if (pipe(fdv)) {
+            fprintf(stderr, "%s: pipe: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+
+        pipev[i].rfd = fdv[0];
+        pipev[(i + npipes - 1) % npipes].wfd = fdv[1];
+    }
+
+    for (i = 0; i < (int)tokens; ++i) {
+        if (write(pipev[(i * npipes / tokens + npipes - 1) % npipes].wfd, "t", 1) != 1) {
+            fprintf(stderr, "%s: write: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    signal(SIGALRM, sigalrm_handler);
+    alarm(secs);
+
+    gettimeofday(&tv_start, NULL);
+
+    if (!strcmp(backend, "c"))
+        nreads = run_c(pipev, fdmax);
+    else if (!strcmp(backend, "capi"))
+        nreads = run_cxx<xpp::c_backend>(pipev, fdmax);
+#if __linux__
+    else if (!strcmp(backend, "epoll"))
+        nreads = run_cxx<xpp::epoll_backend>(pipev, fdmax);
+#endif
+#if XPP_URING
+    else if (!strcmp(backend, "uring"))
+        nreads = run_cxx<xpp::uring_backend>(pipev, fdmax);
+#endif
+    else if (!strcmp(backend, "poll"))
+        nreads = run_cxx<xpp::poll_backend>(pipev, fdmax);
+    else {
+        fprintf(stderr, "%s: backend '%s' not available on this platform\n",
+                progname, backend);
+        exit(EX_USAGE);
+    }
+
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"backend\": \"%s\", \"pipes\": %d, "
+               "\"tokens\": %u, \"secs\": %.3lf, \"reads\": %lu, "
+               "\"reads_per_sec\": %.0lf }\n",
+               mechanism, backend, npipes, tokens, elapsed, nreads,
+               nreads / elapsed);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,backend,pipes,tokens,secs,reads,reads_per_sec\n");
+        printf("%s,%s,%d,%u,%.3lf,%lu,%.0lf\n",
+               mechanism, backend, npipes, tokens, elapsed, nreads,
+               nreads / elapsed);
+    }
+    else {
+        printf("%12s  mechanism (lib/xpoll.c)\n", mechanism);
+        printf("%12s  backend\n", backend);
+        printf("%12d  pipes\n", npipes);
+        printf("%12u  tokens\n", tokens);
+        printf("%12.3lf  secs\n", elapsed);
+        printf("%12lu  total read operations\n", nreads);
+        printf("%12.0lf  reads/sec\n", nreads / elapsed);
+    }
+
+    return 0;
+}
@@ -0,0 +1,877 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * echo is a loopback TCP request/response benchmark.  A pool of server
+ * threads echoes back every byte it receives, while a pool of client
+ * threads keeps up to depth fixed-size requests outstanding on each of
+ * its connections, measuring the round trip time of each.  Every
+ * thread runs its own xpoll event loop over the connections it owns.
+ *
+ * All connections are established up front, so the benchmark measures
+ * steady-state readiness handling rather than connection setup.
+ *
+ * By default the clients are closed-loop: a new request is sent only
+ * once a response arrives, so a slow response delays every request
+ * queued behind it and the reported latencies understate the queueing
+ * delay a real client would see (coordinated omission).  With -R the
+ * clients are instead open-loop: requests are issued on a fixed
+ * schedule (constant or Poisson arrivals) irrespective of responses,
+ * and latency is measured from each request's intended send time.
+ * With -s the servers register each connection's reader and writer
+ * as separate data (see xpoll_rwdata_init()), and dispatch each event
+ * straight to the handler of its direction.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+/*
+ * Each request begins with the time (in nanoseconds) at which it was
+ * sent, which the server returns verbatim.
+ */
+struct msghdr_echo {
+    uint64_t tstamp;
+};
+
+#define MSGSZ_MIN   (sizeof(struct msghdr_echo))
+
+struct sconn;
+
+typedef void shandler_t(struct xpoll *xpoll, struct sconn *conn, int revents);
+
+/*
+ * One direction of a server connection, the event data for it with -s.
+ */
+struct shalf {
+    shandler_t *fn;
+    struct sconn *conn;
+};
+
+/*
+ * Server side connection state.  Input is echoed directly from buf,
+ * and any portion which could not be written immediately is held
+ * (with POLLIN disabled) until the socket becomes writable.
+ */
+struct sconn {
+    int fd;
+    struct shalf rd;
+    struct shalf wr;
+    size_t off;
+    size_t len;
+    char buf[];
+};
+
+/*
+ * Client side connection state.  The receive buffer holds at most one
+ * partial response, while the transmit buffer holds requests which
+ * could not be written immediately.
+ */
+struct cconn {
+    int fd;
+    int inflight;
+    size_t rxlen;
+    size_t txoff;
+    size_t txlen;
+    size_t txcap;
+    char *rxbuf;
+    char *txbuf;
+};
+
+struct worker {
+    pthread_t tid;
+    struct xpoll *xpoll;
+    int nconns;
+    void **connv;
+
+    /* Client statistics, reset at the start of the measured run. */
+    uint64_t nreqs;
+    uint64_t nbytes;
+    uint64_t nsent;
+    struct bench_hist hist;
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+
+size_t msgsz;
+size_t sbufsz;
+size_t rxbufsz;
+double rate;                // open-loop requests/sec per client thread
+int poisson;
+int rwdata;                 // separate read and write data (see -s)
+int depth;
+int fdmax;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-C cthreads] [-c conns] [-d secs] [-m msgsz] "
+           "[-o fmt] [-p depth] [-R rate [-A arrival]] [-s] [-T sthreads] "
+           "[-w secs]\n", progname);
+    printf("-A arrival   open-loop arrivals: const or poisson (default: const)\n");
+    printf("-C cthreads  number of client threads (default: 1)\n");
+    printf("-c conns     number of connections (default: 64)\n");
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-h           print this help list\n");
+    printf("-m msgsz     request size in bytes (default: 64, min: %zu)\n",
+           MSGSZ_MIN);
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-p depth     requests outstanding per connection (default: 1)\n");
+    printf("-R rate      issue rate requests/sec open-loop (ignores -p)\n");
+    printf("-s           servers use separate read and write event data\n");
+    printf("-T sthreads  number of server threads (default: 1)\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+}
+
+/*
+ * Write as much of the connection's pending output as the socket will
+ * take.  Returns 0 if all pending output was written, 1 if some of it
+ * remains, and -1 on error.
+ */
+static int
+flush(int fd, const char *buf, size_t *offp, size_t len)
+{
+    while (*offp < len) {
+        ssize_t cc;
+
+        cc = write(fd, buf + *offp, len - *offp);
+        if (cc == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 1;
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        *offp += cc;
+    }
+
+    return 0;
+}
+
+static void
+server_pollout(struct xpoll *xpoll, struct sconn *conn, int enable)
+{
+    int rc;
+
+    rc = xpoll_ctl(xpoll, enable ? XPOLL_DISABLE : XPOLL_ENABLE,
+                   POLLIN, conn->fd, rwdata ? (void *)&conn->rd : conn);
+    if (!rc)
+        rc = xpoll_ctl(xpoll, enable ? XPOLL_ENABLE : XPOLL_DISABLE,
+                       POLLOUT, conn->fd, rwdata ? (void *)&conn->wr : conn);
+    if (rc) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n",
+                progname, conn->fd, strerror(errno));
+        abort();
+    }
+}
+
+static void
+server_close(struct xpoll *xpoll, struct sconn *conn)
+{
+    if (phase < 2)
+        fprintf(stderr, "%s: server fd %d: %s\n", progname, conn->fd,
+                errno ? strerror(errno) : "EOF");
+    xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, conn->fd, NULL);
+}
+
+/*
+ * Write the remainder of the held input once the socket is writable.
+ */
+static void
+server_write(struct xpoll *xpoll, struct sconn *conn, int revents)
+{
+    int rc;
+
+    (void)revents;
+
+    rc = flush(conn->fd, conn->buf, &conn->off, conn->len);
+    if (rc == -1)
+        server_close(xpoll, conn);
+    else if (rc == 0)
+        server_pollout(xpoll, conn, 0);
+}
+
+/*
+ * Read whatever input is available and echo it back.
+ */
+static void
+server_read(struct xpoll *xpoll, struct sconn *conn, int revents)
+{
+    ssize_t cc;
+    int rc;
+
+    if (revents & (POLLERR | POLLHUP)) {
+        server_close(xpoll, conn);
+        return;
+    }
+
+    cc = read(conn->fd, conn->buf, sbufsz);
+    if (cc < 1) {
+        if (cc == -1 && (errno == EAGAIN || errno == EINTR))
+            return;
+        server_close(xpoll, conn);
+        return;
+    }
+
+    conn->off = 0;
+    conn->len = cc;
+
+    rc = flush(conn->fd, conn->buf, &conn->off, conn->len);
+    if (rc == -1)
+        server_close(xpoll, conn);
+    else if (rc == 1)
+        server_pollout(xpoll, conn, 1);
+}
+
+static void *
+server_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+
+    while (phase < 2) {
+        int revents;
+        void *data;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, &data))) {
+            if (rwdata) {
+                struct shalf *half = data;
+
+                half->fn(xpoll, half->conn, revents);
+            }
+            else if (revents & POLLOUT) {
+                server_write(xpoll, data, revents);
+            }
+            else {
+                server_read(xpoll, data, revents);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Append a request stamped with the given time to the connection's
+ * transmit buffer, discarding any prefix of the buffer which has
+ * already been written.
+ */
+static void
+client_queue(struct cconn *conn, uint64_t tstamp)
+{
+    struct msghdr_echo hdr;
+
+    if (conn->txoff > 0) {
+        conn->txlen -= conn->txoff;
+        memmove(conn->txbuf, conn->txbuf + conn->txoff, conn->txlen);
+        conn->txoff = 0;
+    }
+
+    if (conn->txlen + msgsz > conn->txcap) {
+        size_t txcap = conn->txcap * 2;
+        char *txbuf;
+
+        txbuf = realloc(conn->txbuf, txcap);
+        if (!txbuf)
+            abort();
+
+        memset(txbuf + conn->txcap, 0, txcap - conn->txcap);
+        conn->txbuf = txbuf;
+        conn->txcap = txcap;
+    }
+
+    hdr.tstamp = tstamp;
+    memcpy(conn->txbuf + conn->txlen, &hdr, sizeof(hdr));
+    conn->txlen += msgsz;
+    conn->inflight++;
+}
+
+/*
+ * Write as much of the connection's transmit buffer as possible, and
+ * enable or disable POLLOUT according to whether any output remains.
+ * Returns 0 on success, otherwise -1.
+ */
+static int
+client_flush(struct xpoll *xpoll, struct cconn *conn)
+{
+    int pending = conn->txoff < conn->txlen;
+    int rc;
+
+    rc = flush(conn->fd, conn->txbuf, &conn->txoff, conn->txlen);
+    if (rc == -1)
+        return -1;
+
+    if (rc != pending)
+        xpoll_ctl(xpoll, rc ? XPOLL_ENABLE : XPOLL_DISABLE,
+                  POLLOUT, conn->fd, conn);
+
+    return 0;
+}
+
+/*
+ * Consume responses from the connection, recording the latency of
+ * each complete response relative to the time stamped in it.  Returns
+ * the number of complete responses received, or -1 on error or EOF.
+ */
+static int
+client_recv(struct worker *worker, struct cconn *conn)
+{
+    uint64_t now;
+    ssize_t cc;
+    char *msg;
+    int n = 0;
+
+    cc = read(conn->fd, conn->rxbuf + conn->rxlen, rxbufsz - conn->rxlen);
+    if (cc < 1) {
+        if (cc == -1 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        return -1;
+    }
+
+    now = bench_nsecs();
+    conn->rxlen += cc;
+
+    for (msg = conn->rxbuf; msg + msgsz <= conn->rxbuf + conn->rxlen; msg += msgsz) {
+        struct msghdr_echo hdr;
+
+        memcpy(&hdr, msg, sizeof(hdr));
+        bench_hist_add(&worker->hist, now - hdr.tstamp);
+        conn->inflight--;
+        ++n;
+    }
+
+    conn->rxlen -= msg - conn->rxbuf;
+    if (conn->rxlen > 0)
+        memmove(conn->rxbuf, msg, conn->rxlen);
+
+    worker->nreqs += n;
+    worker->nbytes += n * msgsz;
+
+    return n;
+}
+
+/*
+ * Return the interval in nanoseconds until the next open-loop arrival.
+ */
+static uint64_t
+client_interval(unsigned short *xsubi)
+{
+    double interval = 1000000000.0 / rate;
+
+    if (poisson)
+        interval *= -log(1.0 - erand48(xsubi));
+
+    return interval;
+}
+
+static void *
+client_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    unsigned short xsubi[3];
+    int curphase = phase;
+    uint64_t tnext;
+    int timeout;
+    int next;
+    int i, rc;
+
+    xsubi[0] = 0x330e;
+    xsubi[1] = (uintptr_t)worker;
+    xsubi[2] = (uintptr_t)worker >> 16;
+
+    next = 0;
+    tnext = bench_nsecs();
+    timeout = 100;
+
+    for (i = 0; i < worker->nconns && rate == 0; ++i) {
+        struct cconn *conn = worker->connv[i];
+
+        while (conn->inflight < depth)
+            client_queue(conn, bench_nsecs());
+
+        if (client_flush(xpoll, conn))
+            abort();
+    }
+
+    while (phase < 2) {
+        struct cconn *conn;
+        int revents;
+
+        if (curphase != phase) {
+            curphase = phase;
+            worker->nreqs = 0;
+            worker->nbytes = 0;
+            worker->nsent = 0;
+            bench_hist_init(&worker->hist);
+        }
+
+        /*
+         * In open-loop mode issue every request whose intended send
+         * time has passed, round-robin across the connections, and
+         * then wait no longer than the next intended send time.
+         */
+        if (rate > 0) {
+            uint64_t now = bench_nsecs();
+
+            while (tnext <= now) {
+                int pending;
+
+                conn = worker->connv[next];
+                if (++next >= worker->nconns)
+                    next = 0;
+
+                pending = conn->txoff < conn->txlen;
+
+                client_queue(conn, tnext);
+                if (!pending && client_flush(xpoll, conn))
+                    abort();
+
+                tnext += client_interval(xsubi);
+                worker->nsent++;
+            }
+
+            timeout = (tnext - now) / 1000000;
+        }
+
+        if (xpoll_wait(xpoll, timeout) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, (void **)&conn))) {
+            int pending;
+
+            if (revents & POLLIN) {
+                rc = client_recv(worker, conn);
+                if (rc == -1)
+                    goto errout;
+            }
+            else if (revents & (POLLERR | POLLHUP)) {
+                goto errout;
+            }
+
+            /*
+             * In closed-loop mode refill the pipeline if there's room,
+             * then write whatever the socket will take unless output
+             * is already waiting for the socket to become writable.
+             */
+            pending = conn->txoff < conn->txlen;
+
+            if (rate == 0) {
+                while (conn->inflight < depth)
+                    client_queue(conn, bench_nsecs());
+            }
+
+            if ((revents & POLLOUT) || !pending) {
+                if (client_flush(xpoll, conn))
+                    goto errout;
+            }
+            continue;
+
+          errout:
+            if (phase < 2)
+                fprintf(stderr, "%s: client fd %d: %s\n", progname, conn->fd,
+                        errno ? strerror(errno) : "EOF");
+            xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN | POLLOUT, conn->fd, conn);
+        }
+    }
+
+    return NULL;
+}
+
+static void
+worker_init(struct worker *worker, int nconns)
+{
+    memset(worker, 0, sizeof(*worker));
+
+    worker->connv = calloc(nconns, sizeof(*worker->connv));
+    if (!worker->connv)
+        exit(EX_OSERR);
+
+    worker->xpoll = xpoll_create(fdmax);
+    if (!worker->xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    bench_hist_init(&worker->hist);
+}
+
+/*
+ * Close and free the worker's connections (client connections if
+ * client is set, otherwise server connections), and destroy its xpoll
+ * instance.
+ */
+static void
+worker_fini(struct worker *worker, int client)
+{
+    for (int i = 0; i < worker->nconns; ++i) {
+        if (client) {
+            struct cconn *conn = worker->connv[i];
+
+            close(conn->fd);
+            free(conn->rxbuf);
+            free(conn->txbuf);
+            free(conn);
+        } else {
+            struct sconn *conn = worker->connv[i];
+
+            close(conn->fd);
+            free(conn);
+        }
+    }
+
+    xpoll_destroy(worker->xpoll);
+    free(worker->connv);
+}
+
+/*
+ * Register fd with the worker's xpoll instance for POLLIN, with
+ * POLLOUT added but disabled so that it may later be enabled on
+ * all platforms.  wdata is the write data in rwdata mode, otherwise
+ * it must be conn.
+ */
+static void
+worker_add(struct worker *worker, int fd, void *conn, void *rdata, void *wdata)
+{
+    int rc;
+
+    rc = xpoll_ctl(worker->xpoll, XPOLL_ADD, POLLIN | POLLOUT, fd, rdata);
+    if (!rc)
+        rc = xpoll_ctl(worker->xpoll, XPOLL_DISABLE, POLLOUT, fd, wdata);
+    if (rc) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n", progname, fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    worker->connv[worker->nconns++] = conn;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct worker *serverv, *clientv;
+    struct sockaddr_in sin;
+    struct bench_hist hist;
+    uint64_t nreqs, nbytes;
+    const char *arrival;
+    const char *fmt;
+    u_int warmup, secs;
+    uint64_t nsent;
+    int nservers, nclients;
+    int conns, lfd;
+    double elapsed;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    nservers = 1;
+    nclients = 1;
+    conns = 64;
+    msgsz = 64;
+    depth = 1;
+    rate = 0;
+    poisson = 0;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":A:C:c:d:hm:o:p:R:sT:w:"))) {
+        switch (rc) {
+        case 'A':
+            if (!strcmp(optarg, "poisson")) {
+                poisson = 1;
+            } else if (strcmp(optarg, "const")) {
+                fprintf(stderr, "%s: invalid arrival '%s'\n", progname, optarg);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'C':
+            nclients = bench_getnum(rc, optarg, 1, 1024);
+            break;
+
+        case 'c':
+            conns = bench_getnum(rc, optarg, 1, 1000000);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, MSGSZ_MIN, 16 * 1024 * 1024);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'p':
+            depth = bench_getnum(rc, optarg, 1, 4096);
+            break;
+
+        case 'R':
+            rate = bench_getnum(rc, optarg, 1, 1000000000);
+            break;
+
+        case 's':
+            rwdata = 1;
+            break;
+
+        case 'T':
+            nservers = bench_getnum(rc, optarg, 1, 1024);
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The open-loop rate is divided evenly across the client threads. */
+    rate /= nclients;
+
+    rxbufsz = msgsz * depth;
+    if (rxbufsz < 64 * 1024)
+        rxbufsz = (64 * 1024 / msgsz) * msgsz;
+
+    sbufsz = msgsz * depth;
+    if (sbufsz < 64 * 1024)
+        sbufsz = 64 * 1024;
+
+    /* Each connection consumes two fds, plus a few for stdio et al. */
+    fdmax = conns * 2 + 16;
+
+    lfd = net_listen(&sin, conns < SOMAXCONN ? conns : SOMAXCONN);
+
+    serverv = calloc(nservers, sizeof(*serverv));
+    clientv = calloc(nclients, sizeof(*clientv));
+    if (!serverv || !clientv)
+        exit(EX_OSERR);
+
+    for (i = 0; i < nservers; ++i) {
+        worker_init(serverv + i, conns / nservers + 1);
+
+        if (rwdata && xpoll_rwdata_init(serverv[i].xpoll)) {
+            fprintf(stderr, "%s: xpoll_rwdata_init: %s\n",
+                    progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+    for (i = 0; i < nclients; ++i)
+        worker_init(clientv + i, conns / nclients + 1);
+
+    for (i = 0; i < conns; ++i) {
+        struct sconn *sconn;
+        struct cconn *cconn;
+        int cfd, sfd;
+
+        net_tcp_pair(lfd, &sin, fdmax, &cfd, &sfd);
+
+        sconn = malloc(sizeof(*sconn) + sbufsz);
+        cconn = calloc(1, sizeof(*cconn));
+        if (!sconn || !cconn)
+            exit(EX_OSERR);
+
+        sconn->fd = sfd;
+        sconn->rd.fn = server_read;
+        sconn->rd.conn = sconn;
+        sconn->wr.fn = server_write;
+        sconn->wr.conn = sconn;
+        sconn->off = sconn->len = 0;
+
+        cconn->fd = cfd;
+        cconn->txcap = msgsz * depth;
+        cconn->rxbuf = malloc(rxbufsz);
+        cconn->txbuf = calloc(depth, msgsz);
+        if (!cconn->rxbuf || !cconn->txbuf)
+            exit(EX_OSERR);
+
+        if (rwdata)
+            worker_add(serverv + (i % nservers), sfd, sconn, &sconn->rd, &sconn->wr);
+        else
+            worker_add(serverv + (i % nservers), sfd, sconn, sconn, sconn);
+        worker_add(clientv + (i % nclients), cfd, cconn, cconn, cconn);
+    }
+
+    close(lfd);
+
+    for (i = 0; i < nservers; ++i)
+        pthread_create(&serverv[i].tid, NULL, server_main, serverv + i);
+    for (i = 0; i < nclients; ++i)
+        pthread_create(&clientv[i].tid, NULL, client_main, clientv + i);
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    for (i = 0; i < nclients; ++i)
+        pthread_join(clientv[i].tid, NULL);
+    for (i = 0; i < nservers; ++i)
+        pthread_join(serverv[i].tid, NULL);
+
+    bench_hist_init(&hist);
+    nreqs = nbytes = nsent = 0;
+
+    for (i = 0; i < nclients; ++i) {
+        bench_hist_merge(&hist, &clientv[i].hist);
+        nsent += clientv[i].nsent;
+        nreqs += clientv[i].nreqs;
+        nbytes += clientv[i].nbytes;
+    }
+
+    arrival = (rate == 0) ? "closed" : poisson ? "poisson" : "const";
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"connections\": %d, \"msgsz\": %zu, "
+               "\"depth\": %d, \"sthreads\": %d, \"cthreads\": %d, "
+               "\"arrival\": \"%s\", \"server_data\": \"%s\", \"offered_rps\": %.2lf, "
+               "\"secs\": %.3lf, \"requests\": %lu, \"rps\": %.2lf, "
+               "\"MBps\": %.2lf, \"latency_ns\": { \"mean\": %.1lf, "
+               "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, \"p999\": %lu, "
+               "\"max\": %lu } }\n",
+               mechanism, conns, msgsz, depth, nservers, nclients, arrival,
+               rwdata ? "rwdata" : "shared", nsent / elapsed, elapsed,
+               nreqs, nreqs / elapsed, nbytes / elapsed / (1024 * 1024),
+               hist.count ? hist.sum / hist.count : 0,
+               bench_hist_pct(&hist, 50), bench_hist_pct(&hist, 90),
+               bench_hist_pct(&hist, 99), bench_hist_pct(&hist, 99.9),
+               hist.max);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,connections,msgsz,depth,sthreads,cthreads,arrival,"
+               "offered_rps,secs,requests,rps,MBps,mean,p50,p90,p99,p999,max\n");
+        printf("%s,%d,%zu,%d,%d,%d,%s,%.2lf,%.3lf,%lu,%.2lf,%.2lf,%.1lf,"
+               "%lu,%lu,%lu,%lu,%lu\n",
+               mechanism, conns, msgsz, depth, nservers, nclients, arrival,
+               nsent / elapsed, elapsed,
+               nreqs, nreqs / elapsed, nbytes / elapsed / (1024 * 1024),
+               hist.count ? hist.sum / hist.count : 0,
+               bench_hist_pct(&hist, 50), bench_hist_pct(&hist, 90),
+               bench_hist_pct(&hist, 99), bench_hist_pct(&hist, 99.9),
+               hist.max);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12d  connections\n", conns);
+        printf("%12zu  request bytes\n", msgsz);
+        if (rate > 0) {
+            printf("%12s  arrivals\n", arrival);
+            printf("%12.2lf  offered requests/sec\n", nsent / elapsed);
+        } else {
+            printf("%12d  pipeline depth\n", depth);
+        }
+        printf("%12d  server threads\n", nservers);
+        printf("%12s  server event data\n", rwdata ? "rwdata" : "shared");
+        printf("%12d  client threads\n", nclients);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  total requests\n", nreqs);
+        printf("%12.2lf  requests/sec\n", nreqs / elapsed);
+        printf("%12.2lf  MiB/sec\n", nbytes / elapsed / (1024 * 1024));
+        printf("%12.2lf  latency mean (us)\n",
+               hist.count ? hist.sum / hist.count / 1000 : 0);
+        printf("%12.2lf  latency p50 (us)\n", bench_hist_pct(&hist, 50) / 1000.0);
+        printf("%12.2lf  latency p90 (us)\n", bench_hist_pct(&hist, 90) / 1000.0);
+        printf("%12.2lf  latency p99 (us)\n", bench_hist_pct(&hist, 99) / 1000.0);
+        printf("%12.2lf  latency p99.9 (us)\n", bench_hist_pct(&hist, 99.9) / 1000.0);
+        printf("%12.2lf  latency max (us)\n", hist.max / 1000.0);
+    }
+
+    for (i = 0; i < nclients; ++i)
+        worker_fini(clientv + i, 1);
+    for (i = 0; i < nservers; ++i)
+        worker_fini(serverv + i, 0);
+
+    free(clientv);
+    free(serverv);
+
+    return 0;
+}
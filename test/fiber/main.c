@@ -0,0 +1,599 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * fiber compares xpoll fibers with threads in two ways:
+ *
+ * With -s it measures the cost of a context switch: two fibers (or with
+ * -T two threads) hand control back and forth as fast as they can.
+ *
+ * Otherwise it measures connections per core: a client thread keeps one
+ * -m msgsz request outstanding on each of -c loopback TCP connections,
+ * while the server echoes each back from blocking-style code that runs
+ * either as one fiber per connection on a single xpoll loop, or with
+ * -T as one thread per connection with blocking sockets.  It reports
+ * requests/sec along with the server's CPU time per request.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct cconn {
+    int fd;
+    size_t off;             // bytes of the current response received
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+volatile unsigned long nhandoffs;
+
+pthread_mutex_t turn_mtx = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t turn_cv = PTHREAD_COND_INITIALIZER;
+int turn;
+
+struct xpoll_fibers fibers;
+int *sfdv, *cfdv;
+int conns;
+unsigned long nrequests;
+double client_cpu;
+size_t stacksz;
+size_t msgsz;
+int fdmax;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-sT] [-c conns] [-d secs] [-m msgsz] [-o fmt] "
+           "[-S stacksz] [-w secs]\n", progname);
+    printf("-c conns     number of connections (default: 64)\n");
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-h           print this help list\n");
+    printf("-m msgsz     request size in bytes (default: 64)\n");
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-S stacksz   fiber and thread stack size (default: 65536)\n");
+    printf("-s           measure context switch cost rather than echo\n");
+    printf("-T           use threads rather than fibers\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+}
+
+static double
+process_cpu(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+
+    return bench_tv2sec(&ru.ru_utime) + bench_tv2sec(&ru.ru_stime);
+}
+
+static void
+spawn(pthread_t *tidp, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    int rc;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stacksz < PTHREAD_STACK_MIN ? PTHREAD_STACK_MIN : stacksz);
+
+    rc = pthread_create(tidp, &attr, fn, arg);
+    if (rc) {
+        errno = rc;
+        bench_fatal("pthread_create");
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+/*
+ * Run before either test with fibers: printf() of a double (or a long
+ * double) uses SSE stores to 16-byte aligned stack slots, which fault
+ * unless each fiber starts with its stack aligned as the ABI requires.
+ */
+static void
+align_fiber(void *arg)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "%.1f %.1Lf", 1.5, (long double)2.5);
+
+    *(int *)arg = !strcmp(buf, "1.5 2.5");
+}
+
+/*
+ * Context switch cost: two fibers which yield to each other (i.e., two
+ * switches per handoff, via the scheduler), or two threads which pass
+ * a turn back and forth under a mutex and condition variable.
+ */
+static void
+switch_fiber(void *arg)
+{
+    (void)arg;
+
+    while (phase < 2) {
+        ++nhandoffs;
+        xpoll_fiber_yield(&fibers);
+    }
+}
+
+static void *
+switch_fibers_main(void *arg)
+{
+    (void)arg;
+
+    if (xpoll_fiber_create(&fibers, switch_fiber, NULL) ||
+        xpoll_fiber_create(&fibers, switch_fiber, NULL))
+        bench_fatal("xpoll_fiber_create");
+
+    if (xpoll_fibers_run(&fibers))
+        bench_fatal("xpoll_fibers_run");
+
+    return NULL;
+}
+
+static void *
+switch_thread_main(void *arg)
+{
+    int self = (intptr_t)arg;
+
+    pthread_mutex_lock(&turn_mtx);
+    while (phase < 2) {
+        while (turn != self && phase < 2)
+            pthread_cond_wait(&turn_cv, &turn_mtx);
+
+        ++nhandoffs;
+        turn = !self;
+        pthread_cond_signal(&turn_cv);
+    }
+    pthread_mutex_unlock(&turn_mtx);
+
+    return NULL;
+}
+
+/*
+ * Echo server, written once in blocking style for both fibers and
+ * threads.
+ */
+static void
+echo_fiber(void *arg)
+{
+    int fd = (intptr_t)arg;
+    char buf[msgsz];
+    ssize_t cc;
+
+    while ((cc = xpoll_fiber_read(&fibers, fd, buf, msgsz)) > 0) {
+        if (xpoll_fiber_write(&fibers, fd, buf, cc) != cc)
+            break;
+    }
+
+    xpoll_fiber_close(&fibers, fd);
+}
+
+static void *
+echo_fibers_main(void *arg)
+{
+    int i;
+
+    (void)arg;
+
+    for (i = 0; i < conns; ++i) {
+        if (xpoll_fiber_create(&fibers, echo_fiber, (void *)(intptr_t)sfdv[i]))
+            bench_fatal("xpoll_fiber_create");
+    }
+
+    if (xpoll_fibers_run(&fibers))
+        bench_fatal("xpoll_fibers_run");
+
+    return NULL;
+}
+
+static void *
+echo_thread_main(void *arg)
+{
+    int fd = (intptr_t)arg;
+    char buf[msgsz];
+    ssize_t cc, n, off;
+
+    while ((cc = read(fd, buf, msgsz)) > 0) {
+        for (off = 0; off < cc; off += n) {
+            n = write(fd, buf + off, cc - off);
+            if (n == -1)
+                goto out;
+        }
+    }
+
+  out:
+    close(fd);
+
+    return NULL;
+}
+
+static void *
+client_main(void *arg)
+{
+    struct cconn *connv;
+    unsigned long nreqs = 0;
+    struct xpoll *xpoll;
+    char *msg, *buf;
+    struct bench_cpu cpu = { 0 };
+    int i;
+
+    (void)arg;
+
+    connv = calloc(conns, sizeof(*connv));
+    msg = calloc(2, msgsz);
+    if (!connv || !msg)
+        bench_fatal("calloc");
+    buf = msg + msgsz;
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll)
+        bench_fatal("xpoll_create");
+
+    for (i = 0; i < conns; ++i) {
+        connv[i].fd = cfdv[i];
+
+        if (xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, cfdv[i], connv + i))
+            bench_fatal("xpoll_ctl");
+
+        if (write(cfdv[i], msg, msgsz) != (ssize_t)msgsz)
+            bench_fatal("write");
+    }
+
+    while (phase < 2) {
+        struct cconn *conn;
+        int revents;
+
+        if (bench_cpu_phase(&cpu, phase))
+            nreqs = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, (void **)&conn))) {
+            ssize_t cc;
+
+            cc = read(conn->fd, buf, msgsz - conn->off);
+            if (cc < 1) {
+                if (cc == -1 && errno == EAGAIN)
+                    continue;
+                bench_fatal("read");
+            }
+
+            conn->off += cc;
+            if (conn->off < msgsz)
+                continue;
+
+            conn->off = 0;
+            ++nreqs;
+
+            if (write(conn->fd, msg, msgsz) != (ssize_t)msgsz)
+                bench_fatal("write");
+        }
+    }
+
+    bench_cpu_done(&cpu);
+    client_cpu = cpu.secs;
+    nrequests = nreqs;
+
+    xpoll_destroy(xpoll);
+    free(connv);
+    free(msg);
+
+    return NULL;
+}
+
+static void
+tcp_pairs(int threads)
+{
+    struct sockaddr_in sin;
+    int lfd, i;
+
+    lfd = net_listen(&sin, SOMAXCONN);
+
+    sfdv = calloc(conns, sizeof(*sfdv));
+    cfdv = calloc(conns, sizeof(*cfdv));
+    if (!sfdv || !cfdv)
+        bench_fatal("calloc");
+
+    for (i = 0; i < conns; ++i) {
+        net_tcp_pair(lfd, &sin, fdmax, cfdv + i, sfdv + i);
+
+        /* Thread-per-connection servers use blocking I/O. */
+        if (threads)
+            net_setnonblock(sfdv[i], 0);
+    }
+
+    close(lfd);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    unsigned long nswitches, handoffs;
+    pthread_t *tidv, client_tid;
+    u_int warmup, secs;
+    const char *fmt, *model;
+    double elapsed, cpu, server_cpu;
+    int threads, swtest;
+    struct xpoll *xpoll;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    stacksz = 64 * 1024;
+    msgsz = 64;
+    conns = 64;
+    threads = 0;
+    swtest = 0;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":c:d:hm:o:S:sTw:"))) {
+        switch (rc) {
+        case 'c':
+            conns = bench_getnum(rc, optarg, 1, 100000);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 16 * 1024);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'S':
+            stacksz = bench_getnum(rc, optarg, 16 * 1024, 64 * 1024 * 1024);
+            break;
+
+        case 's':
+            swtest = 1;
+            break;
+
+        case 'T':
+            threads = 1;
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    model = threads ? "threads" : "fibers";
+    fdmax = conns * 2 + 16;
+
+    xpoll = xpoll_create(fdmax);
+    if (!xpoll)
+        bench_fatal("xpoll_create");
+
+    if (xpoll_fibers_init(&fibers, xpoll, stacksz))
+        bench_fatal("xpoll_fibers_init");
+
+    if (!threads) {
+        int ok = 0;
+
+        if (xpoll_fiber_create(&fibers, align_fiber, &ok))
+            bench_fatal("xpoll_fiber_create");
+        if (xpoll_fibers_run(&fibers))
+            bench_fatal("xpoll_fibers_run");
+
+        if (!ok) {
+            fprintf(stderr, "%s: floating point output from a fiber is wrong\n",
+                    progname);
+            exit(EX_SOFTWARE);
+        }
+    }
+
+    tidv = calloc(conns + 2, sizeof(*tidv));
+    if (!tidv)
+        bench_fatal("calloc");
+
+    if (swtest) {
+        if (threads) {
+            spawn(tidv + 0, switch_thread_main, (void *)0);
+            spawn(tidv + 1, switch_thread_main, (void *)1);
+        }
+        else {
+            spawn(tidv + 0, switch_fibers_main, NULL);
+        }
+    }
+    else {
+        tcp_pairs(threads);
+
+        if (threads) {
+            for (i = 0; i < conns; ++i)
+                spawn(tidv + i, echo_thread_main, (void *)(intptr_t)sfdv[i]);
+        }
+        else {
+            spawn(tidv + 0, echo_fibers_main, NULL);
+        }
+
+        spawn(&client_tid, client_main, NULL);
+    }
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+    handoffs = nhandoffs;
+    nswitches = fibers.nswitches;
+    cpu = process_cpu();
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    handoffs = nhandoffs - handoffs;
+    nswitches = fibers.nswitches - nswitches;
+    cpu = process_cpu() - cpu;
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    if (swtest) {
+        if (threads) {
+            pthread_mutex_lock(&turn_mtx);
+            pthread_cond_broadcast(&turn_cv);
+            pthread_mutex_unlock(&turn_mtx);
+            pthread_join(tidv[1], NULL);
+        }
+        pthread_join(tidv[0], NULL);
+
+        /* Threads hand off directly, so each handoff is one switch. */
+        if (threads)
+            nswitches = handoffs;
+
+        if (!strcmp(fmt, "json")) {
+            printf("{ \"test\": \"switch\", \"model\": \"%s\", \"secs\": %.3lf, "
+                   "\"handoffs\": %lu, \"switches\": %lu, "
+                   "\"ns_per_handoff\": %.1lf, \"ns_per_switch\": %.1lf }\n",
+                   model, elapsed, handoffs, nswitches,
+                   elapsed * 1e9 / handoffs, elapsed * 1e9 / nswitches);
+        }
+        else if (!strcmp(fmt, "csv")) {
+            printf("test,model,secs,handoffs,switches,ns_per_handoff,ns_per_switch\n");
+            printf("switch,%s,%.3lf,%lu,%lu,%.1lf,%.1lf\n",
+                   model, elapsed, handoffs, nswitches,
+                   elapsed * 1e9 / handoffs, elapsed * 1e9 / nswitches);
+        }
+        else {
+            printf("%12s  model\n", model);
+            printf("%12.3lf  secs\n", elapsed);
+            printf("%12lu  handoffs\n", handoffs);
+            printf("%12lu  context switches\n", nswitches);
+            printf("%12.1lf  ns/handoff\n", elapsed * 1e9 / handoffs);
+            printf("%12.1lf  ns/switch\n", elapsed * 1e9 / nswitches);
+        }
+    }
+    else {
+        pthread_join(client_tid, NULL);
+
+        /*
+         * Closing the client sockets causes each server fiber or thread
+         * to read EOF and exit.
+         */
+        for (i = 0; i < conns; ++i)
+            close(cfdv[i]);
+
+        for (i = 0; i < (threads ? conns : 1); ++i)
+            pthread_join(tidv[i], NULL);
+
+        server_cpu = cpu - client_cpu;
+
+        if (!strcmp(fmt, "json")) {
+            printf("{ \"test\": \"echo\", \"mechanism\": \"%s\", \"model\": \"%s\", "
+                   "\"connections\": %d, \"msgsz\": %zu, \"secs\": %.3lf, "
+                   "\"requests\": %lu, \"requests_per_sec\": %.0lf, "
+                   "\"server_cpu\": %.3lf, \"server_us_per_request\": %.3lf }\n",
+                   mechanism, model, conns, msgsz, elapsed, nrequests,
+                   nrequests / elapsed, server_cpu,
+                   nrequests ? server_cpu * 1e6 / nrequests : 0);
+        }
+        else if (!strcmp(fmt, "csv")) {
+            printf("test,mechanism,model,connections,msgsz,secs,requests,"
+                   "requests_per_sec,server_cpu,server_us_per_request\n");
+            printf("echo,%s,%s,%d,%zu,%.3lf,%lu,%.0lf,%.3lf,%.3lf\n",
+                   mechanism, model, conns, msgsz, elapsed, nrequests,
+                   nrequests / elapsed, server_cpu,
+                   nrequests ? server_cpu * 1e6 / nrequests : 0);
+        }
+        else {
+            printf("%12s  mechanism\n", mechanism);
+            printf("%12s  model\n", model);
+            printf("%12d  connections\n", conns);
+            printf("%12zu  msgsz\n", msgsz);
+            printf("%12.3lf  secs\n", elapsed);
+            printf("%12lu  total requests\n", nrequests);
+            printf("%12.0lf  requests/sec\n", nrequests / elapsed);
+            printf("%12.3lf  server cpu secs\n", server_cpu);
+            printf("%12.3lf  server cpu usecs/request\n",
+                   nrequests ? server_cpu * 1e6 / nrequests : 0);
+        }
+    }
+
+    xpoll_fibers_fini(&fibers);
+    xpoll_destroy(xpoll);
+    free(tidv);
+
+    return 0;
+}
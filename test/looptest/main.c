@@ -44,6 +44,8 @@
 #include <netinet/in.h>
 
 #include "xpoll.h"
+#include "bench.h"
+#include "perfctr.h"
 
 #ifndef INFTIM
 #define INFTIM (-1)
@@ -51,8 +53,22 @@
 
 struct conn {
     int fd[2];
+    struct conn *next;      // successor in the ring
+    void *data;             // xpoll_ctl() data: conn or its handle (-G)
+    u_long nreads;
+    uint64_t tstamp;        // time at which the token was sent (see -L)
+    char state[];           // per-connection payload (see -s)
 };
 
+/*
+ * Connections are laid out with a stride of connsz bytes so that
+ * each may carry an arbitrary amount of per-connection state.
+ */
+#define CONN(_connv, _connsz, _i) \
+    ((struct conn *)((char *)(_connv) + (size_t)(_i) * (_connsz)))
+
+#define CACHELINE       (64)
+
 volatile sig_atomic_t sigalrm;
 
 void
@@ -63,6 +79,361 @@ sigalrm_isr(int sig)
 }
 
 char rwbuf[PIPE_BUF];
+char *progname;
+
+size_t statesz;
+ssize_t rwmax;
+/*
+ * How each token is passed to the next pipe: by waiting for POLLOUT on
+ * its write-end (the default), via the xpoll write queue (-q), or by a
+ * write deferred to the pre-wait hook (-D).
+ */
+enum wmode {
+    WMODE_POLLOUT,
+    WMODE_QUEUE,
+    WMODE_DEFER,
+};
+
+const char *wmodev[] = { "pollout", "queued", "deferred" };
+const char *hugev[] = { "base", "hugetlb", "thp" };    // by enum xpoll_huge
+
+enum wmode wmode;
+struct conn **deferv;       // conns with a deferred write (see -D)
+int deferc;
+int defererr;               // errno from the last deferred write
+u_long deferwrc;            // writes made by the pre-wait hook
+struct bench_hist *hist;
+struct perfctr *perfctr;
+int handles;                // register generational handles (see -G)
+int hugeflag;               // back xpoll's tables with huge pages (see -H)
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+/*
+ * Results of one timed run of the event loop.
+ */
+struct run {
+    double secs;
+    u_long iter;
+    u_long rd_total;
+};
+
+static void
+usage(void)
+{
+    printf("usage: %s [-DGHLPqr] [-c cpu] [-d secs] [-n reps] [-o fmt] "
+           "[-s statesz] [-t tokens] [-w secs] [connmax]\n", progname);
+    printf("-c cpu      pin the process to the given cpu\n");
+    printf("-D          defer writes to the pre-wait hook rather than POLLOUT\n");
+    printf("-d secs     duration of each measured run (default: 10)\n");
+    printf("-G          register generational handles rather than pointers\n");
+    printf("-H          back xpoll's fd tables with huge pages\n");
+    printf("-h          print this help list\n");
+    printf("-L          measure the latency of each hop around the ring\n");
+    printf("-n reps     number of measured runs (default: 1)\n");
+    printf("-P          report hardware event counts per read\n");
+    printf("-o fmt      output format: text, json, or csv (default: text)\n");
+    printf("-q          write via the xpoll write queue rather than POLLOUT\n");
+    printf("-r          visit connections in random order\n");
+    printf("-s statesz  bytes of state to touch per connection\n");
+    printf("-t tokens   number of tokens circulating the ring (default: 1)\n");
+    printf("-w secs     duration of the unmeasured warmup run (default: 0)\n");
+    printf("connmax     number of pipes in the ring (default: 8)\n");
+}
+
+/*
+ * Link the connections into a single ring.  By default each connection's
+ * successor is the next connection in the array, such that the walk is
+ * perfectly sequential and easily prefetched.  If randring is true then
+ * Sattolo's algorithm is used to generate a random cyclic permutation,
+ * such that the walk visits every connection exactly once per lap but
+ * in an order which defeats the hardware prefetcher.
+ */
+static void
+ring_init(struct conn *connv, size_t connsz, int connc, int randring)
+{
+    int *permv;
+    int i;
+
+    permv = malloc(sizeof(*permv) * connc);
+    if (!permv)
+        exit(EX_OSERR);
+
+    for (i = 0; i < connc; ++i)
+        permv[i] = randring ? i : (i + 1) % connc;
+
+    if (randring) {
+        srandom(connc);
+
+        for (i = connc - 1; i > 0; --i) {
+            int j = random() % i;
+            int tmp = permv[i];
+
+            permv[i] = permv[j];
+            permv[j] = tmp;
+        }
+    }
+
+    for (i = 0; i < connc; ++i)
+        CONN(connv, connsz, i)->next = CONN(connv, connsz, permv[i]);
+
+    free(permv);
+}
+
+/*
+ * Pre-wait hook for -D, which writes the tokens deferred during the
+ * last loop iteration.  Errors are reported via defererr.
+ */
+static void
+defer_flush(struct xpoll *xpoll, int nrdy, void *arg)
+{
+    (void)xpoll;
+    (void)nrdy;
+    (void)arg;
+
+    for (int i = 0; i < deferc; ++i) {
+        if (write(deferv[i]->fd[1], rwbuf, rwmax) != rwmax) {
+            defererr = errno ? errno : EIO;
+            break;
+        }
+        ++deferwrc;
+    }
+
+    deferc = 0;
+}
+
+/*
+ * Run the event loop for the given number of seconds.  The loop may be
+ * called repeatedly as all of its state (i.e., which pipe currently
+ * holds the token and whether it is enabled for POLLIN or POLLOUT) is
+ * carried in the xpoll instance.  Returns 0 on success, otherwise -1
+ * if an unexpected event or I/O error caused the run to end early.
+ */
+static int
+loop(struct xpoll *xpoll, u_int secs, struct run *run)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    u_long rd_total;
+    u_long iter;
+    int rc = 0;
+
+    rd_total = 0;
+    iter = 0;
+
+    sigalrm = 0;
+    alarm(secs);
+
+    if (perfctr)
+        perfctr_start(perfctr);
+
+    gettimeofday(&tv_start, NULL);
+
+    while (!sigalrm) {
+        int n;
+
+        n = xpoll_wait(xpoll, INFTIM);
+
+        if (defererr) {
+            fprintf(stderr, "deferred write: %s\n", strerror(defererr));
+            goto errout;
+        }
+
+        if (n < 1) {
+            if (-1 == n && errno == EINTR)
+                continue;
+
+            fprintf(stderr, "xpoll: %s\n",
+                    (-1 == n) ? strerror(errno) : "timeout");
+            sleep(1);
+            continue;
+        }
+
+        while (1) {
+            struct conn *conn;
+            ssize_t rcc, wcc;
+            int revents;
+
+            revents = xpoll_revents(xpoll, (void **)&conn);
+            if (!revents)
+                break;
+
+            if (revents & (POLLERR | POLLHUP)) {
+                fprintf(stderr, "pollerr | pollhup: conn=%p\n", conn);
+                goto errout;
+            }
+
+            if (revents & POLLIN) {
+                struct conn *rconn = conn;
+                struct conn *wconn;
+
+                rcc = read(rconn->fd[0], rwbuf, rwmax);
+                if (rcc < 1) {
+                    fprintf(stderr, "read(%d, %p, %ld): %s\n",
+                            rconn->fd[0], rwbuf, rwmax,
+                            (-1 == rcc) ? strerror(errno) : "EOF");
+                    goto errout;
+                }
+
+                for (size_t off = 0; off < statesz; off += CACHELINE)
+                    rconn->state[off]++;
+                ++rconn->nreads;
+
+                wconn = rconn->next;
+
+                if (hist) {
+                    uint64_t now = bench_nsecs();
+
+                    if (rconn->tstamp)
+                        bench_hist_add(hist, now - rconn->tstamp);
+                    wconn->tstamp = now;
+                }
+
+                /*
+                 * With -q the token is queued for xpoll_wait() to write
+                 * before it next polls, and with -D it is written by the
+                 * pre-wait hook.  Otherwise it is written once POLLOUT
+                 * is returned for the successor's write-end.
+                 */
+                if (wmode == WMODE_DEFER) {
+                    deferv[deferc++] = wconn;
+                } else if (wmode == WMODE_QUEUE) {
+                    rc = xpoll_write(xpoll, wconn->fd[1], rwbuf, rwmax, NULL, NULL);
+                    if (rc) {
+                        fprintf(stderr, "xpoll_write: wconn=%p: %s\n",
+                                wconn, strerror(errno));
+                        goto errout;
+                    }
+                } else {
+                    rc = xpoll_ctl(xpoll, XPOLL_ENABLE, POLLOUT, wconn->fd[1], wconn->data);
+                    if (rc) {
+                        fprintf(stderr, "xpoll_ctl: enable pollout wconn=%p\n", wconn);
+                        goto errout;
+                    }
+                }
+
+                ++rd_total;
+            }
+
+            if ((revents & POLLOUT) && wmode == WMODE_QUEUE) {
+                struct conn *wconn = conn;
+
+                if (xpoll_flush(xpoll, wconn->fd[1]) == -1) {
+                    fprintf(stderr, "xpoll_flush: wconn=%p: %s\n",
+                            wconn, strerror(errno));
+                    goto errout;
+                }
+            } else if (revents & POLLOUT) {
+                struct conn *wconn = conn;
+
+                rc = xpoll_ctl(xpoll, XPOLL_DISABLE, POLLOUT, wconn->fd[1], wconn->data);
+                if (rc) {
+                    fprintf(stderr, "xpoll_ctl: disable pollout wconn=%p\n", wconn);
+                    goto errout;
+                }
+
+                wcc = write(wconn->fd[1], rwbuf, rwmax);
+                if (wcc != rwmax) {
+                    fprintf(stderr, "%ld = write(%d, %p, %ld): %s\n",
+                            wcc, wconn->fd[1], rwbuf, rwmax,
+                            (-1 == wcc) ? strerror(errno) : "short write");
+                    goto errout;
+                }
+            }
+        }
+
+        ++iter;
+    }
+
+    if (0) {
+      errout:
+        alarm(0);
+        rc = -1;
+    }
+
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+
+    if (perfctr)
+        perfctr_stop(perfctr);
+
+    run->secs = bench_tv2sec(&tv_diff);
+    run->iter = iter;
+    run->rd_total = rd_total;
+
+    return rc;
+}
+
+static double
+run_rate(const struct run *run)
+{
+    return run->secs > 0 ? run->iter / run->secs : 0;
+}
+
+/*
+ * Print the event counts accumulated in pc normalized by the number
+ * of read operations, in the given format.  Counters which could not
+ * be opened are reported as n/a (text), null (json), or empty (csv).
+ */
+static void
+perfctr_print(const struct perfctr *pc, u_long nreads, const char *fmt)
+{
+    static const char *modev[] = { "user", "kernel" };
+    const char *sep = "";
+
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+            const char *name = perfctr_name(event);
+            const char *mname = modev[mode];
+            double val = 0;
+            int valid;
+
+            /* Context switches are only ever counted once (as user). */
+            if (event == PERFCTR_CTXSW) {
+                if (mode != PERFCTR_USER)
+                    continue;
+                mname = "all";
+            }
+
+            valid = perfctr_valid(pc, mode, event);
+            if (valid && nreads > 0)
+                val = (double)pc->valv[mode][event] / nreads;
+
+            if (!strcmp(fmt, "json")) {
+                printf("%s\"%s-%s\": ", sep, name, mname);
+                printf(valid ? "%.3lf" : "null", val);
+                sep = ", ";
+            } else if (!strcmp(fmt, "csv")) {
+                printf(valid ? ",%.3lf" : ",", val);
+            } else if (valid) {
+                printf("%12.3lf  %s/read (%s)\n", val, name, mname);
+            } else {
+                printf("%12s  %s/read (%s)\n", "n/a", name, mname);
+            }
+        }
+    }
+}
+
+static void
+perfctr_print_hdr(void)
+{
+    static const char *modev[] = { "user", "kernel" };
+
+    for (int mode = 0; mode < PERFCTR_MODES; ++mode) {
+        for (int event = 0; event < PERFCTR_MAX; ++event) {
+            if (event == PERFCTR_CTXSW && mode != PERFCTR_USER)
+                continue;
+
+            printf(",%s-%s", perfctr_name(event),
+                   (event == PERFCTR_CTXSW) ? "all" : modev[mode]);
+        }
+    }
+}
 
 /*
  * The following is a simple test program to demonstrate the power and
@@ -86,30 +457,136 @@ char rwbuf[PIPE_BUF];
  * shows that poll(2) performs increasingly worse as n goes up, while
  * epoll(7)/kqueue(2) produce consistent results regardless of n
  * (until n becomes very large).
+ *
+ * To make small differences measurable the loop may be preceded by
+ * an unmeasured warmup run (-w) and repeated any number of times (-n),
+ * after which the median, standard deviation, and 95% confidence
+ * interval of the per-run rates are reported.
  */
 int
 main(int argc, char **argv)
 {
-    struct timeval tv_start, tv_stop, tv_diff;
+    struct bench_summary sum;
+    struct bench_hist *histv;
+    struct perfctr pc;
     struct xpoll *xpoll;
     struct conn *connv;
-    ssize_t cc, rwmax;
+    struct run *runv;
+    double *ratev;
+    const char *fmt;
+    size_t connsz;
+    u_int warmup, secs;
     u_long rd_total;
-    u_long iter;
+    ssize_t cc;
+    int randring;
+    int latency;
+    int counters;
+    int tokens;
     int connc;
+    int nreps;
+    int cpu;
     int rc;
     int i;
 
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    randring = 0;
+    latency = 0;
+    counters = 0;
+    tokens = 1;
+    statesz = 0;
+    warmup = 0;
+    secs = 10;
+    nreps = 1;
     connc = 8;
     rwmax = 1;
+    cpu = -1;
+
+    while (-1 != (rc = getopt(argc, argv, ":c:Dd:GHhLn:o:Pqrs:t:w:"))) {
+        switch (rc) {
+        case 'c':
+            cpu = bench_getnum(rc, optarg, 0, INT_MAX);
+            break;
+
+        case 'D':
+            wmode = WMODE_DEFER;
+            break;
+
+        case 'G':
+            handles = 1;
+            break;
 
-    if (argc > 1) {
-        if (argv[1][0] == '-') {
-            printf("usage: %s [connmax [connlimit [rwmax]]]\n", argv[0]);
+        case 'H':
+            hugeflag = XPOLL_INIT_HUGE;
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
             exit(0);
+
+        case 'L':
+            latency = 1;
+            break;
+
+        case 'n':
+            nreps = bench_getnum(rc, optarg, 1, 100000);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'P':
+            counters = 1;
+            break;
+
+        case 'q':
+            wmode = WMODE_QUEUE;
+            break;
+
+        case 'r':
+            randring = 1;
+            break;
+
+        case 's':
+            statesz = bench_getnum(rc, optarg, 0, ULONG_MAX);
+            break;
+
+        case 't':
+            tokens = bench_getnum(rc, optarg, 1, INT_MAX);
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
         }
+    }
 
-        connc = strtol(argv[1], NULL, 0);
+    argc -= optind;
+    argv += optind;
+
+    if (argc > 0) {
+        connc = strtol(argv[0], NULL, 0);
         if (connc < 1)
             connc = 1;
     }
@@ -119,31 +596,63 @@ main(int argc, char **argv)
     else if ((size_t)rwmax > sizeof(rwbuf))
         rwmax = sizeof(rwbuf);
 
-    if (connc == 1) {
-#if XPOLL_KQUEUE
-        const char *pollname = "kevent";
-#elif XPOLL_EPOLL
-        const char *pollname = "epoll";
-#else
-        const char *pollname = "poll";
-#endif
+    if (cpu >= 0) {
+        rc = bench_pin_cpu(cpu);
+        if (rc) {
+            fprintf(stderr, "%s: unable to pin to cpu %d: %s\n",
+                    progname, cpu, strerror(rc));
+            exit(EX_OSERR);
+        }
+    }
 
+    if (connc == 1 && !strcmp(fmt, "text")) {
         printf("%6s %6s %9s %8s %12s\n",
-               "NFD", "SEC", pollname, "READ", "XPOLL/SEC");
+               "NFD", "SEC", mechanism, "READ", "XPOLL/SEC");
     }
 
-    connv = malloc(sizeof(*connv) * connc);
-    if (!connv)
+    /*
+     * Round the stride up to a multiple of the cache line size once
+     * there is any state so that no two connections share a line.
+     */
+    connsz = sizeof(*connv) + statesz;
+    if (statesz > 0)
+        connsz = (connsz + CACHELINE - 1) & ~(size_t)(CACHELINE - 1);
+    else
+        connsz = (connsz + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    connv = calloc(connc, connsz);
+    runv = calloc(nreps, sizeof(*runv));
+    ratev = calloc(nreps, sizeof(*ratev));
+    histv = calloc(latency ? nreps + 1 : 1, sizeof(*histv));
+    if (!connv || !runv || !ratev || !histv)
         exit(1);
 
-    xpoll = xpoll_create(connc * 2);
+    xpoll = xpoll_create_flags(connc * 2, hugeflag);
     if (!xpoll) {
-        fprintf(stderr, "xpoll_create: %s\n", strerror(errno));
+        fprintf(stderr, "xpoll_create_flags: %s\n", strerror(errno));
         exit(1);
     }
 
+    if (handles && xpoll_handles_init(xpoll, connc)) {
+        fprintf(stderr, "xpoll_handles_init: %s\n", strerror(errno));
+        exit(EX_OSERR);
+    }
+
     for (i = 0; i < connc; ++i) {
-        struct conn *conn = connv + i;
+        struct conn *conn = CONN(connv, connsz, i);
+
+        conn->data = conn;
+
+        if (handles) {
+            xpoll_handle_t handle = xpoll_handle_alloc(xpoll, conn);
+
+            if (!handle) {
+                fprintf(stderr, "xpoll_handle_alloc: %s\n", strerror(errno));
+                exit(EX_OSERR);
+            }
+
+            conn->data = XPOLL_HANDLE_DATA(handle);
+        }
 
         rc = pipe(conn->fd);
         if (rc) {
@@ -152,131 +661,220 @@ main(int argc, char **argv)
             break;
         }
 
-        rc = xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, conn->fd[0], conn);
+        rc = xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, conn->fd[0], conn->data);
         if (rc) {
             fprintf(stderr, "xpoll_ctl(%p, ADD, POLLIN, %d): %s\n",
                     xpoll, conn->fd[0], strerror(errno));
             exit(EX_OSERR);
         }
 
-        rc = xpoll_ctl(xpoll, XPOLL_ADD, POLLOUT, conn->fd[1], conn);
+        rc = xpoll_ctl(xpoll, XPOLL_ADD, POLLOUT, conn->fd[1], conn->data);
         if (rc) {
             fprintf(stderr, "xpoll_ctl(%p, ADD, POLLOUT, %d): %s\n",
                     xpoll, conn->fd[0], strerror(errno));
             exit(EX_OSERR);
         }
 
-        rc = xpoll_ctl(xpoll, XPOLL_DISABLE, POLLOUT, conn->fd[1], conn);
+        rc = xpoll_ctl(xpoll, XPOLL_DISABLE, POLLOUT, conn->fd[1], conn->data);
     }
 
-    cc = write(connv->fd[1], rwbuf, rwmax);
-    if (cc != rwmax) {
-        fprintf(stderr, "write: %s\n", strerror(errno));
-        exit(1);
-    }
+    if (connc < 1)
+        exit(EX_OSERR);
 
-    rd_total = 0;
-    iter = 0;
+    ring_init(connv, connsz, connc, randring);
 
-    signal(SIGALRM, sigalrm_isr);
-    alarm(10);
+    /* Each conn is written at most once per loop iteration. */
+    if (wmode == WMODE_DEFER) {
+        deferv = calloc(connc, sizeof(*deferv));
+        if (!deferv)
+            exit(EX_OSERR);
 
-    gettimeofday(&tv_start, NULL);
+        xpoll_hook(xpoll, XPOLL_HOOK_PREWAIT, defer_flush, NULL);
+    }
 
-    while (!sigalrm) {
-        int n;
+    /*
+     * Start the tokens off spaced evenly around the ring.  With more
+     * than one token in flight each call to xpoll_wait() may return
+     * several ready descriptors.
+     */
+    if (tokens > connc)
+        tokens = connc;
 
-        n = xpoll_wait(xpoll, INFTIM);
+    for (i = 0; i < tokens; ++i) {
+        struct conn *conn = connv;
 
-        if (n < 1) {
-            fprintf(stderr, "xpoll: %s\n",
-                    (-1 == n) ? strerror(errno) : "timeout");
-            sleep(1);
-            continue;
+        for (int j = 0; j < (int)(((long)connc * i) / tokens); ++j)
+            conn = conn->next;
+
+        cc = write(conn->fd[1], rwbuf, rwmax);
+        if (cc != rwmax) {
+            fprintf(stderr, "write: %s\n", strerror(errno));
+            exit(1);
         }
+    }
 
-        while (1) {
-            struct conn *conn;
-            ssize_t rcc, wcc;
-            int revents;
+    if (counters) {
+        if (perfctr_open(&pc)) {
+            fprintf(stderr, "%s: unable to open event counters: %s\n",
+                    progname, strerror(errno));
+            exit(EX_UNAVAILABLE);
+        }
+    }
 
-            revents = xpoll_revents(xpoll, (void **)&conn);
-            if (!revents)
-                break;
+    signal(SIGALRM, sigalrm_isr);
 
-            if (revents & (POLLERR | POLLHUP)) {
-                fprintf(stderr, "pollerr | pollhup: conn=%p\n", conn);
-                goto errout;
-            }
+    rc = 0;
 
-            if (revents & POLLIN) {
-                struct conn *rconn = conn;
-                struct conn *wconn;
+    if (warmup > 0) {
+        struct run wrun;
 
-                rcc = read(rconn->fd[0], rwbuf, rwmax);
-                if (rcc < 1) {
-                    fprintf(stderr, "read(%d, %p, %ld): %s\n",
-                            rconn->fd[0], rwbuf, rwmax,
-                            (-1 == rcc) ? strerror(errno) : "EOF");
-                    goto errout;
-                }
+        hist = latency ? histv + nreps : NULL;
 
-                wconn = rconn + 1;
-                if (wconn >= connv + connc)
-                    wconn = connv;
+        rc = loop(xpoll, warmup, &wrun);
+    }
 
-                rc = xpoll_ctl(xpoll, XPOLL_ENABLE, POLLOUT, wconn->fd[1], wconn);
-                if (rc) {
-                    fprintf(stderr, "xpoll_ctl: enable pollout wconn=%p\n", wconn);
-                    goto errout;
-                }
+    /* Count events only during the measured runs. */
+    perfctr = counters ? &pc : NULL;
+    deferwrc = 0;
 
-                ++rd_total;
-            }
+#if XPOLL_STATS
+    xpoll_stats_reset(xpoll);
+#endif
 
-            if (revents & POLLOUT) {
-                struct conn *wconn = conn;
+    for (i = 0; i < nreps && !rc; ++i) {
+        hist = latency ? histv + i : NULL;
 
-                rc = xpoll_ctl(xpoll, XPOLL_DISABLE, POLLOUT, wconn->fd[1], wconn);
-                if (rc) {
-                    fprintf(stderr, "xpoll_ctl: disable pollout wconn=%p\n", wconn);
-                    goto errout;
-                }
+        rc = loop(xpoll, secs, runv + i);
+        ratev[i] = run_rate(runv + i);
+    }
 
-                wcc = write(wconn->fd[1], rwbuf, rwmax);
-                if (wcc != rwmax) {
-                    fprintf(stderr, "%ld = write(%d, %p, %ld): %s\n",
-                            wcc, wconn->fd[1], rwbuf, rwmax,
-                            (-1 == wcc) ? strerror(errno) : "short write");
-                    goto errout;
-                }
-            }
+    nreps = i;
+
+    bench_summarize(ratev, nreps, &sum);
+
+    /* Fold the per-run latency histograms into histv[0]. */
+    for (i = 1; i < nreps; ++i)
+        bench_hist_merge(histv, histv + i);
+
+    for (i = 0, rd_total = 0; i < nreps; ++i)
+        rd_total += runv[i].rd_total;
+
+    if (!strcmp(fmt, "json")) {
+        printf("{\n");
+        printf("  \"mechanism\": \"%s\",\n", mechanism);
+        printf("  \"connections\": %d,\n", connc);
+        printf("  \"ring\": \"%s\",\n", randring ? "random" : "sequential");
+        printf("  \"statesz\": %zu,\n", statesz);
+        printf("  \"warmup\": %u,\n", warmup);
+        printf("  \"duration\": %u,\n", secs);
+        printf("  \"cpu\": %d,\n", cpu);
+        printf("  \"tokens\": %d,\n", tokens);
+        printf("  \"writes\": \"%s\",\n", wmodev[wmode]);
+        printf("  \"data\": \"%s\",\n", handles ? "handles" : "pointers");
+        printf("  \"pages\": \"%s\",\n", hugev[xpoll->huge]);
+        if (wmode == WMODE_DEFER)
+            printf("  \"hook_writes\": %lu,\n", deferwrc);
+        printf("  \"runs\": [\n");
+        for (i = 0; i < nreps; ++i) {
+            printf("    { \"secs\": %.6lf, \"iterations\": %lu, "
+                   "\"reads\": %lu, \"rate\": %.2lf }%s\n",
+                   runv[i].secs, runv[i].iter, runv[i].rd_total,
+                   ratev[i], (i + 1 < nreps) ? "," : "");
+        }
+        printf("  ],\n");
+        printf("  \"summary\": { \"n\": %d, \"min\": %.2lf, \"max\": %.2lf, "
+               "\"mean\": %.2lf, \"median\": %.2lf, \"stddev\": %.2lf, "
+               "\"ci95\": %.2lf }%s\n",
+               sum.n, sum.min, sum.max, sum.mean, sum.median,
+               sum.stddev, sum.ci95, (latency || counters) ? "," : "");
+        if (latency) {
+            printf("  \"latency\": { \"count\": %lu, \"mean\": %.1lf, "
+                   "\"p50\": %lu, \"p90\": %lu, \"p99\": %lu, "
+                   "\"p999\": %lu, \"max\": %lu }%s\n",
+                   histv->count, histv->count ? histv->sum / histv->count : 0,
+                   bench_hist_pct(histv, 50), bench_hist_pct(histv, 90),
+                   bench_hist_pct(histv, 99), bench_hist_pct(histv, 99.9),
+                   histv->max, counters ? "," : "");
+        }
+        if (counters) {
+            printf("  \"per_read\": { ");
+            perfctr_print(&pc, rd_total, fmt);
+            printf(" }\n");
+        }
+        printf("}\n");
+    } else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,connections,ring,statesz,tokens,reps,"
+               "min,max,mean,median,stddev,ci95,p50,p99,p999");
+        if (counters)
+            perfctr_print_hdr();
+        printf("\n");
+        printf("%s,%d,%s,%zu,%d,%d,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,%.2lf,"
+               "%lu,%lu,%lu",
+               mechanism, connc, randring ? "random" : "sequential",
+               statesz, tokens, sum.n, sum.min, sum.max, sum.mean, sum.median,
+               sum.stddev, sum.ci95, bench_hist_pct(histv, 50),
+               bench_hist_pct(histv, 99), bench_hist_pct(histv, 99.9));
+        if (counters)
+            perfctr_print(&pc, rd_total, fmt);
+        printf("\n");
+    } else {
+        u_long iter = 0;
+        double elapsed = 0;
+
+        for (i = 0; i < nreps; ++i) {
+            elapsed += runv[i].secs;
+            iter += runv[i].iter;
         }
 
-        ++iter;
-    }
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12d  connections\n", connc);
+        printf("%12s  ring order\n", randring ? "random" : "sequential");
+        printf("%12zu  state bytes/conn\n", statesz);
+        printf("%12d  tokens\n", tokens);
+        printf("%12s  writes\n", wmodev[wmode]);
+        printf("%12s  event data\n", handles ? "handles" : "pointers");
+        printf("%12s  table pages\n", hugev[xpoll->huge]);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12ld  total iterations\n", iter);
+        printf("%12lu  total read operations\n", rd_total);
+        if (wmode == WMODE_DEFER)
+            printf("%12lu  pre-wait hook writes\n", deferwrc);
+        printf("%12.2lf  reads/sec\n", elapsed > 0 ? iter / elapsed : 0);
+
+        if (nreps > 1) {
+            printf("%12d  repetitions\n", nreps);
+            printf("%12.2lf  reads/sec median\n", sum.median);
+            printf("%12.2lf  reads/sec stddev\n", sum.stddev);
+            printf("%12.2lf  reads/sec 95%% ci (+/-)\n", sum.ci95);
+            printf("%12.2lf  reads/sec 95%% ci (%%)\n",
+                   sum.mean > 0 ? sum.ci95 * 100 / sum.mean : 0);
+        }
 
-  errout:
-    gettimeofday(&tv_stop, NULL);
-    timersub(&tv_stop, &tv_start, &tv_diff);
+        if (latency) {
+            printf("%12lu  latency p50 (ns)\n", bench_hist_pct(histv, 50));
+            printf("%12lu  latency p90 (ns)\n", bench_hist_pct(histv, 90));
+            printf("%12lu  latency p99 (ns)\n", bench_hist_pct(histv, 99));
+            printf("%12lu  latency p99.9 (ns)\n", bench_hist_pct(histv, 99.9));
+            printf("%12lu  latency max (ns)\n", histv->max);
+        }
 
-#if XPOLL_EPOLL
-    printf("%12s  mechanism\n", "epoll");
-#elif XPOLL_KQUEUE
-    printf("%12s  mechanism\n", "kqueue");
-#else
-    printf("%12s  mechanism\n", "poll");
+        if (counters)
+            perfctr_print(&pc, rd_total, fmt);
+
+#if XPOLL_STATS
+        printf("\n");
+        xpoll_stats_print(xpoll, stdout);
 #endif
-    printf("%12d  connections\n", connc);
-    printf("%12.3lf  total run time\n",
-           (tv_diff.tv_sec * 1000000.0 + tv_diff.tv_usec) / 1000000);
-    printf("%12ld  total iterations\n", iter);
-    printf("%12lu  total read operations\n", rd_total);
-    printf("%12.2lf  reads/sec\n",
-           (iter * 1000000.0) / (tv_diff.tv_sec * 1000000 + tv_diff.tv_usec));
+    }
+
+    if (counters)
+        perfctr_close(&pc);
 
     xpoll_destroy(xpoll);
+    free(histv);
+    free(ratev);
+    free(runv);
     free(connv);
 
-    return 0;
+    return rc ? EX_SOFTWARE : 0;
 }
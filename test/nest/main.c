@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+
+#include "xpoll.h"
+#include "bench.h"
+
+/*
+ * nest compares a flat interest set with a hierarchy of xpoll instances
+ * (see xpoll_fd()).  It creates -g groups of -n pipes each, and keeps
+ * -t tokens (one byte each) hopping from pipe to randomly chosen pipe,
+ * such that at any time most groups are idle.
+ *
+ * By default every group has its own xpoll instance, whose fd is added
+ * to an outer instance, and the loop looks into a group only once the
+ * outer instance reports its fd readable.  With -f all pipes are added
+ * directly to a single instance.  It reports hops/sec along with the
+ * number of xpoll_wait() calls per hop.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct group {
+    struct xpoll *xpoll;    // the group's own instance (unless -f)
+};
+
+struct conn {
+    int fd[2];
+    struct group *group;
+};
+
+struct conn *connv;
+int nconns;
+unsigned long nhops;
+unsigned long nwaits;
+uint64_t rngstate = 0x9e3779b97f4a7c15ull;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-f] [-d secs] [-g groups] [-n pipes] [-o fmt] "
+           "[-t tokens] [-w secs]\n", progname);
+    printf("-d secs     duration of the measured run (default: 10)\n");
+    printf("-f          add all pipes to a single xpoll instance\n");
+    printf("-g groups   number of groups (default: 64)\n");
+    printf("-h          print this help list\n");
+    printf("-n pipes    number of pipes per group (default: 4)\n");
+    printf("-o fmt      output format: text, json, or csv (default: text)\n");
+    printf("-t tokens   number of tokens hopping between pipes (default: 1)\n");
+    printf("-w secs     duration of the unmeasured warmup (default: 1)\n");
+}
+
+static inline uint64_t
+rng(void)
+{
+    rngstate ^= rngstate << 13;
+    rngstate ^= rngstate >> 7;
+    rngstate ^= rngstate << 17;
+
+    return rngstate;
+}
+
+/*
+ * Consume the token from conn and pass it on to a random pipe.
+ */
+static void
+hop(struct conn *conn)
+{
+    struct conn *next;
+    char c;
+
+    if (read(conn->fd[0], &c, 1) != 1)
+        bench_fatal("read");
+
+    next = connv + rng() % nconns;
+
+    if (write(next->fd[1], &c, 1) != 1)
+        bench_fatal("write");
+
+    ++nhops;
+}
+
+/*
+ * Run the event loop for secs seconds.
+ */
+static void
+loop(struct xpoll *xpoll, int flat, u_int secs)
+{
+    uint64_t stop = bench_nsecs() + secs * 1000000000ull;
+    void *data;
+
+    while (bench_nsecs() < stop) {
+        if (xpoll_wait(xpoll, -1) == -1)
+            bench_fatal("xpoll_wait");
+
+        ++nwaits;
+
+        while (xpoll_revents(xpoll, &data)) {
+            struct group *group = data;
+            void *cdata;
+
+            if (flat) {
+                hop(data);
+                continue;
+            }
+
+            if (xpoll_wait(group->xpoll, 0) == -1)
+                bench_fatal("xpoll_wait");
+
+            ++nwaits;
+
+            while (xpoll_revents(group->xpoll, &cdata))
+                hop(cdata);
+        }
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct group *groupv;
+    struct xpoll *xpoll;
+    u_int warmup, secs;
+    const char *fmt;
+    double elapsed;
+    int groups, pipes, tokens;
+    int flat;
+    int rc;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    groups = 64;
+    pipes = 4;
+    tokens = 1;
+    warmup = 1;
+    secs = 10;
+    flat = 0;
+
+    while (-1 != (rc = getopt(argc, argv, ":d:fg:hn:o:t:w:"))) {
+        switch (rc) {
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'f':
+            flat = 1;
+            break;
+
+        case 'g':
+            groups = bench_getnum(rc, optarg, 1, 1 << 20);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'n':
+            pipes = bench_getnum(rc, optarg, 1, 1 << 20);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 't':
+            tokens = bench_getnum(rc, optarg, 1, 1 << 20);
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    nconns = groups * pipes;
+    if (tokens > nconns)
+        tokens = nconns;
+
+    connv = calloc(nconns, sizeof(*connv));
+    groupv = calloc(groups, sizeof(*groupv));
+    if (!connv || !groupv)
+        exit(EX_OSERR);
+
+    xpoll = xpoll_create(nconns * 2 + groups * 2);
+    if (!xpoll)
+        bench_fatal("xpoll_create");
+
+    for (int i = 0; i < groups; ++i) {
+        struct group *group = groupv + i;
+
+        if (flat)
+            continue;
+
+        group->xpoll = xpoll_create(nconns * 2 + groups * 2);
+        if (!group->xpoll)
+            bench_fatal("xpoll_create");
+
+        rc = xpoll_fd(group->xpoll);
+        if (rc == -1)
+            bench_fatal("xpoll_fd");
+
+        if (xpoll_ctl(xpoll, XPOLL_ADD, POLLIN, rc, group))
+            bench_fatal("xpoll_ctl");
+    }
+
+    for (int i = 0; i < nconns; ++i) {
+        struct conn *conn = connv + i;
+
+        if (pipe(conn->fd))
+            bench_fatal("pipe");
+
+        conn->group = groupv + i / pipes;
+
+        rc = xpoll_ctl(flat ? xpoll : conn->group->xpoll, XPOLL_ADD, POLLIN,
+                       conn->fd[0], conn);
+        if (rc)
+            bench_fatal("xpoll_ctl");
+    }
+
+    for (int i = 0; i < tokens; ++i) {
+        if (write(connv[(long)nconns * i / tokens].fd[1], "", 1) != 1)
+            bench_fatal("write");
+    }
+
+    if (warmup > 0)
+        loop(xpoll, flat, warmup);
+
+    nhops = nwaits = 0;
+
+    gettimeofday(&tv_start, NULL);
+    loop(xpoll, flat, secs);
+    gettimeofday(&tv_stop, NULL);
+
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"layout\": \"%s\", \"groups\": %d, "
+               "\"pipes\": %d, \"tokens\": %d, \"secs\": %.3lf, "
+               "\"hops\": %lu, \"hops_per_sec\": %.2lf, "
+               "\"waits_per_hop\": %.3lf }\n",
+               mechanism, flat ? "flat" : "nested", groups, pipes, tokens,
+               elapsed, nhops, nhops / elapsed,
+               nhops ? (double)nwaits / nhops : 0);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,layout,groups,pipes,tokens,secs,hops,hops_per_sec,"
+               "waits_per_hop\n");
+        printf("%s,%s,%d,%d,%d,%.3lf,%lu,%.2lf,%.3lf\n",
+               mechanism, flat ? "flat" : "nested", groups, pipes, tokens,
+               elapsed, nhops, nhops / elapsed,
+               nhops ? (double)nwaits / nhops : 0);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12s  layout\n", flat ? "flat" : "nested");
+        printf("%12d  groups\n", groups);
+        printf("%12d  pipes/group\n", pipes);
+        printf("%12d  tokens\n", tokens);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  total hops\n", nhops);
+        printf("%12.2lf  hops/sec\n", nhops / elapsed);
+        printf("%12.3lf  xpoll_wait calls/hop\n",
+               nhops ? (double)nwaits / nhops : 0);
+    }
+
+    for (int i = 0; i < nconns; ++i) {
+        close(connv[i].fd[0]);
+        close(connv[i].fd[1]);
+    }
+
+    for (int i = 0; i < groups; ++i) {
+        if (groupv[i].xpoll) {
+            xpoll_ctl(xpoll, XPOLL_DELETE, POLLIN, xpoll_fd(groupv[i].xpoll),
+                      groupv + i);
+            xpoll_destroy(groupv[i].xpoll);
+        }
+    }
+
+    xpoll_destroy(xpoll);
+    free(groupv);
+    free(connv);
+
+    return 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * relay is a loopback TCP proxy benchmark.  A source thread writes as
+ * fast as it can into each of -c connections, a proxy thread relays
+ * each connection to a second connection via xpoll_relay_event(), and
+ * a sink thread reads and discards everything that arrives.  Each
+ * thread runs its own xpoll event loop.
+ *
+ * By default the proxy moves bytes with splice(2) such that they never
+ * enter user space, whereas with -C it copies them through a user
+ * buffer with read(2) and write(2) as a conventional proxy would.  The
+ * proxy thread's CPU time per GiB relayed shows the cost of the copy.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct worker {
+    pthread_t tid;
+    struct xpoll *xpoll;
+    int nconns;
+    int *fdv;
+    struct xpoll_relay *relayv;
+
+    /* Statistics, reset at the start of the measured run. */
+    uint64_t nbytes;
+    struct bench_cpu cpu;
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+
+size_t bufsz;
+size_t msgsz;
+int flags;
+int fdmax;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-C] [-b bufsz] [-c conns] [-d secs] [-m msgsz] "
+           "[-o fmt] [-w secs]\n", progname);
+    printf("-b bufsz     relay pipe/buffer size per direction (default: 65536)\n");
+    printf("-C           copy through user space rather than splice\n");
+    printf("-c conns     number of relayed connections (default: 1)\n");
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-h           print this help list\n");
+    printf("-m msgsz     source write size in bytes (default: 65536)\n");
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+}
+
+static void *
+source_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    char *buf;
+
+    buf = calloc(1, msgsz);
+    if (!buf)
+        exit(EX_OSERR);
+
+    while (phase < 2) {
+        void *data;
+        int revents;
+
+        if (bench_cpu_phase(&worker->cpu, phase))
+            worker->nbytes = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, &data))) {
+            int fd = (int)(intptr_t)data;
+            ssize_t cc;
+
+            cc = write(fd, buf, msgsz);
+            if (cc == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                    continue;
+                fprintf(stderr, "%s: source fd %d: %s\n", progname, fd, strerror(errno));
+                exit(EX_OSERR);
+            }
+
+            worker->nbytes += cc;
+        }
+    }
+
+    bench_cpu_done(&worker->cpu);
+    free(buf);
+
+    return NULL;
+}
+
+static void *
+proxy_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+
+    while (phase < 2) {
+        struct xpoll_relay_end *end;
+        int revents;
+
+        if (bench_cpu_phase(&worker->cpu, phase))
+            worker->nbytes = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, (void **)&end))) {
+            if (xpoll_relay_event(xpoll, end, revents)) {
+                fprintf(stderr, "%s: relay fd %d: %s\n",
+                        progname, end->fd, strerror(errno));
+                exit(EX_OSERR);
+            }
+        }
+    }
+
+    bench_cpu_done(&worker->cpu);
+
+    return NULL;
+}
+
+static void *
+sink_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    char *buf;
+
+    buf = malloc(msgsz);
+    if (!buf)
+        exit(EX_OSERR);
+
+    while (phase < 2) {
+        void *data;
+        int revents;
+
+        if (bench_cpu_phase(&worker->cpu, phase))
+            worker->nbytes = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, &data))) {
+            int fd = (int)(intptr_t)data;
+            ssize_t cc;
+
+            cc = read(fd, buf, msgsz);
+            if (cc < 1) {
+                if (cc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    continue;
+                fprintf(stderr, "%s: sink fd %d: %s\n", progname, fd,
+                        cc ? strerror(errno) : "EOF");
+                exit(EX_OSERR);
+            }
+
+            worker->nbytes += cc;
+        }
+    }
+
+    bench_cpu_done(&worker->cpu);
+    free(buf);
+
+    return NULL;
+}
+
+static void
+worker_init(struct worker *worker)
+{
+    memset(worker, 0, sizeof(*worker));
+
+    worker->xpoll = xpoll_create(fdmax);
+    if (!worker->xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+static void
+worker_fini(struct worker *worker)
+{
+    xpoll_destroy(worker->xpoll);
+    worker->xpoll = NULL;
+}
+
+static void
+worker_add(struct worker *worker, int fd, int events)
+{
+    if (xpoll_ctl(worker->xpoll, XPOLL_ADD, events, fd, (void *)(intptr_t)fd)) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n", progname, fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct worker source, proxy, sink;
+    struct xpoll_relay *relayv;
+    struct sockaddr_in sin;
+    u_int warmup, secs;
+    const char *fmt;
+    double elapsed, gib, cpu;
+    int conns, lfd;
+    int rc, i;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    bufsz = 64 * 1024;
+    msgsz = 64 * 1024;
+    conns = 1;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":b:Cc:d:hm:o:w:"))) {
+        switch (rc) {
+        case 'b':
+            bufsz = bench_getnum(rc, optarg, 4096, 64 * 1024 * 1024);
+            break;
+
+        case 'C':
+            flags |= XPOLL_RELAY_COPY;
+            break;
+
+        case 'c':
+            conns = bench_getnum(rc, optarg, 1, 100000);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 64 * 1024 * 1024);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /*
+     * Each relayed connection consumes four sockets and two pipes (i.e.,
+     * eight fds), plus a few for stdio et al.
+     */
+    fdmax = conns * 8 + 16;
+
+    lfd = net_listen(&sin, SOMAXCONN);
+
+    worker_init(&source);
+    worker_init(&proxy);
+    worker_init(&sink);
+
+    relayv = calloc(conns, sizeof(*relayv));
+    if (!relayv)
+        exit(EX_OSERR);
+
+    for (i = 0; i < conns; ++i) {
+        int srcfd, pxyafd, pxybfd, sinkfd;
+
+        net_tcp_pair(lfd, &sin, fdmax, &srcfd, &pxyafd);
+        net_tcp_pair(lfd, &sin, fdmax, &pxybfd, &sinkfd);
+
+        worker_add(&source, srcfd, POLLOUT);
+        worker_add(&sink, sinkfd, POLLIN);
+
+        if (xpoll_relay_init(proxy.xpoll, relayv + i, pxyafd, pxybfd, bufsz, flags)) {
+            fprintf(stderr, "%s: xpoll_relay_init: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    close(lfd);
+
+    pthread_create(&sink.tid, NULL, sink_main, &sink);
+    pthread_create(&proxy.tid, NULL, proxy_main, &proxy);
+    pthread_create(&source.tid, NULL, source_main, &source);
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    pthread_join(source.tid, NULL);
+    pthread_join(proxy.tid, NULL);
+    pthread_join(sink.tid, NULL);
+
+    gib = sink.nbytes / (1024.0 * 1024 * 1024);
+    cpu = source.cpu.secs + proxy.cpu.secs + sink.cpu.secs;
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"mode\": \"%s\", \"connections\": %d, "
+               "\"bufsz\": %zu, \"msgsz\": %zu, \"secs\": %.3lf, "
+               "\"bytes\": %lu, \"GiBps\": %.3lf, \"proxy_cpu_per_GiB\": %.3lf, "
+               "\"total_cpu_per_GiB\": %.3lf }\n",
+               mechanism, (flags & XPOLL_RELAY_COPY) ? "copy" : "splice",
+               conns, bufsz, msgsz, elapsed, sink.nbytes, gib / elapsed,
+               gib > 0 ? proxy.cpu.secs / gib : 0, gib > 0 ? cpu / gib : 0);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,mode,connections,bufsz,msgsz,secs,bytes,GiBps,"
+               "proxy_cpu_per_GiB,total_cpu_per_GiB\n");
+        printf("%s,%s,%d,%zu,%zu,%.3lf,%lu,%.3lf,%.3lf,%.3lf\n",
+               mechanism, (flags & XPOLL_RELAY_COPY) ? "copy" : "splice",
+               conns, bufsz, msgsz, elapsed, sink.nbytes, gib / elapsed,
+               gib > 0 ? proxy.cpu.secs / gib : 0, gib > 0 ? cpu / gib : 0);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12s  relay mode\n", (flags & XPOLL_RELAY_COPY) ? "copy" : "splice");
+        printf("%12d  connections\n", conns);
+        printf("%12zu  relay buffer bytes\n", bufsz);
+        printf("%12zu  source write bytes\n", msgsz);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  bytes relayed\n", sink.nbytes);
+        printf("%12.3lf  GiB/sec\n", gib / elapsed);
+        printf("%12.3lf  proxy CPU secs/GiB\n", gib > 0 ? proxy.cpu.secs / gib : 0);
+        printf("%12.3lf  total CPU secs/GiB\n", gib > 0 ? cpu / gib : 0);
+    }
+
+    for (i = 0; i < conns; ++i)
+        xpoll_relay_fini(proxy.xpoll, relayv + i);
+    free(relayv);
+
+    worker_fini(&source);
+    worker_fini(&proxy);
+    worker_fini(&sink);
+
+    return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+
+/*
+ * udp is a loopback datagram throughput benchmark.  A sender thread
+ * writes fixed-size datagrams as fast as its socket will take them to
+ * a receiver thread, each of which runs its own xpoll event loop.
+ *
+ * With a batch size of one each datagram costs one send(2) and one
+ * recv(2), whereas larger batches use xpoll_dgram_flush() and
+ * xpoll_dgram_recv() to move up to batch datagrams per sendmmsg(2) or
+ * recvmmsg(2).  With -G the batches additionally use UDP GSO and GRO
+ * (where supported) such that runs of datagrams cross the loopback
+ * as a single large message.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+struct worker {
+    pthread_t tid;
+    struct xpoll *xpoll;
+    int fd;
+
+    /* Statistics, reset at the start of the measured run. */
+    uint64_t ndgrams;
+    uint64_t nbytes;
+    uint64_t ncalls;
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+
+size_t msgsz;
+u_int batch;
+int flags;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-G] [-b batch] [-d secs] [-m msgsz] [-o fmt] "
+           "[-w secs]\n", progname);
+    printf("-b batch     datagrams per system call (default: 32)\n");
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-G           use UDP GSO/GRO (requires -b > 1)\n");
+    printf("-h           print this help list\n");
+    printf("-m msgsz     datagram size in bytes (default: 64)\n");
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+}
+
+static void
+worker_reset(struct worker *worker, int *measuring)
+{
+    if (phase > 0 && !*measuring) {
+        worker->ndgrams = worker->nbytes = worker->ncalls = 0;
+        *measuring = 1;
+    }
+}
+
+static void *
+sender_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    struct xpoll_dgram dg;
+    int measuring = 0;
+    char *buf;
+
+    buf = calloc(1, msgsz);
+    if (!buf)
+        exit(EX_OSERR);
+
+    if (batch > 1 && xpoll_dgram_init(&dg, worker->fd, batch, msgsz, flags)) {
+        fprintf(stderr, "%s: xpoll_dgram_init: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    while (phase < 2) {
+        void *data;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while (xpoll_revents(xpoll, &data)) {
+            worker_reset(worker, &measuring);
+
+            if (batch == 1) {
+                ssize_t cc;
+
+                ++worker->ncalls;
+
+                cc = send(worker->fd, buf, msgsz, MSG_DONTWAIT);
+                if (cc == -1) {
+                    if (errno == EAGAIN || errno == EINTR || errno == ENOBUFS)
+                        continue;
+                    goto errout;
+                }
+
+                ++worker->ndgrams;
+                worker->nbytes += cc;
+                continue;
+            }
+
+            /*
+             * Every queued datagram references the same buffer, so
+             * the queue is refilled to capacity before each flush.
+             */
+            while (dg.txc < batch)
+                xpoll_dgram_queue(xpoll, &dg, buf, msgsz, NULL, 0);
+
+            ++worker->ncalls;
+
+            if (xpoll_dgram_flush(xpoll, &dg) == -1) {
+                if (errno != ECONNREFUSED)
+                    goto errout;
+            }
+
+            worker->ndgrams += batch - dg.txc;
+            worker->nbytes += (batch - dg.txc) * msgsz;
+            continue;
+
+          errout:
+            fprintf(stderr, "%s: send: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    if (batch > 1)
+        xpoll_dgram_fini(&dg);
+    free(buf);
+
+    return NULL;
+}
+
+static int
+receiver_dgram(void *buf, size_t len, struct sockaddr *addr,
+               socklen_t addrlen, void *arg)
+{
+    struct worker *worker = arg;
+
+    (void)buf;
+    (void)addr;
+    (void)addrlen;
+
+    ++worker->ndgrams;
+    worker->nbytes += len;
+
+    return 0;
+}
+
+static void *
+receiver_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    struct xpoll_dgram dg;
+    int measuring = 0;
+    size_t bufsz;
+    char *buf;
+    int rc;
+
+    /* GRO may deliver up to 64KiB of coalesced datagrams at once. */
+    bufsz = (flags & XPOLL_DGRAM_GRO) ? 64 * 1024 : msgsz;
+
+    buf = malloc(bufsz);
+    if (!buf)
+        exit(EX_OSERR);
+
+    if (batch > 1 && xpoll_dgram_init(&dg, worker->fd, batch, bufsz, flags)) {
+        fprintf(stderr, "%s: xpoll_dgram_init: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    while (phase < 2) {
+        void *data;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while (xpoll_revents(xpoll, &data)) {
+            worker_reset(worker, &measuring);
+
+            if (batch == 1) {
+                for (;;) {
+                    ssize_t cc;
+
+                    ++worker->ncalls;
+
+                    cc = recv(worker->fd, buf, bufsz, MSG_DONTWAIT);
+                    if (cc == -1) {
+                        if (errno == EINTR)
+                            continue;
+                        if (errno == EAGAIN || errno == EWOULDBLOCK)
+                            break;
+                        goto errout;
+                    }
+
+                    ++worker->ndgrams;
+                    worker->nbytes += cc;
+                }
+                continue;
+            }
+
+            rc = xpoll_dgram_recv(xpoll, &dg, receiver_dgram, worker);
+            if (rc == -1)
+                goto errout;
+
+            /*
+             * xpoll_dgram_recv() doesn't report how many system calls
+             * it made, so estimate it from the number of full batches
+             * (plus the final EAGAIN).  This overestimates with GRO.
+             */
+            worker->ncalls += rc / batch + 1;
+            continue;
+
+          errout:
+            fprintf(stderr, "%s: recv: %s\n", progname, strerror(errno));
+            exit(EX_OSERR);
+        }
+    }
+
+    if (batch > 1)
+        xpoll_dgram_fini(&dg);
+    free(buf);
+
+    return NULL;
+}
+
+static void
+worker_init(struct worker *worker, int fd, int events)
+{
+    memset(worker, 0, sizeof(*worker));
+
+    worker->fd = fd;
+    worker->xpoll = xpoll_create(fd + 16);
+    if (!worker->xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (xpoll_ctl(worker->xpoll, XPOLL_ADD, events, fd, worker)) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n", progname, fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct worker sender, receiver;
+    struct sockaddr_in sin;
+    socklen_t sinlen;
+    u_int warmup, secs;
+    const char *fmt;
+    double elapsed, loss;
+    int sfd, rfd, gso;
+    int bufsz, rc;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    msgsz = 64;
+    batch = 32;
+    gso = 0;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":b:d:Ghm:o:w:"))) {
+        switch (rc) {
+        case 'b':
+            batch = bench_getnum(rc, optarg, 1, 1024);
+            break;
+
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'G':
+            gso = 1;
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 65507);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    if (gso && batch < 2) {
+        fprintf(stderr, "%s: -G requires a batch size greater than one\n", progname);
+        exit(EX_USAGE);
+    }
+
+    flags = gso ? XPOLL_DGRAM_GSO | XPOLL_DGRAM_GRO : 0;
+
+    rfd = socket(AF_INET, SOCK_DGRAM, 0);
+    sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (rfd == -1 || sfd == -1) {
+        fprintf(stderr, "%s: socket: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    bufsz = 4 * 1024 * 1024;
+    setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sinlen = sizeof(sin);
+
+    if (bind(rfd, (struct sockaddr *)&sin, sinlen) ||
+        getsockname(rfd, (struct sockaddr *)&sin, &sinlen) ||
+        connect(sfd, (struct sockaddr *)&sin, sinlen)) {
+        fprintf(stderr, "%s: bind/connect: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    worker_init(&sender, sfd, POLLOUT);
+    worker_init(&receiver, rfd, POLLIN);
+
+    pthread_create(&receiver.tid, NULL, receiver_main, &receiver);
+    pthread_create(&sender.tid, NULL, sender_main, &sender);
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    pthread_join(sender.tid, NULL);
+    pthread_join(receiver.tid, NULL);
+
+    /* Datagrams in flight at either phase boundary skew this slightly. */
+    loss = sender.ndgrams ? 100.0 * (1.0 - (double)receiver.ndgrams / sender.ndgrams) : 0;
+    if (loss < 0)
+        loss = 0;
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"msgsz\": %zu, \"batch\": %u, "
+               "\"gso\": %d, \"secs\": %.3lf, \"sent\": %lu, \"received\": %lu, "
+               "\"sent_pps\": %.2lf, \"received_pps\": %.2lf, \"MBps\": %.2lf, "
+               "\"loss_pct\": %.2lf, \"send_calls\": %lu, \"recv_calls\": %lu }\n",
+               mechanism, msgsz, batch, gso, elapsed,
+               sender.ndgrams, receiver.ndgrams,
+               sender.ndgrams / elapsed, receiver.ndgrams / elapsed,
+               receiver.nbytes / elapsed / (1024 * 1024), loss,
+               sender.ncalls, receiver.ncalls);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,msgsz,batch,gso,secs,sent,received,sent_pps,"
+               "received_pps,MBps,loss_pct,send_calls,recv_calls\n");
+        printf("%s,%zu,%u,%d,%.3lf,%lu,%lu,%.2lf,%.2lf,%.2lf,%.2lf,%lu,%lu\n",
+               mechanism, msgsz, batch, gso, elapsed,
+               sender.ndgrams, receiver.ndgrams,
+               sender.ndgrams / elapsed, receiver.ndgrams / elapsed,
+               receiver.nbytes / elapsed / (1024 * 1024), loss,
+               sender.ncalls, receiver.ncalls);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12zu  datagram bytes\n", msgsz);
+        printf("%12u  datagrams per batch\n", batch);
+        printf("%12s  GSO/GRO\n", gso ? "yes" : "no");
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  datagrams sent\n", sender.ndgrams);
+        printf("%12lu  datagrams received\n", receiver.ndgrams);
+        printf("%12.2lf  sent/sec\n", sender.ndgrams / elapsed);
+        printf("%12.2lf  received/sec\n", receiver.ndgrams / elapsed);
+        printf("%12.2lf  received MiB/sec\n", receiver.nbytes / elapsed / (1024 * 1024));
+        printf("%12.2lf  loss (%%)\n", loss);
+        printf("%12.2lf  datagrams per send call\n",
+               sender.ncalls ? (double)sender.ndgrams / sender.ncalls : 0);
+        printf("%12.2lf  datagrams per recv call\n",
+               receiver.ncalls ? (double)receiver.ndgrams / receiver.ncalls : 0);
+    }
+
+    xpoll_destroy(sender.xpoll);
+    xpoll_destroy(receiver.xpoll);
+    close(sfd);
+    close(rfd);
+
+    return 0;
+}
@@ -0,0 +1,456 @@
+/*
+ * Copyright (c) 2017 Greg Becker.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ *
+ * Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sysexits.h>
+
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "xpoll.h"
+#include "bench.h"
+#include "net.h"
+
+/*
+ * zerocopy is a loopback TCP bulk transfer benchmark.  A sender thread
+ * streams large messages from a small pool of buffers to a receiver
+ * thread, which reads and discards them.  Each thread runs its own
+ * xpoll event loop.
+ *
+ * With -Z the sender uses xpoll_zc_send(), so that a buffer remains
+ * owned by the kernel until its completion arrives on the socket's
+ * error queue (signaled by POLLERR) and xpoll_zc_complete() releases
+ * it.  While every buffer is in flight POLLOUT is disabled, such that
+ * the sender sleeps until a completion frees one.
+ *
+ * Note that Linux always copies MSG_ZEROCOPY sends delivered to a local
+ * socket (reported here as the copied fraction), so over loopback this
+ * measures the overhead of the notification machinery rather than the
+ * savings achievable on a real NIC.
+ */
+
+#if XPOLL_EPOLL
+const char *mechanism = "epoll";
+#elif XPOLL_KQUEUE
+const char *mechanism = "kqueue";
+#else
+const char *mechanism = "poll";
+#endif
+
+/*
+ * A send buffer is busy from the time it is first sent until each send
+ * from it has been released, during which its offset only advances.
+ */
+struct sbuf {
+    size_t off;
+    int refs;
+    char *data;
+};
+
+struct worker {
+    pthread_t tid;
+    struct xpoll *xpoll;
+    int fd;
+
+    /* Statistics, reset at the start of the measured run. */
+    uint64_t nbytes;
+    uint64_t nsends;
+    unsigned long ncompleted;
+    unsigned long ncopied;
+    struct bench_cpu cpu;
+};
+
+volatile int phase;         // 0: warmup, 1: measuring, 2: done
+
+size_t msgsz;
+int nbufs;
+int zerocopy;
+char *progname;
+
+static void
+usage(void)
+{
+    printf("usage: %s [-Z] [-d secs] [-m msgsz] [-n nbufs] [-o fmt] "
+           "[-w secs]\n", progname);
+    printf("-d secs      duration of the measured run (default: 10)\n");
+    printf("-h           print this help list\n");
+    printf("-m msgsz     message size in bytes (default: 1048576)\n");
+    printf("-n nbufs     number of send buffers (default: 8)\n");
+    printf("-o fmt       output format: text, json, or csv (default: text)\n");
+    printf("-w secs      duration of the unmeasured warmup (default: 1)\n");
+    printf("-Z           send with MSG_ZEROCOPY\n");
+}
+
+/*
+ * Called by xpoll_zc_send() or xpoll_zc_complete() once the kernel no
+ * longer needs the buffer for a given send.
+ */
+static void
+sender_release(void *cookie, void *arg)
+{
+    struct sbuf *sbuf = cookie;
+
+    (void)arg;
+
+    if (--sbuf->refs == 0 && sbuf->off == msgsz)
+        sbuf->off = 0;
+}
+
+static void
+sender_pollout(struct xpoll *xpoll, int fd, int enable)
+{
+    if (xpoll_ctl(xpoll, enable ? XPOLL_ENABLE : XPOLL_DISABLE, POLLOUT, fd, NULL)) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n", progname, fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+static void *
+sender_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    struct sbuf *sbufv, *cur;
+    struct xpoll_zc zc;
+    int pollout = 1;
+    int nobufs = 0;
+    int i;
+
+    sbufv = calloc(nbufs, sizeof(*sbufv));
+    if (!sbufv)
+        exit(EX_OSERR);
+
+    for (i = 0; i < nbufs; ++i) {
+        sbufv[i].data = malloc(msgsz);
+        if (!sbufv[i].data)
+            exit(EX_OSERR);
+        memset(sbufv[i].data, i, msgsz);
+    }
+
+    cur = sbufv;
+
+    if (xpoll_zc_init(&zc, worker->fd, nbufs * 64, sender_release, NULL)) {
+        fprintf(stderr, "%s: xpoll_zc_init: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (!zerocopy)
+        zc.enabled = 0;
+    else if (!zc.enabled)
+        fprintf(stderr, "%s: SO_ZEROCOPY not supported, sending normally\n", progname);
+
+    while (phase < 2) {
+        void *data;
+        int revents;
+
+        if (bench_cpu_phase(&worker->cpu, phase))
+            worker->nbytes = worker->nsends = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, &data))) {
+            if (revents & POLLERR) {
+                int n = xpoll_zc_complete(xpoll, &zc);
+
+                if (n == -1) {
+                    fprintf(stderr, "%s: xpoll_zc_complete: %s\n",
+                            progname, strerror(errno));
+                    exit(EX_OSERR);
+                }
+
+                if (n > 0)
+                    nobufs = 0;
+            }
+
+            /*
+             * Send from the buffers in turn until the socket is full or
+             * the next buffer is still in flight.
+             */
+            while ((revents & POLLOUT) && !nobufs && cur->off < msgsz) {
+                ssize_t cc;
+
+                ++cur->refs;
+
+                cc = xpoll_zc_send(xpoll, &zc, cur->data + cur->off,
+                                   msgsz - cur->off, cur);
+                if (cc == -1) {
+                    --cur->refs;
+
+                    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                        break;
+
+                    /* Too much memory pinned, wait for completions. */
+                    if (errno == ENOBUFS) {
+                        nobufs = 1;
+                        break;
+                    }
+
+                    fprintf(stderr, "%s: send: %s\n", progname, strerror(errno));
+                    exit(EX_OSERR);
+                }
+
+                ++worker->nsends;
+                worker->nbytes += cc;
+                cur->off += cc;
+
+                if (cur->off < msgsz)
+                    continue;
+
+                /* Without zerocopy each send was released on return. */
+                if (cur->refs == 0)
+                    cur->off = 0;
+
+                cur = sbufv + ((cur - sbufv + 1) % nbufs);
+            }
+
+            /* Sleep until a completion frees the next buffer. */
+            if (pollout != (!nobufs && cur->off < msgsz)) {
+                pollout = !pollout;
+                sender_pollout(xpoll, worker->fd, pollout);
+            }
+        }
+    }
+
+    worker->ncompleted = zc.ncompleted;
+    worker->ncopied = zc.ncopied;
+    bench_cpu_done(&worker->cpu);
+
+    return NULL;
+}
+
+static void *
+receiver_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct xpoll *xpoll = worker->xpoll;
+    size_t bufsz;
+    char *buf;
+
+    bufsz = 256 * 1024;
+    buf = malloc(bufsz);
+    if (!buf)
+        exit(EX_OSERR);
+
+    while (phase < 2) {
+        void *data;
+        int revents;
+
+        if (bench_cpu_phase(&worker->cpu, phase))
+            worker->nbytes = worker->nsends = 0;
+
+        if (xpoll_wait(xpoll, 100) < 1)
+            continue;
+
+        while ((revents = xpoll_revents(xpoll, &data))) {
+            ssize_t cc;
+
+            cc = read(worker->fd, buf, bufsz);
+            if (cc < 1) {
+                if (cc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                    continue;
+                fprintf(stderr, "%s: receiver: %s\n", progname,
+                        cc ? strerror(errno) : "EOF");
+                exit(EX_OSERR);
+            }
+
+            worker->nbytes += cc;
+        }
+    }
+
+    bench_cpu_done(&worker->cpu);
+    free(buf);
+
+    return NULL;
+}
+
+static void
+worker_init(struct worker *worker, int fd, int events)
+{
+    memset(worker, 0, sizeof(*worker));
+
+    worker->fd = fd;
+    worker->xpoll = xpoll_create(fd + 16);
+    if (!worker->xpoll) {
+        fprintf(stderr, "%s: xpoll_create: %s\n", progname, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    if (xpoll_ctl(worker->xpoll, XPOLL_ADD, events, fd, NULL)) {
+        fprintf(stderr, "%s: xpoll_ctl(%d): %s\n", progname, fd, strerror(errno));
+        exit(EX_OSERR);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct timeval tv_start, tv_stop, tv_diff;
+    struct worker sender, receiver;
+    struct sockaddr_in sin;
+    u_int warmup, secs;
+    const char *fmt;
+    double elapsed, gib, copied;
+    int lfd, cfd, sfd;
+    int rc;
+
+    progname = strrchr(argv[0], '/');
+    progname = progname ? progname + 1 : argv[0];
+
+    fmt = "text";
+    msgsz = 1024 * 1024;
+    nbufs = 8;
+    warmup = 1;
+    secs = 10;
+
+    while (-1 != (rc = getopt(argc, argv, ":d:hm:n:o:w:Z"))) {
+        switch (rc) {
+        case 'd':
+            secs = bench_getnum(rc, optarg, 1, 86400);
+            break;
+
+        case 'h':
+            usage();
+            exit(0);
+
+        case 'm':
+            msgsz = bench_getnum(rc, optarg, 1, 1024 * 1024 * 1024);
+            break;
+
+        case 'n':
+            nbufs = bench_getnum(rc, optarg, 1, 4096);
+            break;
+
+        case 'o':
+            fmt = optarg;
+            if (strcmp(fmt, "text") && strcmp(fmt, "json") && strcmp(fmt, "csv")) {
+                fprintf(stderr, "%s: invalid output format '%s'\n", progname, fmt);
+                exit(EX_USAGE);
+            }
+            break;
+
+        case 'w':
+            warmup = bench_getnum(rc, optarg, 0, 86400);
+            break;
+
+        case 'Z':
+            zerocopy = 1;
+            break;
+
+        case ':':
+            fprintf(stderr, "%s: option -%c requires an argument\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+
+        default:
+            fprintf(stderr, "%s: invalid option -%c, use -h for help\n",
+                    progname, optopt);
+            exit(EX_USAGE);
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    lfd = net_listen(&sin, 1);
+
+    net_tcp_pair(lfd, &sin, INT_MAX, &cfd, &sfd);
+    close(lfd);
+
+    /* POLLERR signals zerocopy completions on the sender's socket. */
+    worker_init(&sender, cfd, POLLOUT | POLLERR);
+    worker_init(&receiver, sfd, POLLIN);
+
+    pthread_create(&receiver.tid, NULL, receiver_main, &receiver);
+    pthread_create(&sender.tid, NULL, sender_main, &sender);
+
+    sleep(warmup);
+
+    phase = 1;
+    gettimeofday(&tv_start, NULL);
+
+    sleep(secs);
+
+    phase = 2;
+    gettimeofday(&tv_stop, NULL);
+    timersub(&tv_stop, &tv_start, &tv_diff);
+    elapsed = bench_tv2sec(&tv_diff);
+
+    pthread_join(sender.tid, NULL);
+    pthread_join(receiver.tid, NULL);
+
+    gib = receiver.nbytes / (1024.0 * 1024 * 1024);
+    copied = sender.ncompleted ? 100.0 * sender.ncopied / sender.ncompleted : 0;
+
+    if (!strcmp(fmt, "json")) {
+        printf("{ \"mechanism\": \"%s\", \"mode\": \"%s\", \"msgsz\": %zu, "
+               "\"nbufs\": %d, \"secs\": %.3lf, \"bytes\": %lu, \"sends\": %lu, "
+               "\"GiBps\": %.3lf, \"sender_cpu_per_GiB\": %.3lf, "
+               "\"receiver_cpu_per_GiB\": %.3lf, \"copied_pct\": %.2lf }\n",
+               mechanism, zerocopy ? "zerocopy" : "copy", msgsz, nbufs,
+               elapsed, receiver.nbytes, sender.nsends, gib / elapsed,
+               gib > 0 ? sender.cpu.secs / gib : 0, gib > 0 ? receiver.cpu.secs / gib : 0,
+               copied);
+    }
+    else if (!strcmp(fmt, "csv")) {
+        printf("mechanism,mode,msgsz,nbufs,secs,bytes,sends,GiBps,"
+               "sender_cpu_per_GiB,receiver_cpu_per_GiB,copied_pct\n");
+        printf("%s,%s,%zu,%d,%.3lf,%lu,%lu,%.3lf,%.3lf,%.3lf,%.2lf\n",
+               mechanism, zerocopy ? "zerocopy" : "copy", msgsz, nbufs,
+               elapsed, receiver.nbytes, sender.nsends, gib / elapsed,
+               gib > 0 ? sender.cpu.secs / gib : 0, gib > 0 ? receiver.cpu.secs / gib : 0,
+               copied);
+    }
+    else {
+        printf("%12s  mechanism\n", mechanism);
+        printf("%12s  send mode\n", zerocopy ? "zerocopy" : "copy");
+        printf("%12zu  message bytes\n", msgsz);
+        printf("%12d  send buffers\n", nbufs);
+        printf("%12.3lf  total run time\n", elapsed);
+        printf("%12lu  bytes received\n", receiver.nbytes);
+        printf("%12lu  send calls\n", sender.nsends);
+        printf("%12.3lf  GiB/sec\n", gib / elapsed);
+        printf("%12.3lf  sender CPU secs/GiB\n", gib > 0 ? sender.cpu.secs / gib : 0);
+        printf("%12.3lf  receiver CPU secs/GiB\n", gib > 0 ? receiver.cpu.secs / gib : 0);
+        if (zerocopy)
+            printf("%12.2lf  completions copied (%%)\n", copied);
+    }
+
+    return 0;
+}